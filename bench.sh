@@ -0,0 +1,67 @@
+#!/bin/sh
+# Times a dry run of dedupe over a synthetic tree and reports each phase.
+#
+# BENCH_DIR      where the tree is generated, /tmp/dedupe-bench by default
+# BENCH_TREE     options for gentree, see ./gentree -h
+# BENCH_OPTIONS  options for dedupe, on top of --dry-run and --stats-json
+# BENCH_RUNS     number of runs over the same tree, 3 by default
+# BENCH_COLD     when set, drops the page cache before each run (needs root)
+
+set -e
+
+dir=${BENCH_DIR:-/tmp/dedupe-bench}
+runs=${BENCH_RUNS:-3}
+stats="$dir.stats"
+
+# The tree is only generated again when its parameters change, and only a
+# directory that gentree wrote is ever deleted.
+if [ ! -d "$dir" ] || [ "$(cat "$dir.params" 2>/dev/null)" != "$BENCH_TREE" ]; then
+	if [ -e "$dir" ] && [ ! -f "$dir/.gentree" ]; then
+		echo "$dir: not a tree written by gentree, refusing to replace it" >&2
+		exit 1
+	fi
+
+	rm -rf "$dir"
+	./gentree $BENCH_TREE "$dir"
+	printf '%s' "$BENCH_TREE" > "$dir.params"
+fi
+
+run=1
+while [ "$run" -le "$runs" ]; do
+	if [ -n "$BENCH_COLD" ]; then
+		sync
+		echo 3 > /proc/sys/vm/drop_caches
+	fi
+
+	./dedupe --dry-run $BENCH_OPTIONS --stats-json "$stats" "$dir"
+
+	echo "Run $run:"
+	awk '
+		function field(name,    found) {
+			if (!match($0, "\"" name "\":(\"[^\"]*\"|[^,}]*)"))
+				return ""
+			found = substr($0, RSTART + length(name) + 3, RLENGTH - length(name) - 3)
+			gsub(/"/, "", found)
+			return found
+		}
+
+		/"type":"phase"/ {
+			seconds = field("seconds")
+			rate = seconds > 0 ? field("items") / seconds : 0
+			printf "  %-14s %10.3f s %12.0f items/s %10.1f MB/s\n", field("name"), seconds, rate,
+				field("read_bytes_per_second") / 1000000
+		}
+
+		/"type":"summary"/ {
+			seconds = field("seconds")
+			rate = seconds > 0 ? field("files") / seconds : 0
+			bandwidth = seconds > 0 ? field("hashed_bytes") / seconds / 1000000 : 0
+			printf "  %-14s %10.3f s %12.0f files/s %10.1f MB/s %8.1f MB peak RSS\n", "total", seconds, rate,
+				bandwidth, field("max_rss_bytes") / 1000000
+		}
+	' "$stats"
+
+	run=$((run + 1))
+done
+
+rm -f "$stats"
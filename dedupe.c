@@ -1,7 +1,15 @@
 #include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
 #include <sys/mman.h>
+#include <sys/resource.h>
 #ifdef __linux__
 #include <sys/random.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <endian.h>
 #endif
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -10,6 +18,11 @@
 #endif
 #ifdef __FreeBSD__
 #include <sys/extattr.h>
+#include <sys/event.h>
+#include <sys/endian.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
 #endif
 #include <fcntl.h>
 #include <dirent.h>
@@ -19,17 +32,158 @@
 #ifdef __linux__
 #include <alloca.h>
 #endif
+#include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <fnmatch.h>
+#include <limits.h>
 #include <getopt.h>
 #include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
 #include <talloc.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
 #ifdef __FreeBSD__
 #include <sha256.h>
 #else
 #include <openssl/sha.h>
 #endif
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__FreeBSD__)
+#include <cpuid.h>
+#define HAVE_SHA256_BATCH
+#endif
+#ifdef HAVE_BLAKE3
+#include <blake3.h>
+#endif
+#ifdef HAVE_XXHASH
+#define XXH_STATIC_LINKING_ONLY
+#include <xxhash.h>
+#endif
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#endif
+
+#define DIGEST_MAX_LENGTH 32
+#define DIGEST_BATCH 16
+
+#define URING_ENTRIES 64
+#define URING_BUFFERS 8
+#define URING_BUFFER_SIZE 0x100000
+
+#define READ_BUFFER_SIZE 0x100000
+#define READ_ALIGNMENT 4096
+
+#define SMALL_FILE_SIZE (READ_BUFFER_SIZE / DIGEST_BATCH)
+
+#define WATCH_DELAY 2
+
+#define SNAPSHOT_EXPIRY (7 * 24 * 3600)
+
+#define CHECKPOINT_INTERVAL 60
+
+#define DEDUPE_RANGE_LENGTH 0x1000000
+
+#define BLOCK_DIGEST_LENGTH 16
+#define BLOCK_FDS 256
+
+#define DIR_FDS 64
+
+#define TRACE_BUCKETS 40
+
+#define PATTERN_STATES 1024
+
+// Times the call in expr when tracing, and marks it for USDT probes.
+#define TRACE(point, expr) ({ \
+	unsigned long long trace_start = trace_begin(point); \
+	__typeof__(expr) trace_result = (expr); \
+	trace_end(point, trace_start); \
+	trace_result; \
+})
+
+// Also counts the call for the --stats-json summary, tracing or not.
+#define TRACE_COUNT(counter, point, expr) ({ \
+	__atomic_add_fetch(&(counter), 1, __ATOMIC_RELAXED); \
+	TRACE(point, expr); \
+})
+
+#define SPILL_BUFFER_SIZE 0x4000000
+#define SPILL_STREAM_SIZE 0x10000
+#define SPILL_BATCH 4096
+#define SPILL_FANIN 256
+#define SPILL_GROUP (SPILL_BUFFER_SIZE / sizeof(struct spill_record))
+
+#if defined(__linux__)
+#define XATTR_PREFIX "user."
+#else
+#define XATTR_PREFIX ""
+#endif
+
+// A token bucket, refilled at rate per second.
+struct throttle
+{
+	double rate;
+	double tokens;
+	double last;
+};
+
+enum trace_point
+{
+	TRACE_READDIR,
+	TRACE_FSTATAT,
+	TRACE_EXCLUDE,
+	TRACE_REHASH,
+	TRACE_OPEN,
+	TRACE_MMAP,
+	TRACE_READ,
+	TRACE_LINK,
+	TRACE_POINTS
+};
+
+// Calls and their latencies in power-of-two buckets of nanoseconds, kept
+// across threads with relaxed atomics.
+struct trace_counter
+{
+	unsigned long long count;
+	unsigned long long total;
+	unsigned long long max;
+	unsigned long long buckets[TRACE_BUCKETS];
+};
+
+// Patterns compiled once for matching names: literal names and "*suffix"
+// patterns are looked up in hash sets, other globs run through one combined
+// DFA over byte classes. Patterns with a slash are matched against the whole
+// path with fnmatch, as are globs the DFA can't express.
+struct pattern_set
+{
+	struct hash_map* literals;
+	struct hash_map* suffixes;
+	size_t suffix_length_count;
+	size_t* suffix_lengths;
+
+	size_t state_count;
+	size_t class_count;
+	unsigned char classes[256];
+	unsigned short* transitions;
+	bool* accepting;
+
+	size_t glob_count;
+	char** globs;
+	size_t path_count;
+	char** paths;
+};
+
+// One step of a glob: either a star or a set of bytes.
+struct pattern_element
+{
+	bool star;
+	unsigned char bytes[32];
+};
 
 struct dedupe_state
 {
@@ -38,38 +192,178 @@ struct dedupe_state
 	bool dryrun;
 	bool interactive;
 	bool xattrs;
+	unsigned int jobs;
+	bool uring;
+	size_t prefilter;
+	bool compare;
+	const struct digest_descriptor* digest;
+	bool digest_batch;
+	const struct relink_descriptor* method;
+	const struct order_descriptor* order;
+	const struct read_descriptor* reader;
+	bool prefilter_only;
+	size_t blocks;
+	off_t min_size;
+	off_t max_size;
+	unsigned long long min_savings;
+	struct throttle bandwidth;
+	struct throttle iops;
+	char* xattr_hash;
+	char* xattr_mtime;
+
+	char* stats_path;
+	FILE* stats;
+	double stats_start;
+	double stats_time;
+	unsigned long long stats_read_size;
+	unsigned long long stats_read_count;
+	unsigned long long stats_stat_count;
+	unsigned long long stats_open_count;
+	unsigned long long stats_link_count;
+	size_t file_count;
+	size_t inode_count;
+	unsigned long long read_size;
+	unsigned long long read_count;
+	unsigned long long stat_count;
+	unsigned long long open_count;
+	unsigned long long link_count;
+	unsigned long long cached_size;
+	size_t digested_count;
+	unsigned long long digested_size;
+
+	char* index_path;
+	void* index_map;
+	size_t index_map_size;
+	size_t index_count;
+	const struct index_record* index_records;
+
+	char* snapshot_path;
+	void* snapshot_map;
+	size_t snapshot_map_size;
+	size_t snapshot_count;
+	const struct snapshot_dir* snapshot_dirs;
+	const unsigned char* snapshot_blob;
+	unsigned long long snapshot_blob_size;
+	unsigned long long snapshot_excludes;
+	time_t snapshot_time;
+	size_t snapshot_file_count;
+	FILE** snapshot_files;
+	size_t snapshot_new_count;
+	struct snapshot_pending* snapshot_new;
+
+	char* checkpoint_path;
+	bool resume;
+	bool checkpoint_snapshot;
+	FILE* checkpoint;
+	double checkpoint_time;
+	size_t checkpoint_count;
+	const struct index_record* checkpoint_records;
+	size_t checkpoint_pending_count;
+	size_t checkpoint_pending_capacity;
+	struct index_record* checkpoint_pending;
+
+	bool watch;
+	bool trace;
+	bool watch_failed;
+	int watch_fd;
+	struct hash_map* watch_lookup;
+	size_t watch_count;
+	size_t watch_capacity;
+	struct watch_event** watch_events;
 
-	dev_t device;
 	size_t dircount;
 	char** dirs;
 
 	size_t xclcount;
 	char** exclude;
+	size_t inclcount;
+	char** include;
+	struct pattern_set* excludes;
+	struct pattern_set* includes;
 
 	bool tty;
 	int width;
 	time_t last;
 
-	struct hash_map* inode_lookup;
-	struct hash_map* size_lookup;
+	struct arena* arena;
+	size_t device_count;
+	struct device_entry** devices;
 
 	size_t tohash_count;
 	unsigned long long tohash_size;
 	struct inode_entry** tohash_list;
 
-	struct hash_map* hash_lookup;
+	size_t tocompare_count;
+	unsigned long long tocompare_size;
+	struct inode_entry** tocompare_list;
+
+	pthread_mutex_t lock;
+	bool (*process)(struct dedupe_state*, struct inode_entry*);
+	size_t process_count;
+	struct inode_entry** process_list;
+	size_t tohash_next;
+	size_t hashed_count;
+	unsigned long long hashed_size;
+	unsigned long long progress_size;
 
 	size_t tolink_count;
 	struct hash_bucket** tolink_list;
 
+	bool pipeline;
+	pthread_cond_t pipeline_cond;
+	bool pipeline_done;
+	size_t pipeline_group_count;
+	struct pipeline_group* pipeline_groups;
+	size_t pipeline_count;
+	size_t pipeline_capacity;
+	size_t pipeline_next;
+	struct hash_bucket* pipeline_queue;
+
+	char* manifest_path;
+	bool merge;
+
+	char* spill_path;
+	size_t spill_names_count;
+	FILE** spill_names;
+	struct spill_runs* spill_runs;
+	struct spill_runs* spill_digests;
+
 	size_t relinked_count;
 	unsigned long long relinked_size;
+
+	size_t shared_count;
+	unsigned long long shared_size;
+};
+
+// Hardlinks and shared extents can't cross file systems, so everything from
+// the inode lookup to the duplicate groups is kept apart for each device.
+struct device_entry
+{
+	dev_t dev;
+	struct hash_map* inode_lookup;
+	struct hash_map* size_lookup;
+	struct hash_map* hash_lookup;
+	struct hash_map* block_lookup;
+	struct hash_map* watch_dirs;
+	size_t tohash_count;
+};
+
+// The members of a size bucket on one device, as a run of tohash_list. Once
+// the last of them has been hashed, their duplicates can't change anymore.
+struct pipeline_group
+{
+	off_t size;
+	dev_t dev;
+	size_t start;
+	size_t count;
+	size_t remaining;
 };
 
 struct gather_state
 {
 	struct dedupe_state* state0;
 	size_t capacity;
+	size_t compare_capacity;
 };
 
 struct hash_map
@@ -77,7 +371,7 @@ struct hash_map
 	const struct hash_descriptor* descriptor;
 	size_t item_count;
 	size_t bucket_count;
-	struct hash_bucket** buckets;
+	struct hash_bucket* buckets;
 };
 
 struct hash_descriptor
@@ -86,61 +380,821 @@ struct hash_descriptor
 	bool (*equal_function)(void*, void*);
 };
 
+// Buckets live inline in an open-addressed table; a pointer returned by
+// hash_map_insert is only valid until the next insert into the same map.
 struct hash_bucket
 {
-	struct hash_bucket* next;
+	size_t hash;
 	void* key;
 	size_t dummy;
 	void* value;
 };
 
+union digest_context
+{
+	SHA256_CTX sha256;
+#ifdef HAVE_BLAKE3
+	blake3_hasher blake3;
+#endif
+#ifdef HAVE_XXHASH
+	XXH3_state_t xxh3;
+#endif
+};
+
+struct digest_descriptor
+{
+	const char* name;
+	size_t length;
+	bool cryptographic;
+	const char* xattr_suffix;
+	void (*init_function)(union digest_context*);
+	void (*update_function)(union digest_context*, const void*, size_t);
+	void (*final_function)(union digest_context*, unsigned char*);
+	void (*batch_function)(const unsigned char* const*, const size_t*, size_t, unsigned char**);
+};
+
+struct relink_descriptor
+{
+	const char* name;
+	bool verifies;
+	void (*link_function)(struct dedupe_state*, struct inode_entry**, size_t);
+};
+
+struct read_descriptor
+{
+	const char* name;
+	bool direct;
+	bool (*read_function)(struct dedupe_state*, int, const char*, off_t, void (*)(void*, const unsigned char*, size_t, off_t), void*);
+};
+
+struct order_descriptor
+{
+	const char* name;
+	void (*locate_function)(struct dedupe_state*, struct inode_entry*);
+	int (*sort_function)(const void*, const void*);
+};
+
 struct inode_entry
 {
 	struct inode_entry* next_by_size;
 	struct inode_entry* next_by_hash;
 
-	struct stat buffer;
-	unsigned char hash[SHA256_DIGEST_LENGTH];
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	nlink_t nlink;
+	blkcnt_t blocks;
+	unsigned long long physical;
+
+	unsigned char* hash;
+	bool hashed;
+	bool unverified;
+	bool stale;
+	bool cached;
 	struct path_entry* paths;
 };
 
 struct path_entry
 {
 	struct path_entry* next;
+	struct dir_entry* dir;
+	char name[];
+};
+
+struct dir_entry
+{
+	struct dir_entry* parent;
+	bool stale;
+	char name[];
+};
+
+// Scan records are never freed individually, so they are bump-allocated from
+// large blocks that go away with the arena itself.
+struct arena
+{
+	char* next;
+	size_t left;
+	pthread_mutex_t* lock;
+};
+
+#define ARENA_BLOCK_SIZE 0x100000
+
+struct dir_fd
+{
+	struct dir_entry* dir;
+	int fd;
+	unsigned long long used;
+};
+
+// Open directories, so that operations on many files in the same directories
+// resolve each directory's path once. Each thread has its own; the least
+// recently used one is closed to make room, so the last two opened are always
+// still valid.
+struct dir_cache
+{
+	unsigned long long tick;
+	struct dir_fd fds[DIR_FDS];
+};
+
+// A directory waiting to be scanned. It holds a reference on its parent, whose
+// stream stays open until every queued child has been opened relative to it.
+struct scan_item
+{
+	struct scan_item* parent;
+	struct dir_entry* dir;
+	dev_t device;
+	DIR* stream;
+	size_t refs;
 	char* path;
+	char name[];
+};
+
+struct scan_worker
+{
+	struct scan_pool* pool;
+	struct arena* arena;
+
+	pthread_mutex_t lock;
+	size_t head;
+	size_t count;
+	size_t capacity;
+	struct scan_item** items;
+
+	size_t batch_count;
+	struct
+	{
+		struct inode_entry* inode;
+		ino_t ino;
+	} batch[256];
+
+#ifdef HAVE_IO_URING
+	size_t statx_count;
+	struct
+	{
+		ino_t ino;
+		int result;
+		struct statx buffer;
+		char name[NAME_MAX + 1];
+	} statx[URING_ENTRIES];
+#endif
+
+	struct device_entry* device;
+
+	FILE* snapshot;
+	unsigned long long snapshot_size;
+	size_t snapshot_count;
+	size_t snapshot_capacity;
+	struct snapshot_pending* snapshot_dirs;
+
+	FILE* spill_names;
+	unsigned int spill_names_index;
+	unsigned long long spill_names_size;
+	size_t spill_count;
+	size_t spill_capacity;
+	struct spill_record* spill;
+};
+
+// A file as written to the sorted runs of --spill. Directories are few enough
+// to stay in memory, and since the runs are only ever read back by the same
+// process, a record simply points to its dir_entry. Names go to a separate
+// file per scan worker.
+struct spill_record
+{
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	struct dir_entry* dir;
+	unsigned long long name;
+	unsigned int names;
+};
+
+struct spill_digest
+{
+	unsigned char hash[DIGEST_MAX_LENGTH];
+	struct spill_record record;
+};
+
+struct spill_run
+{
+	unsigned long long offset;
+	size_t count;
+};
+
+// Sorted runs, all appended to one temporary file, so that the number of open
+// files doesn't grow with the number of runs. Writers reserve their range
+// under the lock and write it outside. Once a run can't be written or read in
+// full, failed is set and the run of dedupe stops.
+struct spill_runs
+{
+	size_t width;
+	int (*sort_function)(const void*, const void*);
+	FILE* file;
+	unsigned long long size;
+	size_t count;
+	struct spill_run* runs;
+	bool failed;
+};
+
+struct spill_stream
+{
+	int fd;
+	unsigned long long offset;
+	size_t left;
+	unsigned char* buffer;
+	size_t count;
+	size_t next;
+};
+
+// Merges sorted runs through a heap of streams ordered by their next record.
+struct spill_merge
+{
+	struct spill_runs* runs;
+	size_t count;
+	struct spill_stream* heap;
+};
+
+// Inodes being hashed together, with the records of their paths.
+struct spill_batch
+{
+	void* ctx;
+	size_t count;
+	size_t capacity;
+	struct inode_entry** inodes;
+	size_t* first;
+	size_t record_count;
+	size_t record_capacity;
+	struct spill_record* records;
+	unsigned long long size;
+
+	size_t digest_count;
+	size_t digest_capacity;
+	struct spill_digest* digests;
+};
+
+struct scan_pool
+{
+	struct dedupe_state* state;
+	unsigned int count;
+	struct scan_worker* workers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t pending;
+	size_t generation;
+};
+
+#ifdef HAVE_IO_URING
+struct uring
+{
+	int fd;
+
+	void* sq_ring;
+	size_t sq_ring_size;
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int tail;
+	unsigned int queued;
+
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+
+	void* cq_ring;
+	size_t cq_ring_size;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	struct io_uring_cqe* cqes;
+	unsigned int cq_mask;
+
+	bool registered;
+	unsigned char* buffers;
+};
+#endif
+
+// The index file is a header followed by records sorted by (dev, ino), in
+// host byte order.
+struct index_header
+{
+	char magic[8];
+	char digest[16];
+	unsigned long long record_size;
+	unsigned long long count;
+};
+
+struct index_record
+{
+	unsigned long long dev;
+	unsigned long long ino;
+	long long size;
+	long long mtime_sec;
+	long long mtime_nsec;
+	long long ctime_sec;
+	long long ctime_nsec;
+	unsigned char hash[DIGEST_MAX_LENGTH];
+};
+
+// The snapshot file is a header, the directory records sorted by (dev, ino)
+// and a blob holding the children of each directory, in host byte order. A
+// child is a snapshot_child followed by its name and, for regular files, by a
+// snapshot_file.
+struct snapshot_header
+{
+	char magic[8];
+	unsigned long long excludes;
+	unsigned long long count;
+	unsigned long long blob_size;
+};
+
+struct snapshot_dir
+{
+	unsigned long long dev;
+	unsigned long long ino;
+	long long mtime_sec;
+	long long mtime_nsec;
+	long long ctime_sec;
+	long long ctime_nsec;
+	long long scanned;
+	unsigned long long offset;
+	unsigned long long size;
+};
+
+struct snapshot_child
+{
+	unsigned short type;
+	unsigned short length;
+};
+
+struct snapshot_file
+{
+	unsigned long long d_ino;
+	unsigned long long dev;
+	unsigned long long ino;
+	long long size;
+	long long mtime_sec;
+	long long mtime_nsec;
+	long long ctime_sec;
+	long long ctime_nsec;
+	unsigned long long nlink;
+	unsigned long long blocks;
+};
+
+struct snapshot_pending
+{
+	struct snapshot_dir record;
+	struct dir_entry* dir;
+};
+
+// A file that changed while watching, waiting for WATCH_DELAY seconds without
+// further writes before it gets hashed.
+struct watch_event
+{
+	struct dir_entry* dir;
+	time_t time;
+	char name[];
+};
+
+#ifdef FIDEDUPERANGE
+// A block of a file, keyed by a prefix of its digest. Blocks are only ever
+// shared through FIDEDUPERANGE, which compares them first, so the prefix
+// doesn't need to be collision free.
+struct block_entry
+{
+	struct block_entry* next;
+	struct inode_entry* inode;
+	off_t offset;
+	unsigned char hash[BLOCK_DIGEST_LENGTH];
+};
+
+struct block_context
+{
+	struct dedupe_state* state;
+	const char* fpath;
+	unsigned long long reported;
+	union digest_context digest;
+	off_t offset;
+	size_t filled;
+	bool nonzero;
+	size_t count;
+	struct
+	{
+		off_t offset;
+		unsigned char hash[BLOCK_DIGEST_LENGTH];
+	}* blocks;
+};
+
+struct block_state
+{
+	struct dedupe_state* state0;
+	size_t capacity;
+	size_t count;
+	unsigned long long size;
+	struct inode_entry** list;
+
+	size_t bucket_capacity;
+	size_t bucket_count;
+	struct hash_bucket** buckets;
+
+	size_t range_capacity;
+	struct file_dedupe_range* range;
+	struct block_entry** targets;
+
+	struct block_fd* fds;
+	size_t next_fd;
+	size_t batch;
+};
+
+struct block_fd
+{
+	struct inode_entry* inode;
+	int fd;
+	size_t batch;
+};
+#endif
+
+// A manifest is a header followed by records sorted by size and digest. Unlike
+// the index and snapshot, it is meant to be merged on other hosts, so its
+// integers are little-endian and its structs have no padding.
+struct manifest_header
+{
+	char magic[8];
+	char digest[16];
+	char host[64];
+	unsigned long long count;
+};
+
+// Followed by path_count NUL-terminated paths, path_size bytes in all.
+struct manifest_record
+{
+	long long size;
+	unsigned char hash[DIGEST_MAX_LENGTH];
+	unsigned long long dev;
+	unsigned long long ino;
+	unsigned int path_count;
+	unsigned int path_size;
+};
+
+_Static_assert(sizeof(struct manifest_header) == 96 && sizeof(struct manifest_record) == 64, "manifest structs are padded");
+
+struct manifest_stream
+{
+	const char* path;
+	FILE* file;
+	struct manifest_header header;
+	unsigned long long left;
+	bool damaged;
+	struct manifest_record record;
+	size_t capacity;
+	char* paths;
+};
+
+struct manifest_entry
+{
+	const char* host;
+	struct manifest_record record;
+	char* paths;
+};
+
+struct index_save_state
+{
+	struct dedupe_state* state0;
+	size_t capacity;
+	size_t count;
+	struct index_record* records;
+};
+
+struct hash_context
+{
+	struct dedupe_state* state;
+	const char* fpath;
+	unsigned long long reported;
+	union digest_context digest;
 };
 
 static int parse_cmdline(struct dedupe_state*, int, char**);
 static void print_usage(const char*);
 static void check_terminal(struct dedupe_state*);
-static bool is_excluded(struct dedupe_state*, const char*);
-static void scan_directory(struct dedupe_state*, int, char*, char*);
+static bool is_excluded(struct dedupe_state*, struct dir_entry*, const char*);
+static struct pattern_set* pattern_compile(void*, char**, size_t);
+static bool pattern_parse(const char*, struct pattern_element*, size_t*);
+static void pattern_build(struct pattern_set*, char**, size_t);
+static void pattern_closure(const struct pattern_element*, const size_t*, size_t, unsigned long long*);
+static bool pattern_match(const struct pattern_set*, struct dir_entry*, const char*);
+static bool is_wanted(struct dedupe_state*, const struct inode_entry*);
+static void scan_all(struct dedupe_state*);
+static void* scan_worker(void*);
+static struct scan_item* scan_next(struct scan_worker*);
+static void scan_push(struct scan_worker*, struct scan_item*);
+static struct scan_item* scan_item_create(struct scan_item*, struct dir_entry*, const char*, const char*);
+static void scan_item_release(struct scan_item*);
+static void scan_directory(struct scan_worker*, struct scan_item*);
+static void scan_snapshot(struct scan_worker*, struct scan_item*, int, struct dir_entry*, const struct snapshot_dir*);
+static void scan_regular(struct scan_worker*, int, const char*, struct dir_entry*, const char*, ino_t, const struct inode_entry*);
+#ifdef HAVE_IO_URING
+static void scan_statx(struct scan_worker*, int, const char*, struct dir_entry*);
+#endif
+static void scan_file(struct scan_worker*, struct dir_entry*, const char*, ino_t, const struct inode_entry*);
+static void scan_path(struct scan_worker*, struct inode_entry*, struct dir_entry*, const char*);
+static struct device_entry* device_get(struct dedupe_state*, dev_t);
+static struct device_entry* device_find(struct dedupe_state*, dev_t);
+static void scan_insert(struct dedupe_state*, struct inode_entry*, ino_t);
+static void scan_flush(struct scan_worker*);
+static void perror_path(const char*, const char*);
 static void bucketize_by_size(void*, struct hash_bucket*);
 static void gather_tohash(struct dedupe_state*);
 static void gather_tohash_walkcb(void*, struct hash_bucket*);
 static int gather_tohash_sortcb(const void*, const void*);
-static void hash_inode(struct dedupe_state*, size_t, unsigned long long, struct inode_entry*);
+static void prefilter_all(struct dedupe_state*);
+static bool prefilter_inode(struct dedupe_state*, struct inode_entry*);
+static int prefilter_sortcb(const void*, const void*);
+static void validate_all(struct dedupe_state*);
+static bool validate_inode(struct dedupe_state*, struct inode_entry*);
+static void hash_all(struct dedupe_state*);
+static void pipeline_hash(struct dedupe_state*, struct inode_entry**, size_t, unsigned long long);
+static bool pipeline_inode(struct dedupe_state*, struct inode_entry*);
+static void pipeline_finish(struct dedupe_state*, struct pipeline_group*);
+static void* pipeline_relink(void*);
+static void order_inodes(struct dedupe_state*, struct inode_entry**, size_t);
+#ifdef FS_IOC_FIEMAP
+static void order_locate(struct dedupe_state*, struct inode_entry*);
+static int order_physical_sortcb(const void*, const void*);
+#endif
+static int order_inode_sortcb(const void*, const void*);
+static void compare_all(struct dedupe_state*);
+static bool compare_inode(struct dedupe_state*, struct inode_entry*);
+static bool compare_contents(struct dedupe_state*, struct inode_entry*, struct inode_entry*, bool);
+static void process_inodes(struct dedupe_state*, struct inode_entry**, size_t, bool (*)(struct dedupe_state*, struct inode_entry*), unsigned long long);
+static void* hash_worker(void*);
+static int open_inode(struct dedupe_state*, struct inode_entry*, char*, int);
+static bool hash_inode(struct dedupe_state*, struct inode_entry*);
+static void hash_small(struct dedupe_state*, struct inode_entry**, size_t);
+static bool hash_xattr_load(struct dedupe_state*, int, struct inode_entry*);
+static bool hash_xattr_read(struct dedupe_state*, int, struct inode_entry*);
+static void hash_xattr_store(struct dedupe_state*, int, struct inode_entry*);
+static void hash_chunk(void*, const unsigned char*, size_t, off_t);
+static bool read_inode(struct dedupe_state*, int, const char*, off_t, void (*)(void*, const unsigned char*, size_t, off_t), void*);
+static bool read_mmap(struct dedupe_state*, int, const char*, off_t, void (*)(void*, const unsigned char*, size_t, off_t), void*);
+static bool read_stream(struct dedupe_state*, int, const char*, off_t, void (*)(void*, const unsigned char*, size_t, off_t), void*);
+static unsigned char* read_local(void);
+static void read_release(void);
+#ifdef HAVE_IO_URING
+static bool read_uring(struct dedupe_state*, struct uring*, int, const char*, off_t, void (*)(void*, const unsigned char*, size_t, off_t), void*);
+#endif
+static void hash_progress(struct dedupe_state*, const char*, size_t, unsigned long long);
 static void gather_tolink(struct dedupe_state*);
 static void gather_tolink_walkcb(void*, struct hash_bucket*);
 static int gather_tolink_sortcb(const void*, const void*);
 static void relink(struct dedupe_state*, struct hash_bucket*);
+static void relink_group(struct dedupe_state*, struct hash_bucket*, struct inode_entry**, size_t);
 static int relink_sortcb(const void*, const void*);
+static void relink_hardlink(struct dedupe_state*, struct inode_entry**, size_t);
+static int relink_hardlink_sortcb(const void*, const void*);
+#ifdef FICLONE
+static void relink_clone(struct dedupe_state*, struct inode_entry**, size_t);
+#endif
+#ifdef FIDEDUPERANGE
+static void relink_dedupe_range(struct dedupe_state*, struct inode_entry**, size_t);
+#endif
+#ifdef FIDEDUPERANGE
+static void block_all(struct dedupe_state*);
+static void block_gather_walkcb(void*, struct hash_bucket*);
+static bool block_inode(struct dedupe_state*, struct inode_entry*);
+static void block_chunk(void*, const unsigned char*, size_t, off_t);
+static void block_share_walkcb(void*, struct hash_bucket*);
+static int block_sortcb(const void*, const void*);
+static void block_share(struct block_state*, struct hash_bucket*);
+static int block_open(struct block_state*, struct inode_entry*);
+#endif
+static void index_load(struct dedupe_state*);
+static const struct index_record* index_find(struct dedupe_state*, struct inode_entry*);
+static const struct index_record* index_search(const struct index_record*, size_t, struct inode_entry*);
+static void manifest_emit(struct dedupe_state*);
+static int manifest_sortcb(const void*, const void*);
+static bool manifest_merge(struct dedupe_state*);
+static bool manifest_next(struct manifest_stream*);
+static void manifest_byteorder(struct manifest_record*);
+static int manifest_compare(const struct manifest_record*, const struct manifest_record*);
+static void manifest_sift(struct manifest_stream**, size_t, size_t);
+static void manifest_report(struct dedupe_state*, const struct manifest_entry*, size_t);
+static bool spill_all(struct dedupe_state*);
+static FILE* spill_open(struct dedupe_state*);
+static struct spill_runs* spill_runs_create(struct dedupe_state*, size_t, int (*)(const void*, const void*));
+static void spill_write(struct dedupe_state*, struct spill_runs*, void*, size_t);
+static bool spill_pwrite(int, const void*, size_t, unsigned long long);
+static bool spill_reduce(struct dedupe_state*, struct spill_runs*);
+static void spill_file(struct scan_worker*, struct dir_entry*, const char*, ino_t, const struct inode_entry*);
+static void spill_flush(struct scan_worker*);
+static int spill_record_sortcb(const void*, const void*);
+static int spill_digest_sortcb(const void*, const void*);
+static struct spill_merge* spill_merge_create(void*, struct spill_runs*, size_t, size_t);
+static bool spill_merge_next(struct spill_merge*, void*);
+static bool spill_stream_fill(struct spill_runs*, struct spill_stream*);
+static void spill_merge_sift(struct spill_merge*, size_t);
+static void spill_hash(struct dedupe_state*);
+static void spill_group(struct dedupe_state*, struct spill_batch*, const struct spill_record*, size_t, bool);
+static void spill_batch_flush(struct dedupe_state*, struct spill_batch*);
+static void spill_link(struct dedupe_state*);
+static void spill_relink(struct dedupe_state*, const struct spill_digest*, size_t);
+static struct inode_entry* spill_inode(void*, const struct spill_record*);
+static void spill_path(struct dedupe_state*, void*, struct inode_entry*, const struct spill_record*);
+static void index_save(struct dedupe_state*);
+static void index_save_walkcb(void*, struct hash_bucket*);
+static int index_sortcb(const void*, const void*);
+static void index_fill(struct index_record*, const struct inode_entry*, const unsigned char*);
+static void checkpoint_open(struct dedupe_state*);
+static void checkpoint_load(struct dedupe_state*);
+static void checkpoint_add(struct dedupe_state*, const struct inode_entry*);
+static void checkpoint_flush(struct dedupe_state*);
+static void checkpoint_finish(struct dedupe_state*);
+static void snapshot_load(struct dedupe_state*);
+static const struct snapshot_dir* snapshot_find(struct dedupe_state*, const struct stat*);
+static void snapshot_child(struct scan_worker*, unsigned short, const char*, ino_t, const struct inode_entry*);
+static void snapshot_end(struct scan_worker*, const struct stat*, struct dir_entry*, unsigned long long, long long);
+static void snapshot_save(struct dedupe_state*);
+static int snapshot_sortcb(const void*, const void*);
+static unsigned long long snapshot_excludes(struct dedupe_state*);
+static bool watch_init(struct dedupe_state*);
+static void watch_add(struct dedupe_state*, int, const char*, struct dir_entry*, const struct stat*);
+static void watch_all(struct dedupe_state*);
+static void watch_read(struct dedupe_state*);
+#ifdef __FreeBSD__
+static void watch_rescan(struct dedupe_state*, struct dir_entry*, int);
+#endif
+static void watch_directory(struct dedupe_state*, struct dir_entry*, const char*);
+static void watch_queue(struct dedupe_state*, struct dir_entry*, const char*);
+static void watch_process(struct dedupe_state*);
+static bool watch_file(struct dedupe_state*, struct dir_entry*, const char*);
+static void watch_match(struct dedupe_state*, struct inode_entry*);
+static void watch_link(struct dedupe_state*, struct hash_bucket*);
+static void watch_settle(struct dedupe_state*, struct hash_bucket*);
+static void watch_forget(struct dedupe_state*, struct inode_entry*);
+static void watch_signal(int);
 static void print_progress(struct dedupe_state*, const char*, size_t, size_t, unsigned long long, unsigned long long);
 static void print_summary(struct dedupe_state*);
+static bool stats_open(struct dedupe_state*);
+static void stats_phase(struct dedupe_state*, const char*, size_t);
+static void stats_duplicate(struct dedupe_state*, const unsigned char*, struct inode_entry**, size_t);
+static void stats_summary(struct dedupe_state*);
+static void stats_digested(struct dedupe_state*, unsigned long long);
+static void stats_string(FILE*, const char*);
+static size_t stats_utf8(const unsigned char*);
+static double stats_clock(void);
+static void trace_init(void);
+static void* trace_worker(void*);
+static unsigned long long trace_clock(void);
+static inline unsigned long long trace_begin(enum trace_point);
+static inline void trace_end(enum trace_point, unsigned long long);
+static void trace_dump(const char*, bool);
+static void trace_format(char*, size_t, double);
 
 static struct hash_map* hash_map_create(void*, const struct hash_descriptor*, size_t);
 static struct hash_bucket* hash_map_insert(struct hash_map*, void*);
+static struct hash_bucket* hash_map_find(const struct hash_map*, void*);
 static void hash_map_rehash(struct hash_map*);
 static void hash_map_walk(struct hash_map*, void*, void(*)(void*, struct hash_bucket*));
 
+static void digest_final(struct dedupe_state*, union digest_context*, unsigned char*);
+static void digest_sha256_init(union digest_context*);
+static void digest_sha256_update(union digest_context*, const void*, size_t);
+static void digest_sha256_final(union digest_context*, unsigned char*);
+#ifdef HAVE_SHA256_BATCH
+static void digest_sha256_batch(const unsigned char* const*, const size_t*, size_t, unsigned char**);
+#endif
+#ifdef HAVE_BLAKE3
+static void digest_blake3_init(union digest_context*);
+static void digest_blake3_update(union digest_context*, const void*, size_t);
+static void digest_blake3_final(union digest_context*, unsigned char*);
+#endif
+#ifdef HAVE_XXHASH
+static void digest_xxh3_init(union digest_context*);
+static void digest_xxh3_update(union digest_context*, const void*, size_t);
+static void digest_xxh3_final(union digest_context*, unsigned char*);
+#endif
+
 static size_t hash_ptr_hash(void*);
 static bool hash_ptr_equals(void*, void*);
 
 static size_t hash_digest_hash(void*);
 static bool hash_digest_equals(void*, void*);
+static size_t hash_string_hash(void*);
+static bool hash_string_equals(void*, void*);
+
+static size_t hash_block_hash(void*);
+static bool hash_block_equals(void*, void*);
+
+static size_t next_power_of_two(size_t);
+
+static void throttle(struct dedupe_state*, unsigned long long, unsigned long long);
+static double throttle_take(struct throttle*, double, double);
+
+#ifdef HAVE_IO_URING
+static struct uring* uring_local(struct dedupe_state*);
+static void uring_release(void);
+static struct uring* uring_create(void);
+static void uring_destroy(struct uring*);
+static struct io_uring_sqe* uring_get_sqe(struct uring*);
+static int uring_submit(struct uring*, unsigned int);
+static struct io_uring_cqe* uring_peek(struct uring*);
+static void uring_advance(struct uring*);
+#endif
+
+static void inode_from_stat(struct inode_entry*, const struct stat*);
+static void* arena_alloc(struct arena*, size_t);
+static size_t path_length(struct dir_entry*, const char*);
+static void path_fill(char*, size_t, struct dir_entry*, const char*);
+static bool path_format(char*, size_t, struct dir_entry*, const char*);
+static char* path_build(void*, struct dir_entry*, const char*);
+static int dir_open(struct dir_entry*);
+static bool dir_evict(void);
+static void dir_release(void);
+
+static const struct digest_descriptor digest_descriptors[] =
+{
+	{
+		"sha256", SHA256_DIGEST_LENGTH, true, "",
+		digest_sha256_init,
+		digest_sha256_update,
+		digest_sha256_final,
+#ifdef HAVE_SHA256_BATCH
+		digest_sha256_batch
+#endif
+	},
+#ifdef HAVE_BLAKE3
+	{
+		"blake3", BLAKE3_OUT_LEN, true, ".blake3",
+		digest_blake3_init,
+		digest_blake3_update,
+		digest_blake3_final
+	},
+#endif
+#ifdef HAVE_XXHASH
+	{
+		"xxh3", sizeof(XXH128_canonical_t), false, ".xxh3",
+		digest_xxh3_init,
+		digest_xxh3_update,
+		digest_xxh3_final
+	},
+#endif
+	{}
+};
+
+static const struct relink_descriptor relink_descriptors[] =
+{
+	{ "hardlink", false, relink_hardlink },
+#ifdef FICLONE
+	{ "reflink", false, relink_clone },
+#endif
+#ifdef FIDEDUPERANGE
+	{ "dedupe-range", true, relink_dedupe_range },
+#endif
+	{}
+};
+
+static const struct read_descriptor read_descriptors[] =
+{
+	{ "mmap", false, read_mmap },
+	{ "stream", false, read_stream },
+#ifdef O_DIRECT
+	{ "direct", true, read_stream },
+#endif
+	{}
+};
+
+static const struct order_descriptor order_descriptors[] =
+{
+	{ "size", NULL, NULL },
+	{ "inode", NULL, order_inode_sortcb },
+#ifdef FS_IOC_FIEMAP
+	{ "physical", order_locate, order_physical_sortcb },
+#endif
+	{}
+};
+
+static const char* const trace_names[TRACE_POINTS] =
+{
+	"readdir", "fstatat", "exclude", "rehash", "open", "mmap", "read", "link"
+};
+
+static bool trace_enabled;
+static double trace_scale = 1;
+static double trace_time;
+static struct trace_counter trace_counters[TRACE_POINTS];
+
+#ifdef HAVE_IO_URING
+static __thread struct uring* uring_thread;
+static __thread bool uring_thread_failed;
+#endif
+
+static __thread unsigned char* read_thread;
+static __thread struct dir_cache dir_thread;
+static size_t dir_limit = DIR_FDS;
 
-static bool is_prime(size_t);
-static size_t next_prime(size_t);
+static volatile sig_atomic_t watch_stop;
 
 static const struct hash_descriptor hash_ptr_descriptor =
 {
@@ -154,40 +1208,144 @@ static const struct hash_descriptor hash_digest_descriptor =
 	hash_digest_equals
 };
 
+static const struct hash_descriptor hash_block_descriptor =
+{
+	hash_block_hash,
+	hash_block_equals
+};
+
+static const struct hash_descriptor hash_string_descriptor =
+{
+	hash_string_hash,
+	hash_string_equals
+};
+
 int main(int argc, char** argv)
 {
 	struct dedupe_state* state = talloc_zero(NULL, struct dedupe_state);
+	state->jobs = 1;
+	state->digest = &digest_descriptors[0];
+	state->method = &relink_descriptors[0];
+	state->order = &order_descriptors[0];
+	state->reader = &read_descriptors[0];
+	pthread_mutex_init(&state->lock, NULL);
 
 	if (parse_cmdline(state, argc, argv))
 	{
+		pthread_mutex_destroy(&state->lock);
 		talloc_free(state);
 		return 1;
 	}
 
 	check_terminal(state);
 
-	if (state->verbose && state->tty)
+	if (state->trace)
+		trace_init();
+
+	// Merging reads manifests written by earlier runs and touches nothing.
+	if (state->merge)
+	{
+		bool success = manifest_merge(state);
+		pthread_mutex_destroy(&state->lock);
+		talloc_free(state);
+		return success ? 0 : 1;
+	}
+
+	// Every job and the relinking thread keep directories open, which must
+	// leave most descriptors to the files themselves.
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) != -1 && limit.rlim_cur != RLIM_INFINITY)
+	{
+		dir_limit = limit.rlim_cur / (4 * (state->jobs + 1));
+		if (dir_limit < 2)
+			dir_limit = 2;
+		else if (dir_limit > DIR_FDS)
+			dir_limit = DIR_FDS;
+	}
+
+	if (state->verbose && state->tty)
 	{
 		fputs("\n\n\e[2A\e[s", stdout);
 		fflush(stdout);
 	}
 
-	state->inode_lookup = hash_map_create(state, &hash_ptr_descriptor, 0);
-	for (size_t i = 0; i < state->dircount; ++i)
-		scan_directory(state, AT_FDCWD, state->dirs[i], state->dirs[i]);
+	if ((state->watch && !watch_init(state)) || (state->stats_path && !stats_open(state)))
+	{
+		pthread_mutex_destroy(&state->lock);
+		talloc_free(state);
+		return 1;
+	}
+
+	state->arena = talloc_zero(state, struct arena);
+	state->devices = talloc_array(state, struct device_entry*, 0);
+
+	// Out of core, sorts on disk take the place of the lookups below.
+	if (state->spill_path)
+	{
+		bool success = spill_all(state);
+		print_summary(state);
+		stats_summary(state);
 
-	state->size_lookup = hash_map_create(state, &hash_ptr_descriptor, state->inode_lookup->item_count);
-	hash_map_walk(state->inode_lookup, state, bucketize_by_size);
+		pthread_mutex_destroy(&state->lock);
+		talloc_free(state);
+		return success ? 0 : 1;
+	}
+
+	if (state->checkpoint_path)
+		checkpoint_open(state);
+
+	if (state->snapshot_path)
+		snapshot_load(state);
+
+	scan_all(state);
+
+	size_t inodes = 0;
+	for (size_t i = 0; i < state->device_count; ++i)
+		inodes += state->devices[i]->inode_lookup->item_count;
+	stats_phase(state, "scan", inodes);
+
+	for (size_t i = 0; i < state->device_count; ++i)
+	{
+		struct device_entry* device = state->devices[i];
+		device->size_lookup = hash_map_create(device, &hash_ptr_descriptor, device->inode_lookup->item_count);
+		hash_map_walk(device->inode_lookup, state, bucketize_by_size);
+	}
+	stats_phase(state, "bucketize", state->inode_count);
+
+	if (state->index_path)
+		index_load(state);
 
 	gather_tohash(state);
+	stats_phase(state, "gather_tohash", state->tohash_count + state->tocompare_count * 2);
 
-	unsigned long long hashed = 0;
-	state->hash_lookup = hash_map_create(state, &hash_digest_descriptor, state->tohash_count);
-	for (size_t i = 0; i < state->tohash_count; ++i)
+	if (state->snapshot_path)
 	{
-		struct inode_entry* inode = state->tohash_list[i];
-		hash_inode(state, i, hashed, inode);
-		hashed += inode->buffer.st_size;
+		validate_all(state);
+		snapshot_save(state);
+		stats_phase(state, "validate", state->tohash_count + state->tocompare_count * 2);
+	}
+
+	if (state->prefilter)
+	{
+		prefilter_all(state);
+		stats_phase(state, "prefilter", state->tohash_count);
+	}
+
+	hash_all(state);
+	if (state->checkpoint)
+		checkpoint_flush(state);
+	stats_phase(state, "hash", state->tohash_count);
+
+	if (state->tocompare_count)
+	{
+		compare_all(state);
+		stats_phase(state, "compare", state->tocompare_count);
+	}
+
+	if (state->manifest_path)
+	{
+		manifest_emit(state);
+		stats_phase(state, "manifest", state->tohash_count);
 	}
 
 	if (state->verbose && state->tty)
@@ -197,12 +1355,47 @@ int main(int argc, char** argv)
 	}
 
 	gather_tolink(state);
+	stats_phase(state, "gather_tolink", state->tolink_count);
 
 	for (size_t i = 0; i < state->tolink_count; ++i)
 		relink(state, state->tolink_list[i]);
+	dir_release();
+	stats_phase(state, "relink", state->relinked_count);
+
+#ifdef FIDEDUPERANGE
+	if (state->blocks)
+	{
+		block_all(state);
+		stats_phase(state, "blocks", state->shared_count);
+	}
+#endif
+
+	if (state->watch)
+	{
+		for (size_t i = 0; i < state->tolink_count; ++i)
+			watch_settle(state, state->tolink_list[i]);
+
+		// The queue holds copies; settle the buckets they were taken from.
+		for (size_t i = 0; i < state->pipeline_count; ++i)
+		{
+			struct inode_entry* inode = state->pipeline_queue[i].value;
+			watch_settle(state, hash_map_insert(device_find(state, inode->dev)->hash_lookup, state->pipeline_queue[i].key));
+		}
+
+		watch_all(state);
+		close(state->watch_fd);
+	}
+
+	if (state->index_path)
+		index_save(state);
+
+	if (state->checkpoint)
+		checkpoint_finish(state);
 
 	print_summary(state);
+	stats_summary(state);
 
+	pthread_mutex_destroy(&state->lock);
 	talloc_free(state);
 	return 0;
 }
@@ -217,6 +1410,32 @@ static int parse_cmdline(struct dedupe_state* state, int argc, char** argv)
 		{"interactive", no_argument, NULL, 'i'},
 		{"exclude", required_argument, NULL, 'e'},
 		{"use-xattrs", no_argument, NULL, 'x'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"io-uring", no_argument, NULL, 'u'},
+		{"prefilter", optional_argument, NULL, 'p'},
+		{"compare", no_argument, NULL, 'c'},
+		{"hash", required_argument, NULL, 'H'},
+		{"index", required_argument, NULL, 'I'},
+		{"snapshot", required_argument, NULL, 'S'},
+		{"watch", no_argument, NULL, 'w'},
+		{"method", required_argument, NULL, 'm'},
+		{"blocks", optional_argument, NULL, 'B'},
+		{"min-size", required_argument, NULL, 's'},
+		{"max-size", required_argument, NULL, 'M'},
+		{"order", required_argument, NULL, 'o'},
+		{"read", required_argument, NULL, 'r'},
+		{"max-bandwidth", required_argument, NULL, 't'},
+		{"max-iops", required_argument, NULL, 'T'},
+		{"stats-json", required_argument, NULL, 'J'},
+		{"pipeline", no_argument, NULL, 'P'},
+		{"spill", required_argument, NULL, 'D'},
+		{"emit-manifest", required_argument, NULL, 'E'},
+		{"merge-manifests", no_argument, NULL, 'G'},
+		{"trace", no_argument, NULL, 'L'},
+		{"include", required_argument, NULL, 'y'},
+		{"min-savings", required_argument, NULL, 'a'},
+		{"checkpoint", required_argument, NULL, 'C'},
+		{"resume", no_argument, NULL, 'R'},
 		{"help", no_argument, NULL, 'h'},
 		{}
 	};
@@ -226,9 +1445,10 @@ static int parse_cmdline(struct dedupe_state* state, int argc, char** argv)
 	memcpy(nargv, argv, argsz);
 
 	state->exclude = talloc_array(state, char*, argc);
+	state->include = talloc_array(state, char*, argc);
 
 	int result, index;
-	while ((result = getopt_long(argc, nargv, "bvnie:xh?", long_options, &index)) != -1)
+	while ((result = getopt_long(argc, nargv, "bvnie:xj:up::cH:I:S:wm:B::s:M:a:o:r:t:T:J:PD:E:GLy:C:Rh?", long_options, &index)) != -1)
 	{
 		switch (result)
 		{
@@ -247,9 +1467,231 @@ static int parse_cmdline(struct dedupe_state* state, int argc, char** argv)
 			case 'e':
 				state->exclude[state->xclcount++] = talloc_strdup(state->exclude, optarg);
 				break;
+			case 'y':
+				state->include[state->inclcount++] = talloc_strdup(state->include, optarg);
+				break;
 			case 'x':
 				state->xattrs = true;
 				break;
+			case 'j':
+			{
+				char* end;
+				unsigned long jobs = strtoul(optarg, &end, 10);
+				if (*end || !jobs || jobs > 1024)
+				{
+					fprintf(stderr, "%s: invalid job count '%s'\n", argv[0], optarg);
+					return 1;
+				}
+				state->jobs = jobs;
+				break;
+			}
+			case 'u':
+#ifdef HAVE_IO_URING
+				state->uring = true;
+				break;
+#else
+				fprintf(stderr, "%s: io_uring is not supported on this platform\n", argv[0]);
+				return 1;
+#endif
+			case 'p':
+			{
+				state->prefilter = 4096;
+				if (!optarg)
+					break;
+
+				char* end;
+				unsigned long size = strtoul(optarg, &end, 10);
+				if (*end || !size || size > 0x100000)
+				{
+					fprintf(stderr, "%s: invalid prefilter size '%s'\n", argv[0], optarg);
+					return 1;
+				}
+				state->prefilter = size;
+				break;
+			}
+			case 'c':
+				state->compare = true;
+				break;
+			case 'H':
+			{
+				const struct digest_descriptor* digest;
+				for (digest = digest_descriptors; digest->name; ++digest)
+				{
+					if (!strcmp(digest->name, optarg))
+						break;
+				}
+
+				if (!digest->name)
+				{
+					fprintf(stderr, "%s: unknown hash '%s', available:", argv[0], optarg);
+					for (digest = digest_descriptors; digest->name; ++digest)
+						fprintf(stderr, " %s", digest->name);
+					fputc('\n', stderr);
+					return 1;
+				}
+
+				state->digest = digest;
+				break;
+			}
+			case 'm':
+			{
+				const struct relink_descriptor* method;
+				for (method = relink_descriptors; method->name; ++method)
+				{
+					if (!strcmp(method->name, optarg))
+						break;
+				}
+
+				if (!method->name)
+				{
+					fprintf(stderr, "%s: unknown method '%s', available:", argv[0], optarg);
+					for (method = relink_descriptors; method->name; ++method)
+						fprintf(stderr, " %s", method->name);
+					fputc('\n', stderr);
+					return 1;
+				}
+
+				state->method = method;
+				break;
+			}
+			case 'o':
+			{
+				const struct order_descriptor* order;
+				for (order = order_descriptors; order->name; ++order)
+				{
+					if (!strcmp(order->name, optarg))
+						break;
+				}
+
+				if (!order->name)
+				{
+					fprintf(stderr, "%s: unknown order '%s', available:", argv[0], optarg);
+					for (order = order_descriptors; order->name; ++order)
+						fprintf(stderr, " %s", order->name);
+					fputc('\n', stderr);
+					return 1;
+				}
+
+				state->order = order;
+				break;
+			}
+			case 'r':
+			{
+				const struct read_descriptor* reader;
+				for (reader = read_descriptors; reader->name; ++reader)
+				{
+					if (!strcmp(reader->name, optarg))
+						break;
+				}
+
+				if (!reader->name)
+				{
+					fprintf(stderr, "%s: unknown read method '%s', available:", argv[0], optarg);
+					for (reader = read_descriptors; reader->name; ++reader)
+						fprintf(stderr, " %s", reader->name);
+					fputc('\n', stderr);
+					return 1;
+				}
+
+				state->reader = reader;
+				break;
+			}
+			case 'B':
+			{
+#ifdef FIDEDUPERANGE
+				state->blocks = 0x20000;
+				if (!optarg)
+					break;
+
+				char* end;
+				unsigned long size = strtoul(optarg, &end, 10);
+				if (*end || !size || size % 4096 || size > DEDUPE_RANGE_LENGTH)
+				{
+					fprintf(stderr, "%s: invalid block size '%s'\n", argv[0], optarg);
+					return 1;
+				}
+				state->blocks = size;
+				break;
+#else
+				fprintf(stderr, "%s: block deduplication is not supported on this platform\n", argv[0]);
+				return 1;
+#endif
+			}
+			case 's':
+			case 'M':
+			case 'a':
+			{
+				char* end;
+				unsigned long long size = strtoull(optarg, &end, 10);
+				if (*end || !*optarg || size > LLONG_MAX)
+				{
+					fprintf(stderr, "%s: invalid size '%s'\n", argv[0], optarg);
+					return 1;
+				}
+
+				if (result == 's')
+					state->min_size = size;
+				else if (result == 'M')
+					state->max_size = size;
+				else
+					state->min_savings = size;
+				break;
+			}
+			case 't':
+			case 'T':
+			{
+				char* end;
+				double rate = strtod(optarg, &end);
+				if (*end || !(rate > 0))
+				{
+					fprintf(stderr, "%s: invalid limit '%s'\n", argv[0], optarg);
+					return 1;
+				}
+
+				if (result == 't')
+					state->bandwidth.rate = rate;
+				else
+					state->iops.rate = rate;
+				break;
+			}
+			case 'J':
+				state->stats_path = talloc_strdup(state, optarg);
+				break;
+			case 'P':
+				state->pipeline = true;
+				break;
+			case 'D':
+				state->spill_path = talloc_strdup(state, optarg);
+				break;
+			case 'E':
+				state->manifest_path = talloc_strdup(state, optarg);
+				break;
+			case 'G':
+				state->merge = true;
+				break;
+			case 'L':
+				state->trace = true;
+				break;
+			case 'I':
+				state->index_path = talloc_strdup(state, optarg);
+				break;
+			case 'S':
+				state->snapshot_path = talloc_strdup(state, optarg);
+				break;
+			case 'C':
+				state->checkpoint_path = talloc_strdup(state, optarg);
+				break;
+			case 'R':
+				state->resume = true;
+				break;
+			case 'w':
+#if defined(__linux__) || defined(__FreeBSD__)
+				state->watch = true;
+				break;
+#else
+				fprintf(stderr, "%s: watching is not supported on this platform\n", argv[0]);
+				return 1;
+#endif
 			case 'h':
 			case '?':
 				print_usage(argv[0]);
@@ -259,6 +1701,75 @@ static int parse_cmdline(struct dedupe_state* state, int argc, char** argv)
 		}
 	}
 
+	if (state->pipeline && state->interactive)
+	{
+		fprintf(stderr, "%s: --pipeline can't be combined with --interactive\n", argv[0]);
+		return 1;
+	}
+
+	if (state->spill_path && (state->watch || state->snapshot_path || state->index_path || state->compare || state->prefilter || state->blocks || state->pipeline))
+	{
+		fprintf(stderr, "%s: --spill can't be combined with --watch, --snapshot, --index, --compare, --prefilter, --blocks or --pipeline\n", argv[0]);
+		return 1;
+	}
+
+	if (state->manifest_path && (state->watch || state->compare || state->prefilter || state->spill_path))
+	{
+		fprintf(stderr, "%s: --emit-manifest can't be combined with --watch, --compare, --prefilter or --spill\n", argv[0]);
+		return 1;
+	}
+
+	// Progress and prompts would break up the JSON lines.
+	if (state->stats_path && !strcmp(state->stats_path, "-") && (state->verbose || state->interactive))
+	{
+		fprintf(stderr, "%s: --stats-json to standard output can't be combined with --verbose or --interactive\n", argv[0]);
+		return 1;
+	}
+
+	if (state->checkpoint_path && (state->watch || state->spill_path))
+	{
+		fprintf(stderr, "%s: --checkpoint can't be combined with --watch or --spill\n", argv[0]);
+		return 1;
+	}
+
+	if (state->resume && !state->checkpoint_path)
+	{
+		fprintf(stderr, "%s: --resume needs the --checkpoint file to resume from\n", argv[0]);
+		return 1;
+	}
+
+	// The scan inventory is kept next to the checkpoint unless it has a
+	// snapshot file of its own.
+	if (state->checkpoint_path && !state->snapshot_path)
+	{
+		state->snapshot_path = talloc_asprintf(state, "%s.snapshot", state->checkpoint_path);
+		state->checkpoint_snapshot = true;
+	}
+
+	if (state->merge && optind == argc)
+	{
+		fprintf(stderr, "%s: --merge-manifests needs the manifest files to merge\n", argv[0]);
+		return 1;
+	}
+
+	state->excludes = pattern_compile(state, state->exclude, state->xclcount);
+	state->includes = pattern_compile(state, state->include, state->inclcount);
+
+	// The kernel compares the ranges before sharing them, so for dedupe-range
+	// same-size files whose prefilter digests match don't need a full hash.
+	state->prefilter_only = state->method->verifies && state->prefilter && !state->watch;
+
+	state->xattr_hash = talloc_asprintf(state, XATTR_PREFIX "dedupe.hash%s", state->digest->xattr_suffix);
+	state->xattr_mtime = talloc_asprintf(state, XATTR_PREFIX "dedupe.hash_mtime%s", state->digest->xattr_suffix);
+
+	// With SHA extensions or only 256-bit vectors, hashing one file at a time
+	// through OpenSSL is as fast as spreading files over 32-bit lanes.
+#ifdef HAVE_SHA256_BATCH
+	unsigned int eax, ebx = 0, ecx, edx;
+	__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+	state->digest_batch = state->digest->batch_function && __builtin_cpu_supports("avx512f") && !(ebx & bit_SHA);
+#endif
+
 	state->dirs = talloc_array(state, char*, argc);
 	for (int i = optind; i < argc; ++i)
 	{
@@ -269,18 +1780,16 @@ static int parse_cmdline(struct dedupe_state* state, int argc, char** argv)
 		state->dirs[state->dircount++] = dir;
 	}
 
-	if (!state->dircount)
-		return 0;
-
-	struct stat buffer;
-	if (stat(state->dirs[0], &buffer) == -1)
+	for (size_t i = 0; i < state->dircount; ++i)
 	{
-		perror(state->dirs[0]);
-		return 1;
+		struct stat buffer;
+		if (stat(state->dirs[i], &buffer) == -1)
+		{
+			perror(state->dirs[i]);
+			return 1;
+		}
 	}
 
-	state->device = buffer.st_dev;
-
 	return 0;
 }
 
@@ -295,7 +1804,46 @@ static void print_usage(const char* name)
 		"  -v, --verbose     Print directory and file names as they are being scanned.\n"
 		"  -n, --dry-run     Don't do any write operations to the file system.\n"
 		"  -e, --exclude     Exclude file or directory pattern from scan.\n"
+		"  -y, --include     Keep files and directories matching the pattern even if\n"
+		"                    they are excluded.\n"
 		"  -x, --use-xattrs  Cache file hashes in user extended attributes.\n"
+		"  -j, --jobs N      Scan and hash files using N threads.\n"
+		"  -u, --io-uring    Batch file system calls and reads through io_uring.\n"
+		"  -p, --prefilter[=SIZE]\n"
+		"                    Compare the first and last SIZE bytes before hashing.\n"
+		"  -c, --compare     Compare pairs of same-size files instead of hashing them.\n"
+		"  -H, --hash NAME   Select the hash algorithm, sha256 by default.\n"
+		"  -I, --index FILE  Cache file hashes in an index file.\n"
+		"  -S, --snapshot FILE\n"
+		"                    Skip reading directories unchanged since the last run.\n"
+		"  -C, --checkpoint FILE\n"
+		"                    Save progress to FILE while hashing.\n"
+		"  -R, --resume      Continue from the --checkpoint file of an interrupted run.\n"
+		"  -w, --watch       Keep running and deduplicate files as they are written.\n"
+		"  -m, --method NAME Share data using hardlink (default), reflink or dedupe-range.\n"
+		"  -B, --blocks[=SIZE]\n"
+		"                    Also share identical SIZE byte blocks between files.\n"
+		"  -s, --min-size SIZE\n"
+		"                    Skip files smaller than SIZE bytes.\n"
+		"  -M, --max-size SIZE\n"
+		"                    Skip files larger than SIZE bytes.\n"
+		"  -a, --min-savings SIZE\n"
+		"                    Skip files with less than SIZE bytes allocated on disk.\n"
+		"  -o, --order NAME  Hash files in size (default), inode or physical order.\n"
+		"  -r, --read NAME   Read files using mmap (default), stream or direct.\n"
+		"  -t, --max-bandwidth BYTES\n"
+		"                    Read at most BYTES per second.\n"
+		"  -T, --max-iops N  Issue at most N reads and stats per second.\n"
+		"  -J, --stats-json FILE\n"
+		"                    Write phases, duplicates and totals to FILE as JSON lines.\n"
+		"  -P, --pipeline    Relink duplicates while the remaining files are hashed.\n"
+		"  -D, --spill DIR   Sort file lists in temporary files in DIR instead of memory.\n"
+		"  -E, --emit-manifest FILE\n"
+		"                    Write the size, hash and paths of every file to FILE.\n"
+		"  -G, --merge-manifests\n"
+		"                    Report duplicates across the manifest files given instead\n"
+		"                    of directories.\n"
+		"  -L, --trace       Print call latencies after each phase and on SIGUSR1.\n"
 		"  -i, -interactive  Ask for confirmation before doing anything.\n"
 		"  -h, -?, --help    Show program usage.\n"
 		"\n",
@@ -319,646 +1867,6691 @@ static void check_terminal(struct dedupe_state* state)
 	state->last = ts.tv_sec;
 }
 
-static bool is_excluded(struct dedupe_state* state, const char* name)
+static bool is_excluded(struct dedupe_state* state, struct dir_entry* dir, const char* name)
 {
-	if (!strcmp(name, ".") || !strcmp(name, ".."))
+	if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
 		return true;
 
-	for (size_t i = 0; i < state->xclcount; ++i)
-	{
-		if (!fnmatch(state->exclude[i], name, FNM_PATHNAME))
-			return true;
-	}
+	if (!state->xclcount)
+		return false;
 
-	return false;
+	unsigned long long start = trace_begin(TRACE_EXCLUDE);
+	bool excluded = pattern_match(state->excludes, dir, name) &&
+		!(state->inclcount && pattern_match(state->includes, dir, name));
+	trace_end(TRACE_EXCLUDE, start);
+
+	return excluded;
 }
 
-static void scan_directory(struct dedupe_state* state, int pfd, char* dpath, char* dname)
+static struct pattern_set* pattern_compile(void* ctx, char** patterns, size_t count)
 {
-	print_progress(state, dpath, 0, 0, 0, 0);
+	struct pattern_set* set = talloc_zero(ctx, struct pattern_set);
+	set->literals = hash_map_create(set, &hash_string_descriptor, count);
+	set->suffixes = hash_map_create(set, &hash_string_descriptor, count);
+	set->suffix_lengths = talloc_array(set, size_t, count);
+	set->globs = talloc_array(set, char*, count);
+	set->paths = talloc_array(set, char*, count);
 
-	int fd = openat(pfd, dname, O_RDONLY|O_CLOEXEC|O_DIRECTORY);
-	if (fd == -1)
-	{
-		perror(dpath);
-		return;
-	}
+	char** globs = talloc_array(set, char*, count);
+	size_t glob_count = 0;
 
-	struct stat buffer;
-	if (fstat(fd, &buffer) == -1 || (buffer.st_dev == state->device ? false : ((errno = EXDEV), true)))
+	for (size_t i = 0; i < count; ++i)
 	{
-		perror(dpath);
-		close(fd);
-		return;
-	}
+		char* pattern = patterns[i];
+		if (strchr(pattern, '/'))
+		{
+			set->paths[set->path_count++] = pattern;
+		}
+		else if (!strpbrk(pattern, "*?[\\"))
+		{
+			hash_map_insert(set->literals, pattern);
+		}
+		else if (pattern[0] == '*' && !strpbrk(pattern + 1, "*?[\\"))
+		{
+			hash_map_insert(set->suffixes, pattern + 1);
 
-	DIR* d = fdopendir(fd);
-	if (!d)
-	{
-		perror(dpath);
-		close(fd);
-		return;
+			size_t length = strlen(pattern + 1), j = 0;
+			while (j < set->suffix_length_count && set->suffix_lengths[j] != length)
+				++j;
+			if (j == set->suffix_length_count)
+				set->suffix_lengths[set->suffix_length_count++] = length;
+		}
+		else
+		{
+			globs[glob_count++] = pattern;
+		}
 	}
 
-	struct dirent* e;
-	while ((e = readdir(d)))
-	{
-		if (is_excluded(state, e->d_name))
-			continue;
+	if (glob_count)
+		pattern_build(set, globs, glob_count);
 
-		char* fullpath = talloc_asprintf(dpath, "%s/%s", dpath, e->d_name);
+	talloc_free(globs);
+	return set;
+}
 
-		if (e->d_type == DT_DIR)
+// Turns a glob into its steps, the way fnmatch reads it for names without a
+// slash. Character classes and the like are left to fnmatch itself.
+static bool pattern_parse(const char* pattern, struct pattern_element* elements, size_t* count)
+{
+	*count = 0;
+	for (const unsigned char* p = (const unsigned char*)pattern; *p; ++p)
+	{
+		struct pattern_element* element = &elements[(*count)++];
+		memset(element, 0, sizeof(struct pattern_element));
+
+		if (*p == '*')
 		{
-			scan_directory(state, fd, fullpath, e->d_name);
-			talloc_free(fullpath);
+			element->star = true;
 		}
-		else if (e->d_type == DT_REG)
+		else if (*p == '?')
 		{
-			struct hash_bucket* bucket = hash_map_insert(state->inode_lookup, (void*)e->d_ino);
-			struct inode_entry* ientry;
-
-			if (bucket->value)
-			{
-				ientry = bucket->value;
-			}
-			else
+			memset(element->bytes, 0xff, sizeof(element->bytes));
+		}
+		else if (*p == '[')
+		{
+			const unsigned char* q = p + 1;
+			bool negate = *q == '!' || *q == '^';
+			if (negate)
+				++q;
+
+			// A closing bracket right at the start is taken literally.
+			bool closed = false;
+			for (bool first = true; *q; first = false)
 			{
-				ientry = talloc_zero(state, struct inode_entry);
+				if (*q == ']' && !first)
+				{
+					closed = true;
+					break;
+				}
 
-				if (fstatat(fd, e->d_name, &ientry->buffer, AT_SYMLINK_NOFOLLOW) == -1)
+				if (*q == '[' && (q[1] == ':' || q[1] == '=' || q[1] == '.'))
+					return false;
+
+				unsigned char low = *q == '\\' && q[1] ? *++q : *q;
+				unsigned char high = low;
+				++q;
+				if (*q == '-' && q[1] && q[1] != ']')
 				{
-					perror(fullpath);
-					talloc_free(ientry);
-					talloc_free(fullpath);
-					continue;
+					high = q[1] == '\\' && q[2] ? q[2] : q[1];
+					q += q[1] == '\\' && q[2] ? 3 : 2;
 				}
 
-				bucket->value = ientry;
+				for (unsigned int c = low; c <= high; ++c)
+					element->bytes[c / 8] |= 1 << (c % 8);
 			}
 
-			struct path_entry* pentry = talloc(ientry, struct path_entry);
-			pentry->next = ientry->paths;
-			ientry->paths = pentry;
+			if (closed)
+			{
+				if (negate)
+				{
+					for (size_t i = 0; i < sizeof(element->bytes); ++i)
+						element->bytes[i] = ~element->bytes[i];
+				}
+				p = q;
+			}
+			else
+			{
+				// An unmatched bracket stands for itself.
+				memset(element->bytes, 0, sizeof(element->bytes));
+				element->bytes['[' / 8] |= 1 << ('[' % 8);
+			}
+		}
+		else
+		{
+			// What a trailing backslash means is up to fnmatch.
+			if (*p == '\\' && !*++p)
+				return false;
 
-			pentry->path = fullpath;
-			talloc_steal(pentry, fullpath);
+			element->bytes[*p / 8] |= 1 << (*p % 8);
 		}
 	}
 
-	closedir(d);
+	return true;
 }
 
-static void bucketize_by_size(void* state0, struct hash_bucket* inode_bucket)
+// Builds the DFA for all globs at once by subset construction. A state is the
+// set of positions reached in every glob; a position past a glob's last step
+// accepts. Bytes that no step tells apart share a class, which keeps the
+// transition table small. Globs that would take too many states are matched
+// with fnmatch instead.
+static void pattern_build(struct pattern_set* set, char** globs, size_t count)
 {
-	struct dedupe_state* state = state0;
-	struct inode_entry* ientry = inode_bucket->value;
+	void* ctx = talloc_new(NULL);
 
-	struct hash_bucket* size_bucket = hash_map_insert(state->size_lookup, (void*)ientry->buffer.st_size);
-	++size_bucket->dummy;
-	ientry->next_by_size = size_bucket->value;
-	size_bucket->value = ientry;
+	// Every glob gets one position per step plus one for its end, where the
+	// element is NULL.
+	size_t total = 0;
+	for (size_t i = 0; i < count; ++i)
+		total += strlen(globs[i]) + 1;
+
+	struct pattern_element* elements = talloc_array(ctx, struct pattern_element, total);
+	size_t* ends = talloc_array(ctx, size_t, total);
+	size_t* starts = talloc_array(ctx, size_t, count);
+	size_t position = 0, parsed = 0;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		size_t steps;
+		if (!pattern_parse(globs[i], elements + position, &steps))
+		{
+			set->globs[set->glob_count++] = globs[i];
+			continue;
+		}
+
+		starts[parsed++] = position;
+		for (size_t j = 0; j <= steps; ++j)
+			ends[position + j] = position + steps;
+		position += steps + 1;
+	}
+
+	if (!parsed)
+	{
+		talloc_free(ctx);
+		return;
+	}
+
+	// Bytes belong to the same class when every step either takes both or
+	// neither of them.
+	size_t class_count = 0;
+	unsigned char representatives[256];
+	for (unsigned int c = 0; c < 256; ++c)
+	{
+		size_t k;
+		for (k = 0; k < class_count; ++k)
+		{
+			unsigned int r = representatives[k];
+			size_t j;
+			for (j = 0; j < position; ++j)
+			{
+				if (j == ends[j] || elements[j].star)
+					continue;
+				if (!(elements[j].bytes[c / 8] & (1 << (c % 8))) != !(elements[j].bytes[r / 8] & (1 << (r % 8))))
+					break;
+			}
+
+			if (j == position)
+				break;
+		}
+
+		if (k == class_count)
+			representatives[class_count++] = c;
+		set->classes[c] = k;
+	}
+
+	size_t words = (position + 63) / 64, capacity = 16;
+	unsigned long long* states = talloc_zero_array(ctx, unsigned long long, words * capacity);
+	unsigned short* transitions = talloc_array(set, unsigned short, class_count * capacity);
+	bool* accepting = talloc_array(set, bool, capacity);
+	unsigned long long* next = talloc_array(ctx, unsigned long long, words);
+
+	// State 0 matches nothing any more, state 1 is the start.
+	size_t state_count = 2;
+	memset(states + words, 0, words * sizeof(unsigned long long));
+	for (size_t i = 0; i < parsed; ++i)
+		states[words + starts[i] / 64] |= 1ULL << (starts[i] % 64);
+	pattern_closure(elements, ends, position, states + words);
+
+	for (size_t state = 0; state < state_count; ++state)
+	{
+		const unsigned long long* current = states + state * words;
+		accepting[state] = false;
+		for (size_t j = 0; j < position; ++j)
+		{
+			if ((current[j / 64] >> (j % 64)) & 1 && j == ends[j])
+				accepting[state] = true;
+		}
+
+		for (size_t k = 0; k < class_count; ++k)
+		{
+			unsigned int c = representatives[k];
+			memset(next, 0, words * sizeof(unsigned long long));
+			for (size_t j = 0; j < position; ++j)
+			{
+				if (!((current[j / 64] >> (j % 64)) & 1) || j == ends[j])
+					continue;
+
+				size_t target = elements[j].star ? j : j + 1;
+				if (elements[j].star || elements[j].bytes[c / 8] & (1 << (c % 8)))
+					next[target / 64] |= 1ULL << (target % 64);
+			}
+			pattern_closure(elements, ends, position, next);
+
+			size_t found;
+			for (found = 0; found < state_count; ++found)
+			{
+				if (!memcmp(states + found * words, next, words * sizeof(unsigned long long)))
+					break;
+			}
+
+			if (found == state_count)
+			{
+				if (state_count == PATTERN_STATES)
+				{
+					for (size_t i = 0; i < count; ++i)
+					{
+						size_t j = 0;
+						while (j < set->glob_count && set->globs[j] != globs[i])
+							++j;
+						if (j == set->glob_count)
+							set->globs[set->glob_count++] = globs[i];
+					}
+
+					talloc_free(transitions);
+					talloc_free(accepting);
+					talloc_free(ctx);
+					return;
+				}
+
+				if (state_count == capacity)
+				{
+					capacity *= 2;
+					states = talloc_realloc(ctx, states, unsigned long long, words * capacity);
+					transitions = talloc_realloc(set, transitions, unsigned short, class_count * capacity);
+					accepting = talloc_realloc(set, accepting, bool, capacity);
+				}
+
+				memcpy(states + state_count * words, next, words * sizeof(unsigned long long));
+				current = states + state * words;
+				++state_count;
+			}
+
+			transitions[state * class_count + k] = found;
+		}
+	}
+
+	set->state_count = state_count;
+	set->class_count = class_count;
+	set->transitions = transitions;
+	set->accepting = accepting;
+	talloc_free(ctx);
+}
+
+// A star may also match nothing, so a position in front of one reaches the
+// next one too. Positions only ever lead forward, so one pass is enough.
+static void pattern_closure(const struct pattern_element* elements, const size_t* ends, size_t count, unsigned long long* positions)
+{
+	for (size_t j = 0; j < count; ++j)
+	{
+		if ((positions[j / 64] >> (j % 64)) & 1 && j != ends[j] && elements[j].star)
+			positions[(j + 1) / 64] |= 1ULL << ((j + 1) % 64);
+	}
+}
+
+static bool pattern_match(const struct pattern_set* set, struct dir_entry* dir, const char* name)
+{
+	if (set->literals->item_count && hash_map_find(set->literals, (void*)name))
+		return true;
+
+	size_t length = strlen(name);
+	for (size_t i = 0; i < set->suffix_length_count; ++i)
+	{
+		size_t suffix = set->suffix_lengths[i];
+		if (suffix <= length && hash_map_find(set->suffixes, (void*)(name + length - suffix)))
+			return true;
+	}
+
+	if (set->state_count)
+	{
+		size_t state = 1;
+		for (const unsigned char* c = (const unsigned char*)name; *c && state; ++c)
+			state = set->transitions[state * set->class_count + set->classes[*c]];
+
+		if (set->accepting[state])
+			return true;
+	}
+
+	for (size_t i = 0; i < set->glob_count; ++i)
+	{
+		if (!fnmatch(set->globs[i], name, FNM_PATHNAME))
+			return true;
+	}
+
+	char fpath[PATH_MAX];
+	if (set->path_count && path_format(fpath, PATH_MAX, dir, name))
+	{
+		for (size_t i = 0; i < set->path_count; ++i)
+		{
+			if (!fnmatch(set->paths[i], fpath, FNM_PATHNAME))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+// Files outside the size limits, or with too few blocks allocated for linking
+// them to be worth it, are never hashed.
+static bool is_wanted(struct dedupe_state* state, const struct inode_entry* inode)
+{
+	if (inode->size < state->min_size || (state->max_size && inode->size > state->max_size))
+		return false;
+
+	return (unsigned long long)inode->blocks * 512 >= state->min_savings;
+}
+
+static void scan_all(struct dedupe_state* state)
+{
+	struct scan_pool pool = { state, state->jobs };
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+
+	pool.workers = talloc_zero_array(state, struct scan_worker, pool.count);
+	for (unsigned int i = 0; i < pool.count; ++i)
+	{
+		struct scan_worker* worker = &pool.workers[i];
+		worker->pool = &pool;
+		pthread_mutex_init(&worker->lock, NULL);
+
+		if (i)
+		{
+			worker->arena = talloc_zero(state, struct arena);
+			worker->arena->lock = &state->lock;
+		}
+		else
+		{
+			worker->arena = state->arena;
+		}
+
+		if (state->snapshot_path && !(worker->snapshot = tmpfile()))
+			perror("tmpfile");
+
+		if (state->spill_path)
+		{
+			if (!(worker->spill_names = spill_open(state)))
+				state->spill_runs->failed = true;
+			worker->spill_names_index = i;
+		}
+	}
+
+	if (state->spill_path)
+	{
+		state->spill_names_count = pool.count;
+		state->spill_names = talloc_array(state, FILE*, pool.count);
+		for (unsigned int i = 0; i < pool.count; ++i)
+			state->spill_names[i] = pool.workers[i].spill_names;
+	}
+
+	state->snapshot_time = time(NULL);
+
+	for (size_t i = 0; i < state->dircount; ++i)
+		scan_push(&pool.workers[i % pool.count], scan_item_create(NULL, NULL, NULL, state->dirs[i]));
+
+	if (pool.count > 1)
+		state->arena->lock = &state->lock;
+
+	pthread_t* threads = talloc_array(state, pthread_t, pool.count);
+	unsigned int started = 1;
+	for (; started < pool.count; ++started)
+	{
+		int error = pthread_create(&threads[started], NULL, scan_worker, &pool.workers[started]);
+		if (error)
+		{
+			errno = error;
+			perror("pthread_create");
+			break;
+		}
+	}
+
+	scan_worker(&pool.workers[0]);
+
+	for (unsigned int i = 1; i < started; ++i)
+		pthread_join(threads[i], NULL);
+
+	state->arena->lock = NULL;
+
+	if (state->snapshot_path)
+	{
+		size_t count = 0;
+		for (unsigned int i = 0; i < pool.count; ++i)
+			count += pool.workers[i].snapshot_count;
+
+		state->snapshot_files = talloc_array(state, FILE*, pool.count);
+		state->snapshot_new = talloc_array(state, struct snapshot_pending, count);
+
+		unsigned long long base = 0;
+		for (unsigned int i = 0; i < pool.count; ++i)
+		{
+			struct scan_worker* worker = &pool.workers[i];
+			if (!worker->snapshot)
+				continue;
+
+			state->snapshot_files[state->snapshot_file_count++] = worker->snapshot;
+			for (size_t j = 0; j < worker->snapshot_count; ++j)
+			{
+				struct snapshot_pending* pending = &state->snapshot_new[state->snapshot_new_count++];
+				*pending = worker->snapshot_dirs[j];
+				pending->record.offset += base;
+			}
+
+			base += worker->snapshot_size;
+		}
+	}
+
+	for (unsigned int i = 0; i < pool.count; ++i)
+	{
+		free(pool.workers[i].items);
+		free(pool.workers[i].snapshot_dirs);
+		free(pool.workers[i].spill);
+		pthread_mutex_destroy(&pool.workers[i].lock);
+	}
+
+	talloc_free(threads);
+	talloc_free(pool.workers);
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+}
+
+static void* scan_worker(void* worker0)
+{
+	struct scan_worker* worker = worker0;
+	struct scan_pool* pool = worker->pool;
+
+	struct scan_item* item;
+	while ((item = scan_next(worker)))
+	{
+		scan_directory(worker, item);
+
+		pthread_mutex_lock(&pool->lock);
+		if (!--pool->pending)
+			pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	scan_flush(worker);
+	spill_flush(worker);
+#ifdef HAVE_IO_URING
+	uring_release();
+#endif
+	return NULL;
+}
+
+// Pops the most recently queued directory of this worker, which keeps its
+// traversal depth-first, or steals the oldest (and likely largest) subtree
+// from another worker.
+static struct scan_item* scan_next(struct scan_worker* worker)
+{
+	struct scan_pool* pool = worker->pool;
+
+	while (true)
+	{
+		pthread_mutex_lock(&pool->lock);
+		size_t generation = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		struct scan_item* result = NULL;
+
+		pthread_mutex_lock(&worker->lock);
+		if (worker->count)
+		{
+			--worker->count;
+			result = worker->items[(worker->head + worker->count) % worker->capacity];
+		}
+		pthread_mutex_unlock(&worker->lock);
+
+		for (unsigned int i = 1; !result && i < pool->count; ++i)
+		{
+			struct scan_worker* victim = &pool->workers[(worker - pool->workers + i) % pool->count];
+
+			pthread_mutex_lock(&victim->lock);
+			if (victim->count)
+			{
+				result = victim->items[victim->head];
+				victim->head = (victim->head + 1) % victim->capacity;
+				--victim->count;
+			}
+			pthread_mutex_unlock(&victim->lock);
+		}
+
+		if (result)
+			return result;
+
+		pthread_mutex_lock(&pool->lock);
+		while (pool->pending && pool->generation == generation)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		bool done = !pool->pending;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (done)
+			return NULL;
+	}
+}
+
+static void scan_push(struct scan_worker* worker, struct scan_item* item)
+{
+	struct scan_pool* pool = worker->pool;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->count == worker->capacity)
+	{
+		size_t capacity = worker->capacity ? worker->capacity * 2 : 64;
+		struct scan_item** items = malloc(capacity * sizeof(struct scan_item*));
+		for (size_t i = 0; i < worker->count; ++i)
+			items[i] = worker->items[(worker->head + i) % worker->capacity];
+
+		free(worker->items);
+		worker->items = items;
+		worker->capacity = capacity;
+		worker->head = 0;
+	}
+
+	worker->items[(worker->head + worker->count++) % worker->capacity] = item;
+	pthread_mutex_unlock(&worker->lock);
+
+	pthread_mutex_lock(&pool->lock);
+	++pool->pending;
+	++pool->generation;
+	if (pool->count > 1)
+		pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static struct scan_item* scan_item_create(struct scan_item* parent, struct dir_entry* dir, const char* dpath, const char* name)
+{
+	size_t length = strlen(name) + 1;
+	struct scan_item* result = malloc(sizeof(struct scan_item) + length);
+	result->parent = parent;
+	result->dir = dir;
+	result->device = parent ? parent->device : 0;
+	result->stream = NULL;
+	result->refs = 1;
+	memcpy(result->name, name, length);
+
+	if (dpath)
+	{
+		size_t dlength = strlen(dpath);
+		result->path = malloc(dlength + length + 1);
+		memcpy(result->path, dpath, dlength);
+		result->path[dlength] = '/';
+		memcpy(result->path + dlength + 1, name, length);
+	}
+	else
+	{
+		result->path = strdup(name);
+	}
+
+	if (parent)
+		__atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+
+	return result;
+}
+
+static void scan_item_release(struct scan_item* item)
+{
+	if (__atomic_sub_fetch(&item->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	if (item->stream)
+		closedir(item->stream);
+
+	free(item->path);
+	free(item);
+}
+
+static void scan_directory(struct scan_worker* worker, struct scan_item* item)
+{
+	struct dedupe_state* state = worker->pool->state;
+	char* dpath = item->path;
+
+	pthread_mutex_lock(&state->lock);
+	print_progress(state, dpath, 0, 0, 0, 0);
+	pthread_mutex_unlock(&state->lock);
+
+	int fd = openat(item->parent ? dirfd(item->parent->stream) : AT_FDCWD, item->name, O_RDONLY|O_CLOEXEC|O_DIRECTORY);
+	if (item->parent)
+	{
+		scan_item_release(item->parent);
+		item->parent = NULL;
+	}
+
+	if (fd == -1)
+	{
+		perror(dpath);
+		scan_item_release(item);
+		return;
+	}
+
+	struct stat buffer;
+	if (fstat(fd, &buffer) == -1)
+	{
+		perror(dpath);
+		close(fd);
+		scan_item_release(item);
+		return;
+	}
+
+	// Roots may be on any device, but the scan doesn't cross mount points
+	// below them.
+	if (!item->dir)
+		item->device = buffer.st_dev;
+	else if (buffer.st_dev != item->device)
+	{
+		errno = EXDEV;
+		perror(dpath);
+		close(fd);
+		scan_item_release(item);
+		return;
+	}
+
+	if (worker->pool->count == 1)
+		worker->device = device_get(state, buffer.st_dev);
+
+	DIR* d = fdopendir(fd);
+	if (!d)
+	{
+		perror(dpath);
+		close(fd);
+		scan_item_release(item);
+		return;
+	}
+
+	item->stream = d;
+
+	size_t length = strlen(item->name) + 1;
+	struct dir_entry* dentry = arena_alloc(worker->arena, sizeof(struct dir_entry) + length);
+	dentry->parent = item->dir;
+	dentry->stale = false;
+	memcpy(dentry->name, item->name, length);
+
+	if (state->watch)
+		watch_add(state, fd, dpath, dentry, &buffer);
+
+	unsigned long long start = worker->snapshot_size;
+	const struct snapshot_dir* snapshot = snapshot_find(state, &buffer);
+	if (snapshot)
+	{
+		scan_snapshot(worker, item, fd, dentry, snapshot);
+	}
+	else
+	{
+		struct dirent* e;
+		while ((e = TRACE(TRACE_READDIR, readdir(d))))
+		{
+			if (is_excluded(state, dentry, e->d_name))
+				continue;
+
+			if (e->d_type == DT_DIR)
+			{
+				scan_push(worker, scan_item_create(item, dentry, dpath, e->d_name));
+				snapshot_child(worker, DT_DIR, e->d_name, 0, NULL);
+			}
+			else if (e->d_type == DT_REG)
+			{
+				scan_regular(worker, fd, dpath, dentry, e->d_name, e->d_ino, NULL);
+			}
+		}
+	}
+
+#ifdef HAVE_IO_URING
+	if (worker->statx_count)
+		scan_statx(worker, fd, dpath, dentry);
+#endif
+
+	snapshot_end(worker, &buffer, dentry, start, snapshot ? snapshot->scanned : state->snapshot_time);
+	scan_item_release(item);
+}
+
+// Replays the children recorded for a directory whose mtime and ctime haven't
+// changed since the snapshot was taken. Subdirectories are still opened, as
+// their own contents may have changed without touching the parent.
+static void scan_snapshot(struct scan_worker* worker, struct scan_item* item, int fd, struct dir_entry* dentry, const struct snapshot_dir* snapshot)
+{
+	struct dedupe_state* state = worker->pool->state;
+	const unsigned char* p = state->snapshot_blob + snapshot->offset;
+	const unsigned char* end = p + snapshot->size;
+
+	while (end - p >= sizeof(struct snapshot_child))
+	{
+		struct snapshot_child child;
+		memcpy(&child, p, sizeof(struct snapshot_child));
+		p += sizeof(struct snapshot_child);
+
+		size_t extra = child.type == DT_REG ? sizeof(struct snapshot_file) : 0;
+		if (child.length > NAME_MAX || end - p < child.length + extra)
+			break;
+
+		char name[NAME_MAX + 1];
+		memcpy(name, p, child.length);
+		name[child.length] = 0;
+		p += child.length;
+
+		if (child.type == DT_DIR)
+		{
+			if (!is_excluded(state, dentry, name))
+			{
+				scan_push(worker, scan_item_create(item, dentry, item->path, name));
+				snapshot_child(worker, DT_DIR, name, 0, NULL);
+			}
+		}
+		else if (child.type == DT_REG)
+		{
+			struct snapshot_file file;
+			memcpy(&file, p, sizeof(struct snapshot_file));
+			p += sizeof(struct snapshot_file);
+
+			if (is_excluded(state, dentry, name))
+				continue;
+
+			struct inode_entry record;
+			memset(&record, 0, sizeof(struct inode_entry));
+			record.dev = file.dev;
+			record.ino = file.ino;
+			record.size = file.size;
+			record.mtime.tv_sec = file.mtime_sec;
+			record.mtime.tv_nsec = file.mtime_nsec;
+			record.ctime.tv_sec = file.ctime_sec;
+			record.ctime.tv_nsec = file.ctime_nsec;
+			record.nlink = file.nlink;
+			record.blocks = file.blocks;
+			record.unverified = true;
+
+			scan_regular(worker, fd, item->path, dentry, name, file.d_ino, &record);
+		}
+	}
+}
+
+// Adds a regular file found in a directory, stat'ing it unless its record is
+// already known from the snapshot.
+static void scan_regular(struct scan_worker* worker, int fd, const char* dpath, struct dir_entry* dentry, const char* name, ino_t ino, const struct inode_entry* known)
+{
+	struct dedupe_state* state = worker->pool->state;
+
+	// Without other workers the lookup can be done in place, which saves an
+	// fstatat for every additional hardlink.
+	if (worker->pool->count == 1 && !state->spill_path)
+	{
+		struct inode_entry* ientry = hash_map_insert(worker->device->inode_lookup, (void*)ino)->value;
+		if (ientry)
+		{
+			scan_path(worker, ientry, dentry, name);
+			snapshot_child(worker, DT_REG, name, ino, ientry);
+			return;
+		}
+	}
+
+	if (known)
+	{
+		scan_file(worker, dentry, name, ino, known);
+		return;
+	}
+
+#ifdef HAVE_IO_URING
+	if (uring_local(state) && strlen(name) <= NAME_MAX)
+	{
+		worker->statx[worker->statx_count].ino = ino;
+		strcpy(worker->statx[worker->statx_count].name, name);
+
+		if (++worker->statx_count == URING_ENTRIES)
+			scan_statx(worker, fd, dpath, dentry);
+		return;
+	}
+#endif
+
+	struct stat buffer;
+	throttle(state, 0, 1);
+	if (TRACE(TRACE_FSTATAT, fstatat(fd, name, &buffer, AT_SYMLINK_NOFOLLOW)) == -1)
+	{
+		perror_path(dpath, name);
+		return;
+	}
+
+	struct inode_entry record;
+	inode_from_stat(&record, &buffer);
+	scan_file(worker, dentry, name, ino, &record);
+}
+
+#ifdef HAVE_IO_URING
+// Stats the file names queued by scan_directory with a single io_uring_enter,
+// falling back to fstatat if the ring or the kernel can't do it.
+static void scan_statx(struct scan_worker* worker, int fd, const char* dpath, struct dir_entry* dentry)
+{
+	struct uring* ring = uring_local(worker->pool->state);
+	size_t count = worker->statx_count;
+	worker->statx_count = 0;
+
+	for (size_t i = 0; i < count; ++i)
+		worker->statx[i].result = -EAGAIN;
+
+	if (ring)
+	{
+		throttle(worker->pool->state, 0, count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			struct io_uring_sqe* sqe = uring_get_sqe(ring);
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = fd;
+			sqe->addr = (unsigned long long)(uintptr_t)worker->statx[i].name;
+			sqe->len = STATX_TYPE|STATX_INO|STATX_SIZE|STATX_MTIME|STATX_CTIME|STATX_NLINK|STATX_BLOCKS;
+			sqe->off = (unsigned long long)(uintptr_t)&worker->statx[i].buffer;
+			sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+			sqe->user_data = i;
+		}
+
+		// Names whose results didn't come back before the ring failed are
+		// left at -EAGAIN, and stat'ed below instead.
+		bool failed = uring_submit(ring, count) < 0;
+		for (size_t i = 0; i < count && !failed; ++i)
+		{
+			struct io_uring_cqe* cqe;
+			while (!(cqe = uring_peek(ring)) && !(failed = uring_submit(ring, 1) < 0));
+			if (failed)
+				break;
+
+			worker->statx[cqe->user_data].result = cqe->res;
+			uring_advance(ring);
+		}
+
+		if (failed)
+		{
+			perror("io_uring_enter");
+			uring_release();
+			uring_thread_failed = true;
+		}
+	}
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		const char* name = worker->statx[i].name;
+		int result = worker->statx[i].result;
+		struct inode_entry record;
+
+		if (result == -EAGAIN || result == -EINVAL || result == -EOPNOTSUPP)
+		{
+			struct stat buffer;
+			throttle(worker->pool->state, 0, 1);
+			if (TRACE(TRACE_FSTATAT, fstatat(fd, name, &buffer, AT_SYMLINK_NOFOLLOW)) == -1)
+			{
+				perror_path(dpath, name);
+				continue;
+			}
+
+			inode_from_stat(&record, &buffer);
+		}
+		else if (result < 0)
+		{
+			errno = -result;
+			perror_path(dpath, name);
+			continue;
+		}
+		else
+		{
+			const struct statx* buffer = &worker->statx[i].buffer;
+			memset(&record, 0, sizeof(struct inode_entry));
+			record.dev = makedev(buffer->stx_dev_major, buffer->stx_dev_minor);
+			record.ino = buffer->stx_ino;
+			record.size = buffer->stx_size;
+			record.mtime.tv_sec = buffer->stx_mtime.tv_sec;
+			record.mtime.tv_nsec = buffer->stx_mtime.tv_nsec;
+			record.ctime.tv_sec = buffer->stx_ctime.tv_sec;
+			record.ctime.tv_nsec = buffer->stx_ctime.tv_nsec;
+			record.nlink = buffer->stx_nlink;
+			record.blocks = buffer->stx_blocks;
+		}
+
+		scan_file(worker, dentry, name, worker->statx[i].ino, &record);
+	}
+}
+#endif
+
+static void scan_file(struct scan_worker* worker, struct dir_entry* dentry, const char* name, ino_t ino, const struct inode_entry* record)
+{
+	if (worker->pool->state->spill_path)
+	{
+		spill_file(worker, dentry, name, ino, record);
+		return;
+	}
+
+	snapshot_child(worker, DT_REG, name, ino, record);
+
+	// Other links of the inode may be seen by any worker, so they are merged
+	// right away under the lock rather than each getting its own record that
+	// the batch merge would later abandon.
+	if (worker->pool->count > 1 && record->nlink > 1)
+	{
+		struct dedupe_state* state = worker->pool->state;
+
+		pthread_mutex_lock(&state->lock);
+		struct hash_bucket* bucket = hash_map_insert(device_get(state, record->dev)->inode_lookup, (void*)ino);
+		struct inode_entry* ientry = bucket->value;
+		if (!ientry)
+		{
+			ientry = bucket->value = arena_alloc(worker->arena, sizeof(struct inode_entry));
+			*ientry = *record;
+		}
+		else if (ientry->unverified && !record->unverified)
+		{
+			struct path_entry* paths = ientry->paths;
+			*ientry = *record;
+			ientry->paths = paths;
+		}
+
+		scan_path(worker, ientry, dentry, name);
+		pthread_mutex_unlock(&state->lock);
+		return;
+	}
+
+	struct inode_entry* ientry = arena_alloc(worker->arena, sizeof(struct inode_entry));
+	*ientry = *record;
+	scan_path(worker, ientry, dentry, name);
+
+	if (worker->pool->count == 1)
+	{
+		scan_insert(worker->pool->state, ientry, ino);
+		return;
+	}
+
+	worker->batch[worker->batch_count].inode = ientry;
+	worker->batch[worker->batch_count].ino = ino;
+	if (++worker->batch_count == sizeof(worker->batch) / sizeof(worker->batch[0]))
+		scan_flush(worker);
+}
+
+static void scan_path(struct scan_worker* worker, struct inode_entry* ientry, struct dir_entry* dentry, const char* name)
+{
+	size_t length = strlen(name) + 1;
+	struct path_entry* pentry = arena_alloc(worker->arena, sizeof(struct path_entry) + length);
+	pentry->next = ientry->paths;
+	ientry->paths = pentry;
+
+	pentry->dir = dentry;
+	memcpy(pentry->name, name, length);
+}
+
+// Returns the partition for a device, creating it on first use. Callers that
+// share the state with other threads must hold the lock.
+static struct device_entry* device_get(struct dedupe_state* state, dev_t dev)
+{
+	struct device_entry* device = device_find(state, dev);
+	if (device)
+		return device;
+
+	device = talloc_zero(state, struct device_entry);
+	device->dev = dev;
+	device->inode_lookup = hash_map_create(device, &hash_ptr_descriptor, 0);
+	if (state->watch)
+		device->watch_dirs = hash_map_create(device, &hash_ptr_descriptor, 0);
+
+	state->devices = talloc_realloc(state, state->devices, struct device_entry*, state->device_count + 1);
+	state->devices[state->device_count++] = device;
+	return device;
+}
+
+// There are only ever a few devices, so they are simply searched in order.
+static struct device_entry* device_find(struct dedupe_state* state, dev_t dev)
+{
+	for (size_t i = 0; i < state->device_count; ++i)
+	{
+		if (state->devices[i]->dev == dev)
+			return state->devices[i];
+	}
+
+	return NULL;
+}
+
+static void scan_insert(struct dedupe_state* state, struct inode_entry* ientry, ino_t ino)
+{
+	struct hash_bucket* bucket = hash_map_insert(device_get(state, ientry->dev)->inode_lookup, (void*)ino);
+	struct inode_entry* existing = bucket->value;
+
+	if (!existing)
+	{
+		bucket->value = ientry;
+		return;
+	}
+
+	if (existing->unverified && !ientry->unverified)
+	{
+		struct path_entry* paths = existing->paths;
+		*existing = *ientry;
+		existing->paths = paths;
+	}
+
+	while (ientry->paths)
+	{
+		struct path_entry* pentry = ientry->paths;
+		ientry->paths = pentry->next;
+		pentry->next = existing->paths;
+		existing->paths = pentry;
+	}
+}
+
+static void scan_flush(struct scan_worker* worker)
+{
+	if (!worker->batch_count)
+		return;
+
+	struct dedupe_state* state = worker->pool->state;
+
+	pthread_mutex_lock(&state->lock);
+	for (size_t i = 0; i < worker->batch_count; ++i)
+		scan_insert(state, worker->batch[i].inode, worker->batch[i].ino);
+	pthread_mutex_unlock(&state->lock);
+
+	worker->batch_count = 0;
+}
+
+static void perror_path(const char* dpath, const char* name)
+{
+	fprintf(stderr, "%s/%s: %s\n", dpath, name, strerror(errno));
+}
+
+static void bucketize_by_size(void* state0, struct hash_bucket* inode_bucket)
+{
+	struct dedupe_state* state = state0;
+	struct inode_entry* ientry = inode_bucket->value;
+	if (!ientry)
+		return;
+
+	++state->inode_count;
+	if (state->stats)
+	{
+		for (struct path_entry* path = ientry->paths; path; path = path->next)
+			++state->file_count;
+	}
+
+	if (!is_wanted(state, ientry))
+		return;
+
+	struct hash_bucket* size_bucket = hash_map_insert(device_find(state, ientry->dev)->size_lookup, (void*)ientry->size);
+	++size_bucket->dummy;
+	ientry->next_by_size = size_bucket->value;
+	size_bucket->value = ientry;
+}
+
+static void gather_tohash(struct dedupe_state* state0)
+{
+	struct gather_state state1 = { state0, 16, 16 };
+
+	state0->tohash_count = 0;
+	state0->tohash_size = 0;
+	state0->tohash_list = talloc_array(state0, struct inode_entry*, state1.capacity);
+
+	state0->tocompare_count = 0;
+	state0->tocompare_size = 0;
+	state0->tocompare_list = talloc_array(state0, struct inode_entry*, state1.compare_capacity);
+
+	for (size_t i = 0; i < state0->device_count; ++i)
+	{
+		size_t start = state0->tohash_count;
+		hash_map_walk(state0->devices[i]->size_lookup, &state1, gather_tohash_walkcb);
+		state0->devices[i]->tohash_count = state0->tohash_count - start;
+	}
+	qsort(state0->tohash_list, state0->tohash_count, sizeof(struct inode_entry*), gather_tohash_sortcb);
+
+	unsigned char* digests = talloc_array(state0, unsigned char, state0->tohash_count * DIGEST_MAX_LENGTH);
+	for (size_t i = 0; i < state0->tohash_count; ++i)
+		state0->tohash_list[i]->hash = digests + i * DIGEST_MAX_LENGTH;
+}
+
+static void gather_tohash_walkcb(void* state0, struct hash_bucket* size_bucket)
+{
+	struct gather_state* state1 = state0;
+	struct dedupe_state* state2 = state1->state0;
+
+	// A manifest needs the digest of every file, not only of those that have
+	// company on this host.
+	if (size_bucket->dummy < 2 && !state2->manifest_path)
+		return;
+
+	if (state2->compare && !state2->xattrs && !state2->index_path && size_bucket->dummy == 2)
+	{
+		if (state1->compare_capacity == state2->tocompare_count)
+		{
+			state1->compare_capacity *= 2;
+			state2->tocompare_list = talloc_realloc(state2, state2->tocompare_list, struct inode_entry*, state1->compare_capacity);
+		}
+
+		struct inode_entry* inode = size_bucket->value;
+		state2->tocompare_list[state2->tocompare_count++] = inode;
+		state2->tocompare_size += inode->size * 2;
+		return;
+	}
+
+	for (struct inode_entry* inode = size_bucket->value; inode; inode = inode->next_by_size)
+	{
+		if (state1->capacity == state2->tohash_count)
+		{
+			state1->capacity *= 2;
+			state2->tohash_list = talloc_realloc(state2, state2->tohash_list, struct inode_entry*, state1->capacity);
+		}
+
+		state2->tohash_list[state2->tohash_count++] = inode;
+		state2->tohash_size += inode->size;
+	}
+}
+
+static int gather_tohash_sortcb(const void* p1, const void* p2)
+{
+	struct inode_entry
+		*inode0 = *((struct inode_entry* const*)p1),
+		*inode1 = *((struct inode_entry* const*)p2);
+
+	off_t sz0 = inode0->size,
+		sz1 = inode1->size;
+
+	if (sz0 < sz1)
+		return -1;
+	else if (sz0 > sz1)
+		return 1;
+	else if (inode0->dev != inode1->dev)
+		return inode0->dev < inode1->dev ? -1 : 1;
+	else
+		return 0;
+}
+
+static void prefilter_all(struct dedupe_state* state)
+{
+	unsigned long long total = 0;
+	for (size_t i = 0; i < state->tohash_count; ++i)
+	{
+		off_t size = state->tohash_list[i]->size;
+		total += size > state->prefilter * 2 ? state->prefilter * 2 : size;
+	}
+
+	process_inodes(state, state->tohash_list, state->tohash_count, prefilter_inode, total);
+
+	size_t count = 0;
+	state->tohash_size = 0;
+	for (size_t i = 0, j; i < state->tohash_count; i = j)
+	{
+		off_t size = state->tohash_list[i]->size;
+		dev_t dev = state->tohash_list[i]->dev;
+		for (j = i + 1; j < state->tohash_count && state->tohash_list[j]->size == size && state->tohash_list[j]->dev == dev; ++j);
+
+		// Cached files have no sample to compare the others with, so a bucket
+		// that has any is kept whole and fully hashed.
+		bool cached = false;
+		for (size_t k = i; k < j && !cached; ++k)
+			cached = state->tohash_list[k]->cached;
+
+		if (size > state->prefilter * 2 && !cached)
+			qsort(state->tohash_list + i, j - i, sizeof(struct inode_entry*), prefilter_sortcb);
+
+		for (size_t k = i; k < j; ++k)
+		{
+			struct inode_entry* inode = state->tohash_list[k];
+
+			if (size > state->prefilter * 2 && cached)
+			{
+				if (!inode->hashed && !inode->cached)
+					continue;
+
+				inode->hashed = false;
+			}
+			else if (size > state->prefilter * 2)
+			{
+				if (!inode->hashed)
+					continue;
+
+				bool same_prev = k > i && state->tohash_list[k - 1]->hashed && !prefilter_sortcb(&state->tohash_list[k - 1], &inode);
+				bool same_next = k + 1 < j && !prefilter_sortcb(&state->tohash_list[k + 1], &inode);
+				if (!same_prev && !same_next)
+				{
+					inode->hashed = false;
+					continue;
+				}
+			}
+
+			state->tohash_list[count++] = inode;
+			state->tohash_size += size;
+		}
+	}
+
+	state->tohash_count = count;
+}
+
+// Files whose digest is already in the index or their extended attributes
+// are marked cached rather than sampled, as hashing them reads nothing.
+static bool prefilter_inode(struct dedupe_state* state, struct inode_entry* inode)
+{
+	off_t size = inode->size;
+	inode->cached = false;
+	if (size <= state->prefilter * 2)
+	{
+		hash_progress(state, NULL, 1, size);
+		return false;
+	}
+
+	if (index_find(state, inode))
+	{
+		inode->cached = true;
+		hash_progress(state, NULL, 1, state->prefilter * 2);
+		return false;
+	}
+
+	char fpath[PATH_MAX];
+	int fd = open_inode(state, inode, fpath, O_RDONLY);
+	if (fd == -1)
+	{
+		hash_progress(state, NULL, 1, state->prefilter * 2);
+		return false;
+	}
+
+	if (hash_xattr_read(state, fd, inode))
+	{
+		inode->cached = true;
+		close(fd);
+		hash_progress(state, fpath, 1, state->prefilter * 2);
+		return false;
+	}
+
+	hash_progress(state, fpath, 0, 0);
+
+	throttle(state, state->prefilter * 2, 2);
+
+	bool result = false;
+	ssize_t head = 0, tail = 0;
+	unsigned char* data = malloc(state->prefilter * 2);
+	if (!data)
+	{
+		perror(fpath);
+	}
+	else if ((head = pread(fd, data, state->prefilter, 0)) == -1 ||
+		(head == state->prefilter && (tail = pread(fd, data + state->prefilter, state->prefilter, size - state->prefilter)) == -1))
+	{
+		perror(fpath);
+	}
+	else if (head != state->prefilter || tail != state->prefilter)
+	{
+		fprintf(stderr, "%s: truncated while reading\n", fpath);
+	}
+	else
+	{
+		union digest_context ctx;
+		state->digest->init_function(&ctx);
+		state->digest->update_function(&ctx, &size, sizeof(size));
+		state->digest->update_function(&ctx, data, state->prefilter * 2);
+		digest_final(state, &ctx, inode->hash);
+		stats_digested(state, state->prefilter * 2);
+		result = true;
+	}
+
+	free(data);
+	close(fd);
+
+	hash_progress(state, fpath, 1, state->prefilter * 2);
+	return result;
+}
+
+static int prefilter_sortcb(const void* p1, const void* p2)
+{
+	struct inode_entry
+		*inode0 = *((struct inode_entry* const*)p1),
+		*inode1 = *((struct inode_entry* const*)p2);
+
+	if (inode0->hashed != inode1->hashed)
+		return inode0->hashed ? -1 : 1;
+
+	return memcmp(inode0->hash, inode1->hash, DIGEST_MAX_LENGTH);
+}
+
+// Inodes replayed from the snapshot may have been modified in place without
+// their directory changing, so the candidates among them are stat'ed again and
+// dropped if anything differs.
+static void validate_all(struct dedupe_state* state)
+{
+	size_t count = 0;
+	struct inode_entry** list = talloc_array(state, struct inode_entry*, state->tohash_count + state->tocompare_count * 2);
+
+	for (size_t i = 0; i < state->tohash_count; ++i)
+	{
+		if (state->tohash_list[i]->unverified)
+			list[count++] = state->tohash_list[i];
+	}
+
+	for (size_t i = 0; i < state->tocompare_count; ++i)
+	{
+		struct inode_entry* inode = state->tocompare_list[i];
+		if (inode->unverified)
+			list[count++] = inode;
+		if (inode->next_by_size->unverified)
+			list[count++] = inode->next_by_size;
+	}
+
+	if (count)
+		process_inodes(state, list, count, validate_inode, 0);
+
+	talloc_free(list);
+
+	count = 0;
+	state->tohash_size = 0;
+	for (size_t i = 0; i < state->tohash_count; ++i)
+	{
+		struct inode_entry* inode = state->tohash_list[i];
+		if (inode->stale)
+			continue;
+
+		state->tohash_list[count++] = inode;
+		state->tohash_size += inode->size;
+	}
+
+	state->tohash_count = count;
+
+	count = 0;
+	state->tocompare_size = 0;
+	for (size_t i = 0; i < state->tocompare_count; ++i)
+	{
+		struct inode_entry* inode = state->tocompare_list[i];
+		if (inode->stale || inode->next_by_size->stale)
+			continue;
+
+		state->tocompare_list[count++] = inode;
+		state->tocompare_size += inode->size * 2;
+	}
+
+	state->tocompare_count = count;
+}
+
+static bool validate_inode(struct dedupe_state* state, struct inode_entry* inode)
+{
+	char fpath[PATH_MAX];
+	struct stat buffer;
+	throttle(state, 0, 1);
+
+	if (!path_format(fpath, PATH_MAX, inode->paths->dir, inode->paths->name))
+	{
+		perror(fpath);
+	}
+	else if (lstat(fpath, &buffer) == -1)
+	{
+		if (errno != ENOENT)
+			perror(fpath);
+	}
+	else if (S_ISREG(buffer.st_mode) && buffer.st_dev == inode->dev && buffer.st_ino == inode->ino &&
+		buffer.st_size == inode->size &&
+		buffer.st_mtim.tv_sec == inode->mtime.tv_sec && buffer.st_mtim.tv_nsec == inode->mtime.tv_nsec &&
+		buffer.st_ctim.tv_sec == inode->ctime.tv_sec && buffer.st_ctim.tv_nsec == inode->ctime.tv_nsec)
+	{
+		inode->unverified = false;
+		hash_progress(state, fpath, 1, 0);
+		return true;
+	}
+
+	pthread_mutex_lock(&state->lock);
+	inode->stale = true;
+	for (struct path_entry* path = inode->paths; path; path = path->next)
+		path->dir->stale = true;
+	pthread_mutex_unlock(&state->lock);
+
+	hash_progress(state, fpath, 1, 0);
+	return false;
+}
+
+static void hash_all(struct dedupe_state* state)
+{
+	for (size_t i = 0; i < state->device_count; ++i)
+		state->devices[i]->hash_lookup = hash_map_create(state->devices[i], &hash_digest_descriptor, state->devices[i]->tohash_count);
+
+	if (state->prefilter_only || state->pipeline)
+	{
+		size_t count = 0;
+		unsigned long long size = 0;
+		struct inode_entry** list = talloc_array(state, struct inode_entry*, state->tohash_count);
+		for (size_t i = 0; i < state->tohash_count; ++i)
+		{
+			struct inode_entry* inode = state->tohash_list[i];
+			if (state->prefilter_only && inode->hashed)
+				continue;
+
+			list[count++] = inode;
+			size += inode->size;
+		}
+
+		order_inodes(state, list, count);
+		if (state->pipeline)
+			pipeline_hash(state, list, count, size);
+		else
+			process_inodes(state, list, count, hash_inode, size);
+		talloc_free(list);
+
+		if (state->pipeline)
+			return;
+	}
+	else
+	{
+		order_inodes(state, state->tohash_list, state->tohash_count);
+		process_inodes(state, state->tohash_list, state->tohash_count, hash_inode, state->tohash_size);
+	}
+
+	for (size_t i = 0; i < state->tohash_count; ++i)
+	{
+		struct inode_entry* inode = state->tohash_list[i];
+		if (!inode->hashed)
+			continue;
+
+		struct hash_bucket* bucket = hash_map_insert(device_find(state, inode->dev)->hash_lookup, inode->hash);
+		++bucket->dummy;
+		inode->next_by_hash = bucket->value;
+		bucket->value = inode;
+	}
+}
+
+// Hashes the list while a separate thread relinks the duplicates of every size
+// bucket as soon as all of its members are hashed, so linking overlaps with
+// reading and an interrupted run keeps what it already saved. tohash_list is
+// still sorted by size and device here, which makes the buckets runs of it.
+static void pipeline_hash(struct dedupe_state* state, struct inode_entry** list, size_t count, unsigned long long size)
+{
+	state->pipeline_group_count = 0;
+	state->pipeline_groups = talloc_array(state, struct pipeline_group, state->tohash_count);
+	for (size_t i = 0, j; i < state->tohash_count; i = j)
+	{
+		struct pipeline_group* group = &state->pipeline_groups[state->pipeline_group_count++];
+		group->size = state->tohash_list[i]->size;
+		group->dev = state->tohash_list[i]->dev;
+		group->start = i;
+		group->remaining = 0;
+
+		for (j = i; j < state->tohash_count && state->tohash_list[j]->size == group->size && state->tohash_list[j]->dev == group->dev; ++j)
+		{
+			if (!state->prefilter_only || !state->tohash_list[j]->hashed)
+				++group->remaining;
+		}
+
+		group->count = j - i;
+	}
+
+	state->pipeline_done = false;
+	state->pipeline_count = 0;
+	state->pipeline_next = 0;
+	state->pipeline_capacity = 16;
+	state->pipeline_queue = talloc_array(state, struct hash_bucket, state->pipeline_capacity);
+	pthread_cond_init(&state->pipeline_cond, NULL);
+
+	// Buckets the prefilter already hashed in full are done before starting.
+	for (size_t i = 0; i < state->pipeline_group_count; ++i)
+	{
+		if (!state->pipeline_groups[i].remaining)
+			pipeline_finish(state, &state->pipeline_groups[i]);
+	}
+
+	pthread_t thread;
+	int error = pthread_create(&thread, NULL, pipeline_relink, state);
+	if (error)
+	{
+		errno = error;
+		perror("pthread_create");
+	}
+
+	process_inodes(state, list, count, pipeline_inode, size);
+
+	pthread_mutex_lock(&state->lock);
+	state->pipeline_done = true;
+	pthread_cond_signal(&state->pipeline_cond);
+	pthread_mutex_unlock(&state->lock);
+
+	// Without a thread of its own, relinking simply follows hashing.
+	if (error)
+		pipeline_relink(state);
+	else
+		pthread_join(thread, NULL);
+
+	pthread_cond_destroy(&state->pipeline_cond);
+}
+
+static bool pipeline_inode(struct dedupe_state* state, struct inode_entry* inode)
+{
+	inode->hashed = hash_inode(state, inode);
+
+	pthread_mutex_lock(&state->lock);
+	size_t low = 0, high = state->pipeline_group_count;
+	while (low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+		struct pipeline_group* group = &state->pipeline_groups[middle];
+		if (group->size < inode->size || (group->size == inode->size && group->dev < inode->dev))
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	struct pipeline_group* group = &state->pipeline_groups[low];
+	if (!--group->remaining)
+		pipeline_finish(state, group);
+	pthread_mutex_unlock(&state->lock);
+
+	return inode->hashed;
+}
+
+// Adds the members of a finished bucket to the digest lookup and queues every
+// duplicate group among them. The queue holds copies, as further inserts may
+// move the buckets around. Called with the lock held once other threads run.
+static void pipeline_finish(struct dedupe_state* state, struct pipeline_group* group)
+{
+	struct hash_map* hash_lookup = device_find(state, group->dev)->hash_lookup;
+	struct inode_entry** members = state->tohash_list + group->start;
+
+	for (size_t i = 0; i < group->count; ++i)
+	{
+		struct inode_entry* inode = members[i];
+		if (!inode->hashed)
+			continue;
+
+		struct hash_bucket* bucket = hash_map_insert(hash_lookup, inode->hash);
+		++bucket->dummy;
+		inode->next_by_hash = bucket->value;
+		bucket->value = inode;
+	}
+
+	bool queued = false;
+	for (size_t i = 0; i < group->count; ++i)
+	{
+		struct inode_entry* inode = members[i];
+		if (!inode->hashed)
+			continue;
+
+		struct hash_bucket* bucket = hash_map_insert(hash_lookup, inode->hash);
+		if (bucket->value != inode || bucket->dummy < 2)
+			continue;
+
+		if (state->pipeline_count == state->pipeline_capacity)
+		{
+			state->pipeline_capacity *= 2;
+			state->pipeline_queue = talloc_realloc(state, state->pipeline_queue, struct hash_bucket, state->pipeline_capacity);
+		}
+
+		state->pipeline_queue[state->pipeline_count++] = *bucket;
+		queued = true;
+	}
+
+	if (queued)
+		pthread_cond_signal(&state->pipeline_cond);
+}
+
+static void* pipeline_relink(void* state0)
+{
+	struct dedupe_state* state = state0;
+
+	pthread_mutex_lock(&state->lock);
+	while (true)
+	{
+		if (state->pipeline_next == state->pipeline_count)
+		{
+			if (state->pipeline_done)
+				break;
+
+			pthread_cond_wait(&state->pipeline_cond, &state->lock);
+			continue;
+		}
+
+		struct hash_bucket bucket = state->pipeline_queue[state->pipeline_next++];
+		pthread_mutex_unlock(&state->lock);
+
+		relink(state, &bucket);
+
+		pthread_mutex_lock(&state->lock);
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	dir_release();
+	return NULL;
+}
+
+// Size order keeps the files of a bucket together, but on rotating disks the
+// seeks between them can cost more than the reads. Going through the files in
+// inode order, or in the order of their first extent, keeps reads close to
+// sequential instead.
+static void order_inodes(struct dedupe_state* state, struct inode_entry** list, size_t count)
+{
+	if (!state->order->sort_function)
+		return;
+
+	if (state->order->locate_function)
+	{
+		for (size_t i = 0; i < count; ++i)
+			state->order->locate_function(state, list[i]);
+	}
+
+	qsort(list, count, sizeof(struct inode_entry*), state->order->sort_function);
+}
+
+#ifdef FS_IOC_FIEMAP
+// Files with a cached digest aren't read, so they simply go first. Files
+// without a known extent, such as those on file systems lacking FIEMAP, go
+// last in inode order.
+static void order_locate(struct dedupe_state* state, struct inode_entry* inode)
+{
+	char fpath[PATH_MAX];
+	inode->physical = 0;
+	if (index_find(state, inode))
+		return;
+
+	int fd = open_inode(state, inode, fpath, O_RDONLY);
+	inode->physical = ULLONG_MAX;
+	if (fd != -1 && hash_xattr_read(state, fd, inode))
+	{
+		inode->physical = 0;
+		close(fd);
+	}
+	else if (fd != -1)
+	{
+		struct fiemap* map = alloca(sizeof(struct fiemap) + sizeof(struct fiemap_extent));
+		memset(map, 0, sizeof(struct fiemap) + sizeof(struct fiemap_extent));
+		map->fm_length = FIEMAP_MAX_OFFSET;
+		map->fm_extent_count = 1;
+
+		if (ioctl(fd, FS_IOC_FIEMAP, map) != -1 && map->fm_mapped_extents &&
+			!(map->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN|FIEMAP_EXTENT_DATA_INLINE)))
+			inode->physical = map->fm_extents[0].fe_physical;
+
+		close(fd);
+	}
+}
+
+static int order_physical_sortcb(const void* p1, const void* p2)
+{
+	struct inode_entry
+		*inode0 = *((struct inode_entry* const*)p1),
+		*inode1 = *((struct inode_entry* const*)p2);
+
+	if (inode0->physical != inode1->physical)
+		return inode0->physical < inode1->physical ? -1 : 1;
+	else
+		return order_inode_sortcb(p1, p2);
+}
+#endif
+
+// Devices are interleaved rather than one after the other, so that with
+// several jobs each of them gets read at once.
+static int order_inode_sortcb(const void* p1, const void* p2)
+{
+	struct inode_entry
+		*inode0 = *((struct inode_entry* const*)p1),
+		*inode1 = *((struct inode_entry* const*)p2);
+
+	if (inode0->ino != inode1->ino)
+		return inode0->ino < inode1->ino ? -1 : 1;
+	else if (inode0->dev != inode1->dev)
+		return inode0->dev < inode1->dev ? -1 : 1;
+	else
+		return 0;
+}
+
+static void compare_all(struct dedupe_state* state)
+{
+	if (!state->tocompare_count)
+		return;
+
+	qsort(state->tocompare_list, state->tocompare_count, sizeof(struct inode_entry*), gather_tohash_sortcb);
+	process_inodes(state, state->tocompare_list, state->tocompare_count, compare_inode, state->tocompare_size);
+}
+
+static bool compare_inode(struct dedupe_state* state, struct inode_entry* inode)
+{
+	return compare_contents(state, inode, inode->next_by_size, true);
+}
+
+static bool compare_contents(struct dedupe_state* state, struct inode_entry* inode, struct inode_entry* other, bool progress)
+{
+	off_t size = inode->size;
+
+	if (!size)
+	{
+		if (progress)
+			hash_progress(state, NULL, 1, 0);
+		return true;
+	}
+
+	bool result = false;
+	unsigned long long reported = 0;
+	unsigned char *data0 = MAP_FAILED, *data1 = MAP_FAILED;
+
+	char fpath0[PATH_MAX], fpath1[PATH_MAX];
+	int fd0 = open_inode(state, inode, fpath0, O_RDONLY), fd1 = -1;
+	if (fd0 == -1)
+		goto done;
+
+	fd1 = open_inode(state, other, fpath1, O_RDONLY);
+	if (fd1 == -1)
+		goto done;
+
+	if (progress)
+		hash_progress(state, fpath0, 0, 0);
+
+	data0 = mmap(NULL, size, PROT_READ, MAP_SHARED, fd0, 0);
+	if (data0 == MAP_FAILED)
+	{
+		perror(fpath0);
+		goto done;
+	}
+
+	data1 = mmap(NULL, size, PROT_READ, MAP_SHARED, fd1, 0);
+	if (data1 == MAP_FAILED)
+	{
+		perror(fpath1);
+		goto done;
+	}
+
+	const size_t chunk_size = 0x2000000;
+	for (size_t offset = 0; offset < size; offset += chunk_size)
+	{
+		if (offset && progress)
+		{
+			hash_progress(state, fpath0, 0, (offset - reported) * 2);
+			reported = offset;
+		}
+
+		size_t remaining = size - offset;
+		if (remaining > chunk_size)
+			remaining = chunk_size;
+
+		throttle(state, remaining * 2, (remaining + READ_BUFFER_SIZE - 1) / READ_BUFFER_SIZE * 2);
+		if (memcmp(data0 + offset, data1 + offset, remaining))
+			goto done;
+	}
+
+	result = true;
+
+done:
+	if (data1 != MAP_FAILED)
+		munmap(data1, size);
+	if (data0 != MAP_FAILED)
+		munmap(data0, size);
+	if (fd1 != -1)
+		close(fd1);
+	if (fd0 != -1)
+		close(fd0);
+
+	if (progress)
+		hash_progress(state, fpath0, 1, (size - reported) * 2);
+	return result;
+}
+
+static void process_inodes(struct dedupe_state* state, struct inode_entry** list, size_t count, bool (*process)(struct dedupe_state*, struct inode_entry*), unsigned long long total)
+{
+	state->process = process;
+	state->process_count = count;
+	state->process_list = list;
+	state->tohash_next = 0;
+	state->hashed_count = 0;
+	state->hashed_size = 0;
+	state->progress_size = total;
+
+	unsigned int threads = state->jobs;
+	if (threads > count)
+		threads = count ? count : 1;
+
+	pthread_t* workers = talloc_array(state, pthread_t, threads);
+	unsigned int started = 1;
+	for (; started < threads; ++started)
+	{
+		int error = pthread_create(&workers[started], NULL, hash_worker, state);
+		if (error)
+		{
+			errno = error;
+			perror("pthread_create");
+			break;
+		}
+	}
+
+	hash_worker(state);
+
+	for (unsigned int i = 1; i < started; ++i)
+		pthread_join(workers[i], NULL);
+
+	talloc_free(workers);
+}
+
+static void* hash_worker(void* state0)
+{
+	struct dedupe_state* state = state0;
+
+	// Runs of small files are read whole and hashed together. Other readers
+	// and io_uring keep their own way of reading.
+	bool small = state->process == hash_inode && state->reader->read_function == read_mmap && !state->uring;
+
+	while (true)
+	{
+		pthread_mutex_lock(&state->lock);
+		size_t i = state->tohash_next, count = 1;
+		while (small && i + count < state->process_count && count < DIGEST_BATCH &&
+			state->process_list[i]->size <= SMALL_FILE_SIZE &&
+			state->process_list[i + count]->size <= SMALL_FILE_SIZE)
+			++count;
+		state->tohash_next += count;
+		pthread_mutex_unlock(&state->lock);
+
+		if (i >= state->process_count)
+			break;
+
+		// pipeline_inode marks the inode itself before counting down its
+		// bucket, which the relink thread may own by the time it returns.
+		struct inode_entry* inode = state->process_list[i];
+		if (small && inode->size <= SMALL_FILE_SIZE)
+			hash_small(state, &state->process_list[i], count);
+		else if (state->process == pipeline_inode)
+			pipeline_inode(state, inode);
+		else
+			inode->hashed = state->process(state, inode);
+	}
+
+#ifdef HAVE_IO_URING
+	uring_release();
+#endif
+	read_release();
+	dir_release();
+	return NULL;
+}
+
+// Opens the file relative to its directory, so that the kernel doesn't walk
+// the whole path again for every file. fpath is still filled in for messages.
+static int open_inode(struct dedupe_state* state, struct inode_entry* inode, char* fpath, int flags)
+{
+	*fpath = 0;
+	for (struct path_entry* path = inode->paths; path; path = path->next)
+	{
+		if (!path_format(fpath, PATH_MAX, path->dir, path->name))
+		{
+			perror(fpath);
+			continue;
+		}
+
+		int dfd = dir_open(path->dir);
+		if (dfd == -1)
+			continue;
+
+		int fd;
+		while ((fd = TRACE_COUNT(state->open_count, TRACE_OPEN, openat(dfd, path->name, flags|O_CLOEXEC|O_NOFOLLOW))) == -1 && dir_evict());
+		if (fd == -1)
+			perror(fpath);
+		else
+			return fd;
+	}
+
+	return -1;
+}
+
+static bool hash_inode(struct dedupe_state* state, struct inode_entry* inode)
+{
+	bool result = false;
+	unsigned long long reported = 0;
+
+	char fpath[PATH_MAX];
+	*fpath = 0;
+
+	const struct index_record* record = index_find(state, inode);
+	if (record)
+	{
+		memcpy(inode->hash, record->hash, DIGEST_MAX_LENGTH);
+		__atomic_add_fetch(&state->cached_size, inode->size, __ATOMIC_RELAXED);
+		result = true;
+		goto done;
+	}
+
+	int fd = open_inode(state, inode, fpath, O_RDONLY);
+	if (fd == -1)
+		goto done;
+
+	hash_progress(state, fpath, 0, 0);
+
+	if (!hash_xattr_load(state, fd, inode))
+	{
+		struct hash_context ctx = { state, fpath };
+		state->digest->init_function(&ctx.digest);
+
+		bool success = read_inode(state, fd, fpath, inode->size, hash_chunk, &ctx);
+		reported = ctx.reported;
+		if (!success)
+		{
+			close(fd);
+			goto done;
+		}
+
+		digest_final(state, &ctx.digest, inode->hash);
+		hash_xattr_store(state, fd, inode);
+		stats_digested(state, inode->size);
+	}
+
+	close(fd);
+	checkpoint_add(state, inode);
+	result = true;
+
+done:
+	hash_progress(state, fpath, 1, inode->size - reported);
+	return result;
+}
+
+// Reads each file into its own slice of the thread's buffer with a single
+// pread instead of mapping it, then hashes all of them at once, through the
+// digest's batch kernel where the CPU has one.
+static void hash_small(struct dedupe_state* state, struct inode_entry** list, size_t count)
+{
+	unsigned char* buffer = read_local();
+	if (!buffer)
+	{
+		for (size_t i = 0; i < count; ++i)
+			list[i]->hashed = hash_inode(state, list[i]);
+		return;
+	}
+
+	struct inode_entry* inodes[DIGEST_BATCH];
+	int fds[DIGEST_BATCH];
+	const unsigned char* data[DIGEST_BATCH];
+	size_t sizes[DIGEST_BATCH];
+	unsigned char* hashes[DIGEST_BATCH];
+	size_t pending = 0;
+	char fpath[PATH_MAX];
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		struct inode_entry* inode = list[i];
+		inode->hashed = false;
+		*fpath = 0;
+
+		const struct index_record* record = index_find(state, inode);
+		if (record)
+		{
+			memcpy(inode->hash, record->hash, DIGEST_MAX_LENGTH);
+			__atomic_add_fetch(&state->cached_size, inode->size, __ATOMIC_RELAXED);
+			inode->hashed = true;
+			hash_progress(state, fpath, 1, inode->size);
+			continue;
+		}
+
+		int fd = open_inode(state, inode, fpath, O_RDONLY);
+		if (fd == -1)
+		{
+			hash_progress(state, fpath, 1, inode->size);
+			continue;
+		}
+
+		hash_progress(state, fpath, 0, 0);
+
+		if (hash_xattr_load(state, fd, inode))
+		{
+			close(fd);
+			checkpoint_add(state, inode);
+			inode->hashed = true;
+			hash_progress(state, NULL, 1, inode->size);
+			continue;
+		}
+
+		unsigned char* slice = buffer + pending * SMALL_FILE_SIZE;
+		size_t size = inode->size;
+		bool success = true;
+		if (size)
+			throttle(state, size, 1);
+
+		for (size_t offset = 0; offset < size && success;)
+		{
+			ssize_t length = TRACE(TRACE_READ, pread(fd, slice + offset, size - offset, offset));
+			if (length == -1 && errno == EINTR)
+				continue;
+
+			if (length == -1)
+			{
+				perror(fpath);
+				success = false;
+			}
+			else if (!length)
+			{
+				fprintf(stderr, "%s: truncated while reading\n", fpath);
+				success = false;
+			}
+
+			offset += length;
+		}
+
+		if (!success)
+		{
+			close(fd);
+			hash_progress(state, NULL, 1, inode->size);
+			continue;
+		}
+
+		inodes[pending] = inode;
+		fds[pending] = fd;
+		data[pending] = slice;
+		sizes[pending] = size;
+		hashes[pending] = inode->hash;
+		memset(inode->hash, 0, DIGEST_MAX_LENGTH);
+		++pending;
+	}
+
+	if (state->digest_batch)
+	{
+		state->digest->batch_function(data, sizes, pending, hashes);
+	}
+	else
+	{
+		for (size_t i = 0; i < pending; ++i)
+		{
+			union digest_context ctx;
+			state->digest->init_function(&ctx);
+			state->digest->update_function(&ctx, data[i], sizes[i]);
+			digest_final(state, &ctx, hashes[i]);
+		}
+	}
+
+	for (size_t i = 0; i < pending; ++i)
+	{
+		hash_xattr_store(state, fds[i], inodes[i]);
+		stats_digested(state, sizes[i]);
+		close(fds[i]);
+		checkpoint_add(state, inodes[i]);
+		inodes[i]->hashed = true;
+		hash_progress(state, NULL, 1, sizes[i]);
+	}
+}
+
+// Like hash_xattr_read, but counts the file's size as taken from a cache.
+static bool hash_xattr_load(struct dedupe_state* state, int fd, struct inode_entry* inode)
+{
+	if (!hash_xattr_read(state, fd, inode))
+		return false;
+
+	__atomic_add_fetch(&state->cached_size, inode->size, __ATOMIC_RELAXED);
+	return true;
+}
+
+// Takes the digest from the file's extended attributes, if it was stored
+// there for the same modification time.
+static bool hash_xattr_read(struct dedupe_state* state, int fd, struct inode_entry* inode)
+{
+	if (!state->xattrs)
+		return false;
+
+	ssize_t result0, result1;
+	struct timespec mtime;
+
+	memset(inode->hash, 0, DIGEST_MAX_LENGTH);
+
+#if defined(__linux__)
+	result0 = fgetxattr(fd, state->xattr_hash, inode->hash, state->digest->length);
+	result1 = fgetxattr(fd, state->xattr_mtime, &mtime, sizeof(struct timespec));
+#elif defined(__FreeBSD__)
+	result0 = extattr_get_fd(fd, EXTATTR_NAMESPACE_USER, state->xattr_hash, inode->hash, state->digest->length);
+	result1 = extattr_get_fd(fd, EXTATTR_NAMESPACE_USER, state->xattr_mtime, &mtime, sizeof(struct timespec));
+#else
+	result1 = result0 = 0;
+#endif
+
+	return result0 == state->digest->length && (result1 == -1 ||
+		(result1 == sizeof(struct timespec) &&
+		inode->mtime.tv_sec == mtime.tv_sec &&
+		inode->mtime.tv_nsec == mtime.tv_nsec));
+}
+
+static void hash_xattr_store(struct dedupe_state* state, int fd, struct inode_entry* inode)
+{
+	if (!state->xattrs)
+		return;
+
+#if defined(__linux__)
+	fsetxattr(fd, state->xattr_hash, inode->hash, state->digest->length, 0);
+	fsetxattr(fd, state->xattr_mtime, &inode->mtime, sizeof(struct timespec), 0);
+#elif defined(__FreeBSD__)
+	extattr_set_fd(fd, EXTATTR_NAMESPACE_USER, state->xattr_hash, inode->hash, state->digest->length);
+	extattr_set_fd(fd, EXTATTR_NAMESPACE_USER, state->xattr_mtime, &inode->mtime, sizeof(struct timespec));
+#endif
+}
+
+static void hash_chunk(void* context, const unsigned char* data, size_t size, off_t offset)
+{
+	struct hash_context* ctx = context;
+
+	if (offset)
+	{
+		hash_progress(ctx->state, ctx->fpath, 0, offset - ctx->reported);
+		ctx->reported = offset;
+	}
+
+	ctx->state->digest->update_function(&ctx->digest, data, size);
+}
+
+static bool read_inode(struct dedupe_state* state, int fd, const char* fpath, off_t size, void (*cb)(void*, const unsigned char*, size_t, off_t), void* context)
+{
+	if (!size)
+		return true;
+
+#ifdef HAVE_IO_URING
+	struct uring* ring = uring_local(state);
+	if (ring)
+		return read_uring(state, ring, fd, fpath, size, cb, context);
+#endif
+
+	return state->reader->read_function(state, fd, fpath, size, cb, context);
+}
+
+// Files that can't be mapped, on file systems without mmap support or larger
+// than the address space left, are read through the stream buffer instead.
+static bool read_mmap(struct dedupe_state* state, int fd, const char* fpath, off_t size, void (*cb)(void*, const unsigned char*, size_t, off_t), void* context)
+{
+	unsigned char* data = TRACE(TRACE_MMAP, (unsigned char*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0));
+	if (data == MAP_FAILED && (errno == ENODEV || errno == ENOMEM || errno == EOVERFLOW))
+		return read_stream(state, fd, fpath, size, cb, context);
+
+	if (data == MAP_FAILED)
+	{
+		perror(fpath);
+		return false;
+	}
+
+	const size_t chunk_size = 0x2000000;
+	for (size_t offset = 0; offset < size; offset += chunk_size)
+	{
+		size_t remaining = size - offset;
+		if (remaining > chunk_size)
+			remaining = chunk_size;
+
+		throttle(state, remaining, (remaining + READ_BUFFER_SIZE - 1) / READ_BUFFER_SIZE);
+
+		// Page faults are taken while hashing the chunk, so both count here.
+		unsigned long long start = trace_begin(TRACE_READ);
+		cb(context, data + offset, remaining, offset);
+		trace_end(TRACE_READ, start);
+	}
+
+	munmap(data, size);
+	return true;
+}
+
+// Reads through a buffer kept by each thread, asking the kernel to read ahead
+// and to drop what was read behind it, so that hashing doesn't push everything
+// else out of the page cache. Direct reads bypass the page cache entirely, on
+// file systems that support them.
+static bool read_stream(struct dedupe_state* state, int fd, const char* fpath, off_t size, void (*cb)(void*, const unsigned char*, size_t, off_t), void* context)
+{
+	unsigned char* buffer = read_local();
+	if (!buffer)
+	{
+		perror(fpath);
+		return false;
+	}
+
+	bool direct = false;
+#ifdef O_DIRECT
+	if (state->reader->direct)
+		direct = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_DIRECT) != -1;
+#endif
+
+	// A file that is already cached belongs to someone else's working set, so
+	// it is left there; only files that had to be read from disk are dropped
+	// again.
+	bool cached = false;
+	void* probe = direct ? MAP_FAILED : mmap(NULL, 1, PROT_READ, MAP_SHARED, fd, 0);
+	if (probe != MAP_FAILED)
+	{
+		unsigned char resident;
+		cached = mincore(probe, 1, (void*)&resident) != -1 && (resident & 1);
+		munmap(probe, 1);
+	}
+
+	if (!direct)
+		posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+
+	for (off_t offset = 0; offset < size;)
+	{
+		throttle(state, size - offset < READ_BUFFER_SIZE ? size - offset : READ_BUFFER_SIZE, 1);
+		ssize_t length = TRACE(TRACE_READ, pread(fd, buffer, READ_BUFFER_SIZE, offset));
+		if (length == -1 && errno == EINTR)
+			continue;
+
+#ifdef O_DIRECT
+		// Some file systems only refuse direct reads once they're made.
+		if (length == -1 && errno == EINVAL && direct)
+		{
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+			posix_fadvise(fd, offset, size - offset, POSIX_FADV_SEQUENTIAL);
+			direct = false;
+			continue;
+		}
+#endif
+
+		if (length == -1)
+		{
+			perror(fpath);
+			return false;
+		}
+		else if (!length)
+		{
+			fprintf(stderr, "%s: truncated while reading\n", fpath);
+			return false;
+		}
+
+		if (length > size - offset)
+			length = size - offset;
+
+		cb(context, buffer, length, offset);
+
+		if (!direct && !cached)
+			posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+		offset += length;
+	}
+
+	return true;
+}
+
+static unsigned char* read_local(void)
+{
+	if (!read_thread)
+	{
+		void* buffer;
+		int error = posix_memalign(&buffer, READ_ALIGNMENT, READ_BUFFER_SIZE);
+		if (error)
+		{
+			errno = error;
+			return NULL;
+		}
+		read_thread = buffer;
+	}
+
+	return read_thread;
+}
+
+static void read_release(void)
+{
+	free(read_thread);
+	read_thread = NULL;
+}
+
+#ifdef HAVE_IO_URING
+// Keeps up to URING_BUFFERS reads in flight, feeding them to the callback in
+// file order as they complete.
+static bool read_uring(struct dedupe_state* state, struct uring* ring, int fd, const char* fpath, off_t size, void (*cb)(void*, const unsigned char*, size_t, off_t), void* context)
+{
+	size_t chunks = (size + URING_BUFFER_SIZE - 1) / URING_BUFFER_SIZE;
+	size_t submitted = 0, consumed = 0;
+	int results[URING_BUFFERS];
+	int error = 0;
+
+	while (consumed < chunks)
+	{
+		while (!error && submitted < chunks && submitted - consumed < URING_BUFFERS)
+		{
+			unsigned int slot = submitted % URING_BUFFERS;
+			off_t offset = (off_t)submitted * URING_BUFFER_SIZE;
+			size_t length = size - offset < URING_BUFFER_SIZE ? size - offset : URING_BUFFER_SIZE;
+
+			throttle(state, length, 1);
+			struct io_uring_sqe* sqe = uring_get_sqe(ring);
+			sqe->opcode = ring->registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+			sqe->fd = fd;
+			sqe->addr = (unsigned long long)(uintptr_t)(ring->buffers + (size_t)slot * URING_BUFFER_SIZE);
+			sqe->len = length;
+			sqe->off = offset;
+			sqe->buf_index = ring->registered ? slot : 0;
+			sqe->user_data = submitted;
+
+			results[slot] = -EINPROGRESS;
+			++submitted;
+		}
+
+		if (results[consumed % URING_BUFFERS] == -EINPROGRESS)
+		{
+			struct io_uring_cqe* cqe;
+			while (!(cqe = uring_peek(ring)))
+			{
+				if (uring_submit(ring, 1) < 0)
+				{
+					perror("io_uring_enter");
+
+					// Closing the ring doesn't wait for reads still in flight,
+					// which may write into their buffers later, so those are
+					// left allocated rather than freed under the kernel.
+					for (size_t i = consumed; i < submitted; ++i)
+					{
+						if (results[i % URING_BUFFERS] == -EINPROGRESS)
+						{
+							ring->buffers = NULL;
+							break;
+						}
+					}
+
+					uring_release();
+					uring_thread_failed = true;
+					return false;
+				}
+			}
+
+			results[cqe->user_data % URING_BUFFERS] = cqe->res;
+			uring_advance(ring);
+			continue;
+		}
+
+		unsigned int slot = consumed % URING_BUFFERS;
+		off_t offset = (off_t)consumed * URING_BUFFER_SIZE;
+		size_t length = size - offset < URING_BUFFER_SIZE ? size - offset : URING_BUFFER_SIZE;
+		unsigned char* data = ring->buffers + (size_t)slot * URING_BUFFER_SIZE;
+
+		// Short reads are unusual for regular files; finish them synchronously.
+		ssize_t done = results[slot];
+		while (done >= 0 && done < length)
+		{
+			ssize_t result = pread(fd, data + done, length - done, offset + done);
+			if (result <= 0)
+			{
+				done = result ? -errno : -EIO;
+				break;
+			}
+
+			done += result;
+		}
+
+		if (done < 0 && !error)
+			error = -done;
+
+		if (!error)
+			cb(context, data, length, offset);
+
+		++consumed;
+
+		// After an error, only drain what is still in flight.
+		if (error)
+			chunks = submitted;
+	}
+
+	if (error)
+	{
+		errno = error;
+		perror(fpath);
+		return false;
+	}
+
+	return true;
+}
+#endif
+
+static void hash_progress(struct dedupe_state* state, const char* fpath, size_t count, unsigned long long size)
+{
+	pthread_mutex_lock(&state->lock);
+	state->hashed_count += count;
+	state->hashed_size += size;
+	if (fpath && *fpath)
+		print_progress(state, fpath, state->hashed_count, state->process_count, state->hashed_size, state->progress_size);
+	pthread_mutex_unlock(&state->lock);
+}
+
+static void gather_tolink(struct dedupe_state* state0)
+{
+	struct gather_state state1 = { state0, 16, 0 };
+
+	state0->tolink_count = 0;
+	state0->tolink_list = talloc_array(state0, struct hash_bucket*, state1.capacity);
+
+	// Pipelined duplicates were relinked while hashing.
+	for (size_t i = 0; i < state0->device_count && !state0->pipeline; ++i)
+		hash_map_walk(state0->devices[i]->hash_lookup, &state1, gather_tolink_walkcb);
+
+	for (size_t i = 0; i < state0->tocompare_count; ++i)
+	{
+		struct inode_entry* inode = state0->tocompare_list[i];
+		if (!inode->hashed)
+			continue;
+
+		struct hash_bucket* bucket = talloc_zero(state0, struct hash_bucket);
+		bucket->dummy = 2;
+		bucket->value = inode;
+		inode->next_by_hash = inode->next_by_size;
+		inode->next_by_size->next_by_hash = NULL;
+
+		gather_tolink_walkcb(&state1, bucket);
+	}
+
+	qsort(state0->tolink_list, state0->tolink_count, sizeof(struct hash_bucket*), gather_tolink_sortcb);
+}
+
+static void gather_tolink_walkcb(void* state0, struct hash_bucket* bucket)
+{
+	if (bucket->dummy < 2)
+		return;
+
+	struct gather_state* state1 = state0;
+	struct dedupe_state* state2 = state1->state0;
+
+	if (state1->capacity == state2->tolink_count)
+	{
+		state1->capacity *= 2;
+		state2->tolink_list = talloc_realloc(state2, state2->tolink_list, struct hash_bucket*, state1->capacity);
+	}
+
+	state2->tolink_list[state2->tolink_count++] = bucket;
+}
+
+static int gather_tolink_sortcb(const void* p1, const void* p2)
+{
+	struct hash_bucket
+		*bucket0 = *((struct hash_bucket* const*)p1),
+		*bucket1 = *((struct hash_bucket* const*)p2);
+
+	if (!bucket0->key || !bucket1->key)
+	{
+		if (bucket0->key || bucket1->key)
+			return bucket0->key ? -1 : 1;
+
+		return gather_tohash_sortcb(&bucket0->value, &bucket1->value);
+	}
+
+	return memcmp(bucket0->key, bucket1->key, DIGEST_MAX_LENGTH);
+}
+
+static void relink(struct dedupe_state* state, struct hash_bucket* bucket)
+{
+	struct inode_entry** ordered = alloca(bucket->dummy * sizeof(struct inode_entry*));
+	size_t i = 0;
+	for (struct inode_entry* inode = bucket->value; inode; inode = inode->next_by_hash)
+		ordered[i++] = inode;
+	qsort(ordered, bucket->dummy, sizeof(struct inode_entry*), relink_sortcb);
+
+	if (!bucket->key || state->digest->cryptographic || state->method->verifies)
+	{
+		relink_group(state, bucket, ordered, bucket->dummy);
+		return;
+	}
+
+	// A weak digest may be shared by several different contents, so the files
+	// are split into classes of equal content, each one compared against the
+	// oldest file left, and each class is linked on its own. Members are
+	// swapped to the front in place, which leaves the rest to be sorted again.
+	struct inode_entry** rest = ordered;
+	size_t left = bucket->dummy;
+	while (left >= 2)
+	{
+		size_t count = 1;
+		for (i = 1; i < left; ++i)
+		{
+			if (compare_contents(state, rest[0], rest[i], false))
+			{
+				struct inode_entry* inode = rest[count];
+				rest[count++] = rest[i];
+				rest[i] = inode;
+			}
+		}
+
+		if (count >= 2)
+			relink_group(state, bucket, rest, count);
+
+		rest += count;
+		left -= count;
+		qsort(rest, left, sizeof(struct inode_entry*), relink_sortcb);
+	}
+}
+
+static void relink_group(struct dedupe_state* state, struct hash_bucket* bucket, struct inode_entry** ordered, size_t count)
+{
+	size_t i;
+
+	// While pipelined, the hash workers share the output and the stats.
+	if (state->pipeline)
+		pthread_mutex_lock(&state->lock);
+
+	if (state->stats)
+		stats_duplicate(state, bucket->key, ordered, count);
+
+	if (state->pipeline && state->verbose && state->tty)
+		fputs("\e[u\e[J", stdout);
+
+	if (state->verbose || state->interactive)
+	{
+		char buffer[DIGEST_MAX_LENGTH * 2 + 1];
+		unsigned char* key = bucket->key;
+
+		if (key)
+		{
+			for (i = 0; i < state->digest->length; ++i)
+				snprintf(buffer + (i * 2), 3, "%02x", (int)key[i]);
+		}
+		else
+		{
+			strcpy(buffer, "(compared)");
+		}
+
+		printf(state->tty ? "\e[1mDuplicate \e[31m%s\e[39m:\e[0m\n" : "Duplicate %s:\n", buffer);
+
+		for (i = 0; i < count; ++i)
+		{
+			struct tm tm;
+			localtime_r(&ordered[i]->mtime.tv_sec, &tm);
+
+			strftime(buffer, sizeof(buffer) / sizeof(char), "%c", &tm);
+
+			printf(
+				state->tty ?
+					" \e[1m#%lu\e[0m (%llu bytes) \e[2mmodified %s\e[0m\n" :
+					" #%lu (%llu bytes) modified %s\n",
+				(unsigned long)ordered[i]->ino,
+				(unsigned long long)ordered[i]->size,
+				buffer
+			);
+
+			for (struct path_entry* path = ordered[i]->paths; path; path = path->next)
+			{
+				char* fpath = path_build(NULL, path->dir, path->name);
+				printf("  %s\n", fpath);
+				talloc_free(fpath);
+			}
+		}
+	}
+
+	if (state->pipeline)
+	{
+		if (state->verbose && state->tty)
+			fputs("\n\n\e[2A\e[s", stdout);
+
+		fflush(stdout);
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	if (state->interactive)
+	{
+		while (true)
+		{
+			fputs(state->tty ? " \e[1mRelink? [\e[32myes\e[39m/\e[31mno\e[39m]\e[0m " : " Relink? [yes/no] ", stdout);
+			fflush(stdout);
+
+			char buffer[4096];
+			fgets(buffer, 4096, stdin);
+
+			if (!strcmp(buffer, "y\n") || !strcmp(buffer, "yes\n"))
+				break;
+			else if (!strcmp(buffer, "n\n") || !strcmp(buffer, "no\n"))
+				return;
+		}
+	}
+
+	if (state->dryrun)
+		return;
+
+	state->method->link_function(state, ordered, count);
+
+	// Relinking changed the ctimes, which would otherwise fail the check on
+	// resuming.
+	for (i = 0; bucket->key && i < count; ++i)
+		checkpoint_add(state, ordered[i]);
+}
+
+static int relink_sortcb(const void* p1, const void* p2)
+{
+	struct inode_entry
+		*inode0 = *((struct inode_entry* const*)p1),
+		*inode1 = *((struct inode_entry* const*)p2);
+
+	struct timespec
+		*mt0 = &inode0->mtime,
+		*mt1 = &inode1->mtime;
+
+	if (mt0->tv_sec < mt1->tv_sec)
+		return -1;
+	else if (mt0->tv_sec > mt1->tv_sec)
+		return 1;
+	else if (mt0->tv_nsec < mt1->tv_nsec)
+		return -1;
+	else if (mt0->tv_nsec > mt1->tv_nsec)
+		return 1;
+	else if (inode0->ino < inode1->ino)
+		return -1;
+	else if (inode0->ino > inode1->ino)
+		return 1;
+	else
+		return 0;
+}
+
+// Links the first file over all others. The paths are processed directory by
+// directory, relative to cached directory fds, so each directory is resolved
+// once rather than for every temporary link and rename.
+static void relink_hardlink(struct dedupe_state* state, struct inode_entry** ordered, size_t count)
+{
+	size_t total = 0;
+	for (size_t i = 1; i < count; ++i)
+	{
+		for (struct path_entry* dpath = ordered[i]->paths; dpath; dpath = dpath->next)
+			++total;
+	}
+
+	struct path_entry** targets = talloc_array(NULL, struct path_entry*, total);
+	total = 0;
+	for (size_t i = 1; i < count; ++i)
+	{
+		for (struct path_entry* dpath = ordered[i]->paths; dpath; dpath = dpath->next)
+			targets[total++] = dpath;
+	}
+	qsort(targets, total, sizeof(struct path_entry*), relink_hardlink_sortcb);
+
+	// Temporary names only need to be unique within their directory, so a
+	// counter from one random start does, with a retry on the odd collision.
+	unsigned int r;
+#if defined(__linux__)
+	getrandom(&r, sizeof(r), 0);
+#elif defined(__FreeBSD__)
+	arc4random_buf(&r, sizeof(r));
+#else
+	r = (unsigned int)rand();
+#endif
+
+	struct path_entry* linked = NULL;
+	char fpath[PATH_MAX];
+	for (size_t i = 0; i < total; ++i)
+	{
+		struct path_entry* dpath = targets[i];
+		int dfd = dir_open(dpath->dir);
+		if (dfd == -1)
+		{
+			// The rest of the directory would fail the same way.
+			while (i + 1 < total && targets[i + 1]->dir == dpath->dir)
+				++i;
+			continue;
+		}
+
+		char tmp[16];
+		struct path_entry* spath = ordered[0]->paths;
+		while (spath)
+		{
+			snprintf(tmp, sizeof(tmp), ".tmp%08X~", r++);
+
+			// Opening the source's directory may have closed the target's to
+			// make room, but the last two opened always stay valid.
+			int sfd = dir_open(spath->dir);
+			if (sfd != -1 && (dfd = dir_open(dpath->dir)) == -1)
+			{
+				spath = NULL;
+				break;
+			}
+
+			if (sfd != -1 && TRACE_COUNT(state->link_count, TRACE_LINK, linkat(sfd, spath->name, dfd, tmp, 0)) != -1)
+				break;
+
+			if (sfd != -1)
+			{
+				if (errno == EEXIST)
+					continue;
+
+				path_format(fpath, PATH_MAX, spath->dir, spath->name);
+				perror(fpath);
+			}
+
+			spath = spath->next;
+		}
+
+		if (!spath)
+			continue;
+
+		if (TRACE_COUNT(state->link_count, TRACE_LINK, renameat(dfd, tmp, dfd, dpath->name)) == -1)
+		{
+			path_format(fpath, PATH_MAX, dpath->dir, tmp);
+			perror(fpath);
+			unlinkat(dfd, tmp, 0);
+		}
+		else
+		{
+			++state->relinked_count;
+			state->relinked_size += ordered[0]->size;
+			linked = dpath;
+		}
+	}
+
+	// The new links changed the ctime of the source inode; refresh it so
+	// that the index entry stays valid.
+	struct stat buffer;
+	int dfd;
+	if (linked && (state->index_path || state->checkpoint_path) && (dfd = dir_open(linked->dir)) != -1 && fstatat(dfd, linked->name, &buffer, 0) != -1)
+		ordered[0]->ctime = buffer.st_ctim;
+
+	talloc_free(targets);
+}
+
+static int relink_hardlink_sortcb(const void* p1, const void* p2)
+{
+	struct path_entry
+		*path0 = *((struct path_entry* const*)p1),
+		*path1 = *((struct path_entry* const*)p2);
+
+	if (path0->dir < path1->dir)
+		return -1;
+	else if (path0->dir > path1->dir)
+		return 1;
+	else
+		return 0;
+}
+
+#ifdef FICLONE
+// Replaces the contents of each duplicate with the extents of the first file,
+// so that the duplicates keep their own inode and metadata. The kernel doesn't
+// look at what it overwrites, so each duplicate is checked to be unchanged.
+static void relink_clone(struct dedupe_state* state, struct inode_entry** ordered, size_t count)
+{
+	char spath[PATH_MAX];
+	int src = open_inode(state, ordered[0], spath, O_RDONLY);
+	if (src == -1)
+		return;
+
+	for (size_t i = 1; i < count; ++i)
+	{
+		char dpath[PATH_MAX];
+		int dst = open_inode(state, ordered[i], dpath, O_WRONLY);
+		if (dst == -1)
+			continue;
+
+		struct stat buffer;
+		if (fstat(dst, &buffer) == -1)
+		{
+			perror(dpath);
+		}
+		else if (buffer.st_dev != ordered[i]->dev || buffer.st_ino != ordered[i]->ino || buffer.st_size != ordered[i]->size ||
+			buffer.st_mtim.tv_sec != ordered[i]->mtime.tv_sec || buffer.st_mtim.tv_nsec != ordered[i]->mtime.tv_nsec)
+		{
+			fprintf(stderr, "%s: modified since it was hashed, skipping\n", dpath);
+		}
+		else if (TRACE_COUNT(state->link_count, TRACE_LINK, ioctl(dst, FICLONE, src)) == -1)
+		{
+			perror(dpath);
+		}
+		else
+		{
+			struct timespec times[2] = { buffer.st_atim, buffer.st_mtim };
+			futimens(dst, times);
+
+			++state->relinked_count;
+			state->relinked_size += ordered[0]->size;
+
+			if ((state->index_path || state->checkpoint_path) && fstat(dst, &buffer) != -1)
+				ordered[i]->ctime = buffer.st_ctim;
+		}
+
+		close(dst);
+	}
+
+	close(src);
+}
+#endif
+
+#ifdef FIDEDUPERANGE
+// Asks the kernel to share the extents of the first file with the others. It
+// compares the ranges itself and refuses those that differ, which is why this
+// method can do without full hashes.
+static void relink_dedupe_range(struct dedupe_state* state, struct inode_entry** ordered, size_t count)
+{
+	off_t size = ordered[0]->size;
+	if (!size)
+		return;
+
+	char spath[PATH_MAX];
+	int src = open_inode(state, ordered[0], spath, O_RDONLY);
+	if (src == -1)
+		return;
+
+	// The argument of a single call has to fit in a page.
+	size_t batch = (4096 - sizeof(struct file_dedupe_range)) / sizeof(struct file_dedupe_range_info);
+	struct file_dedupe_range* range = talloc_size(NULL, sizeof(struct file_dedupe_range) + batch * sizeof(struct file_dedupe_range_info));
+	size_t* targets = talloc_array(NULL, size_t, batch);
+	int* fds = talloc_array(NULL, int, batch);
+	struct file_dedupe_range* single = talloc_size(range, sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info));
+
+	for (size_t i = 1; i < count; i += batch)
+	{
+		size_t n = count - i < batch ? count - i : batch;
+		for (size_t k = 0; k < n; ++k)
+		{
+			char dpath[PATH_MAX];
+			fds[k] = open_inode(state, ordered[i + k], dpath, O_RDONLY);
+		}
+
+		for (off_t offset = 0; offset < size; offset += DEDUPE_RANGE_LENGTH)
+		{
+			memset(range, 0, sizeof(struct file_dedupe_range));
+			range->src_offset = offset;
+			range->src_length = size - offset < DEDUPE_RANGE_LENGTH ? size - offset : DEDUPE_RANGE_LENGTH;
+
+			for (size_t k = 0; k < n; ++k)
+			{
+				if (fds[k] == -1)
+					continue;
+
+				struct file_dedupe_range_info* info = &range->info[range->dest_count];
+				memset(info, 0, sizeof(struct file_dedupe_range_info));
+				info->dest_fd = fds[k];
+				info->dest_offset = offset;
+				targets[range->dest_count++] = k;
+			}
+
+			if (!range->dest_count)
+				break;
+
+			if (TRACE_COUNT(state->link_count, TRACE_LINK, ioctl(src, FIDEDUPERANGE, range)) == -1)
+			{
+				perror(spath);
+				for (size_t k = 0; k < n; ++k)
+				{
+					if (fds[k] != -1)
+						close(fds[k]);
+					fds[k] = -1;
+				}
+				break;
+			}
+
+			for (size_t j = 0; j < range->dest_count; ++j)
+			{
+				struct file_dedupe_range_info* info = &range->info[j];
+				size_t k = targets[j];
+
+				// The kernel may share less than asked for in one call; the
+				// rest is asked for again, until it is done or refused.
+				int status = info->status;
+				unsigned long long done = info->bytes_deduped;
+				while (status == FILE_DEDUPE_RANGE_SAME && done && done < range->src_length)
+				{
+					memset(single, 0, sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info));
+					single->src_offset = offset + done;
+					single->src_length = range->src_length - done;
+					single->dest_count = 1;
+					single->info[0].dest_fd = fds[k];
+					single->info[0].dest_offset = offset + done;
+
+					if (TRACE_COUNT(state->link_count, TRACE_LINK, ioctl(src, FIDEDUPERANGE, single)) == -1)
+					{
+						status = -errno;
+						break;
+					}
+
+					status = single->info[0].status;
+					if (!single->info[0].bytes_deduped)
+						break;
+					done += single->info[0].bytes_deduped;
+				}
+
+				if (status == FILE_DEDUPE_RANGE_SAME && done == range->src_length)
+					continue;
+
+				char* dpath = path_build(NULL, ordered[i + k]->paths->dir, ordered[i + k]->paths->name);
+				if (status < 0)
+				{
+					errno = -status;
+					perror(dpath);
+				}
+				else if (status == FILE_DEDUPE_RANGE_SAME)
+				{
+					fprintf(stderr, "%s: only %llu of %llu bytes at offset %lld shared, skipping the rest\n",
+						dpath, done, (unsigned long long)range->src_length, (long long)offset);
+				}
+				else
+				{
+					fprintf(stderr, "%s: contents differ, skipping\n", dpath);
+				}
+				talloc_free(dpath);
+
+				close(fds[k]);
+				fds[k] = -1;
+			}
+		}
+
+		for (size_t k = 0; k < n; ++k)
+		{
+			if (fds[k] == -1)
+				continue;
+
+			++state->relinked_count;
+			state->relinked_size += size;
+			close(fds[k]);
+		}
+	}
+
+	talloc_free(fds);
+	talloc_free(targets);
+	talloc_free(range);
+	close(src);
+}
+#endif
+
+#ifdef FIDEDUPERANGE
+// Shares identical blocks between files that aren't duplicates as a whole,
+// such as disk images or archives that were appended to. Blocks are aligned to
+// their offset in the file, since extents can only be shared that way.
+static void block_all(struct dedupe_state* state0)
+{
+	struct block_state state1 = { state0, 16 };
+	state1.list = talloc_array(state0, struct inode_entry*, state1.capacity);
+	for (size_t i = 0; i < state0->device_count; ++i)
+		hash_map_walk(state0->devices[i]->inode_lookup, &state1, block_gather_walkcb);
+
+	if (state0->verbose && state0->tty)
+	{
+		fputs("\n\n\e[2A\e[s", stdout);
+		fflush(stdout);
+	}
+
+	for (size_t i = 0; i < state0->device_count; ++i)
+		state0->devices[i]->block_lookup = hash_map_create(state0->devices[i], &hash_block_descriptor, 0);
+
+	process_inodes(state0, state1.list, state1.count, block_inode, state1.size);
+
+	if (state0->verbose && state0->tty)
+	{
+		fputs("\e[u\e[J", stdout);
+		fflush(stdout);
+	}
+
+	state1.bucket_capacity = 16;
+	state1.buckets = talloc_array(state0, struct hash_bucket*, state1.bucket_capacity);
+	for (size_t i = 0; i < state0->device_count; ++i)
+		hash_map_walk(state0->devices[i]->block_lookup, &state1, block_share_walkcb);
+
+	// Going through the sources in order keeps the kernel's reads sequential.
+	qsort(state1.buckets, state1.bucket_count, sizeof(struct hash_bucket*), block_sortcb);
+
+	size_t duplicates = 0;
+	for (size_t i = 0; i < state1.bucket_count; ++i)
+		duplicates += state1.buckets[i]->dummy - 1;
+
+	if (state0->interactive && duplicates && !state0->dryrun)
+	{
+		while (true)
+		{
+			printf(state0->tty ? " \e[1mShare %zu duplicate blocks? [\e[32myes\e[39m/\e[31mno\e[39m]\e[0m " : " Share %zu duplicate blocks? [yes/no] ", duplicates);
+			fflush(stdout);
+
+			char buffer[4096];
+			fgets(buffer, 4096, stdin);
+
+			if (!strcmp(buffer, "y\n") || !strcmp(buffer, "yes\n"))
+				break;
+			else if (!strcmp(buffer, "n\n") || !strcmp(buffer, "no\n"))
+			{
+				state1.bucket_count = 0;
+				break;
+			}
+		}
+	}
+
+	// The argument of a single call has to fit in a page.
+	state1.range_capacity = (4096 - sizeof(struct file_dedupe_range)) / sizeof(struct file_dedupe_range_info);
+	state1.range = talloc_size(state0, sizeof(struct file_dedupe_range) + state1.range_capacity * sizeof(struct file_dedupe_range_info));
+	state1.targets = talloc_array(state0, struct block_entry*, state1.range_capacity);
+	state1.fds = talloc_zero_array(state0, struct block_fd, BLOCK_FDS);
+	for (size_t i = 0; i < BLOCK_FDS; ++i)
+		state1.fds[i].fd = -1;
+
+	for (size_t i = 0; i < state1.bucket_count; ++i)
+		block_share(&state1, state1.buckets[i]);
+
+	for (size_t i = 0; i < BLOCK_FDS; ++i)
+	{
+		if (state1.fds[i].fd != -1)
+			close(state1.fds[i].fd);
+	}
+
+	talloc_free(state1.fds);
+	talloc_free(state1.targets);
+	talloc_free(state1.range);
+	talloc_free(state1.buckets);
+	talloc_free(state1.list);
+}
+
+static void block_gather_walkcb(void* state0, struct hash_bucket* inode_bucket)
+{
+	struct block_state* state1 = state0;
+	struct inode_entry* inode = inode_bucket->value;
+	if (!inode || inode->size < state1->state0->blocks || !is_wanted(state1->state0, inode))
+		return;
+
+	if (state1->capacity == state1->count)
+	{
+		state1->capacity *= 2;
+		state1->list = talloc_realloc(state1->state0, state1->list, struct inode_entry*, state1->capacity);
+	}
+
+	state1->list[state1->count++] = inode;
+	state1->size += inode->size;
+}
+
+static bool block_inode(struct dedupe_state* state, struct inode_entry* inode)
+{
+	char fpath[PATH_MAX];
+	int fd = open_inode(state, inode, fpath, O_RDONLY);
+	if (fd == -1)
+	{
+		hash_progress(state, NULL, 1, inode->size);
+		return false;
+	}
+
+	hash_progress(state, fpath, 0, 0);
+
+	// Whole-file duplicates that were just replaced by links now lead to
+	// the file they were linked to, which is scanned on its own.
+	struct stat buffer;
+	if (fstat(fd, &buffer) == -1 || buffer.st_dev != inode->dev || buffer.st_ino != inode->ino || buffer.st_size != inode->size)
+	{
+		close(fd);
+		hash_progress(state, NULL, 1, inode->size);
+		return false;
+	}
+
+	struct block_context ctx = { state, fpath };
+	state->digest->init_function(&ctx.digest);
+
+	bool result = false;
+	ctx.blocks = malloc((inode->size / state->blocks) * sizeof(*ctx.blocks));
+	if (!ctx.blocks)
+		perror(fpath);
+	else
+		result = read_inode(state, fd, fpath, inode->size, block_chunk, &ctx);
+
+	close(fd);
+
+	if (result)
+	{
+		stats_digested(state, inode->size);
+
+		pthread_mutex_lock(&state->lock);
+		struct device_entry* device = device_find(state, inode->dev);
+		for (size_t i = 0; i < ctx.count; ++i)
+		{
+			struct block_entry* entry = arena_alloc(state->arena, sizeof(struct block_entry));
+			entry->inode = inode;
+			entry->offset = ctx.blocks[i].offset;
+			memcpy(entry->hash, ctx.blocks[i].hash, BLOCK_DIGEST_LENGTH);
+
+			struct hash_bucket* bucket = hash_map_insert(device->block_lookup, entry->hash);
+			++bucket->dummy;
+			entry->next = bucket->value;
+			bucket->value = entry;
+		}
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	free(ctx.blocks);
+
+	hash_progress(state, fpath, 1, inode->size - ctx.reported);
+	return result;
+}
+
+// Digests each full block as the data streams by. Blocks of zeroes are left
+// out, as they are usually holes that take no space to begin with.
+static void block_chunk(void* context, const unsigned char* data, size_t size, off_t offset)
+{
+	struct block_context* ctx = context;
+	struct dedupe_state* state = ctx->state;
+
+	if (offset)
+	{
+		hash_progress(state, ctx->fpath, 0, offset - ctx->reported);
+		ctx->reported = offset;
+	}
+
+	while (size)
+	{
+		size_t length = state->blocks - ctx->filled;
+		if (length > size)
+			length = size;
+
+		for (size_t i = 0; i < length && !ctx->nonzero; ++i)
+			ctx->nonzero = data[i] != 0;
+
+		state->digest->update_function(&ctx->digest, data, length);
+		ctx->filled += length;
+		data += length;
+		size -= length;
+
+		if (ctx->filled < state->blocks)
+			continue;
+
+		if (ctx->nonzero)
+		{
+			unsigned char hash[DIGEST_MAX_LENGTH];
+			digest_final(state, &ctx->digest, hash);
+
+			ctx->blocks[ctx->count].offset = ctx->offset;
+			memcpy(ctx->blocks[ctx->count].hash, hash, BLOCK_DIGEST_LENGTH);
+			++ctx->count;
+		}
+
+		state->digest->init_function(&ctx->digest);
+		ctx->offset += state->blocks;
+		ctx->filled = 0;
+		ctx->nonzero = false;
+	}
+}
+
+static void block_share_walkcb(void* state0, struct hash_bucket* bucket)
+{
+	if (bucket->dummy < 2)
+		return;
+
+	struct block_state* state1 = state0;
+	if (state1->bucket_capacity == state1->bucket_count)
+	{
+		state1->bucket_capacity *= 2;
+		state1->buckets = talloc_realloc(state1->state0, state1->buckets, struct hash_bucket*, state1->bucket_capacity);
+	}
+
+	state1->buckets[state1->bucket_count++] = bucket;
+}
+
+static int block_sortcb(const void* p1, const void* p2)
+{
+	const struct block_entry
+		*entry0 = (*((struct hash_bucket* const*)p1))->value,
+		*entry1 = (*((struct hash_bucket* const*)p2))->value;
+
+	if (entry0->inode->ino != entry1->inode->ino)
+		return entry0->inode->ino < entry1->inode->ino ? -1 : 1;
+	else if (entry0->offset != entry1->offset)
+		return entry0->offset < entry1->offset ? -1 : 1;
+	else
+		return 0;
+}
+
+static void block_share(struct block_state* state1, struct hash_bucket* bucket)
+{
+	struct dedupe_state* state = state1->state0;
+	struct block_entry* src = bucket->value;
+
+	if (state->verbose)
+	{
+		char buffer[BLOCK_DIGEST_LENGTH * 2 + 1];
+		for (size_t i = 0; i < BLOCK_DIGEST_LENGTH; ++i)
+			snprintf(buffer + (i * 2), 3, "%02x", (int)src->hash[i]);
+
+		printf(state->tty ? "\e[1mDuplicate block \e[31m%s\e[39m:\e[0m\n" : "Duplicate block %s:\n", buffer);
+
+		for (struct block_entry* entry = src; entry; entry = entry->next)
+		{
+			char* fpath = path_build(NULL, entry->inode->paths->dir, entry->inode->paths->name);
+			printf(state->tty ? "  %s \e[2mat %llu\e[0m\n" : "  %s at %llu\n", fpath, (unsigned long long)entry->offset);
+			talloc_free(fpath);
+		}
+	}
+
+	if (state->dryrun)
+		return;
+
+	struct file_dedupe_range* range = state1->range;
+	for (struct block_entry* next = src->next; next; )
+	{
+		++state1->batch;
+
+		int fd = block_open(state1, src->inode);
+		if (fd == -1)
+			return;
+
+		memset(range, 0, sizeof(struct file_dedupe_range));
+		range->src_offset = src->offset;
+		range->src_length = state->blocks;
+
+		for (; next && range->dest_count < state1->range_capacity; next = next->next)
+		{
+			int dest = block_open(state1, next->inode);
+			if (dest == -1)
+				continue;
+
+			struct file_dedupe_range_info* info = &range->info[range->dest_count];
+			memset(info, 0, sizeof(struct file_dedupe_range_info));
+			info->dest_fd = dest;
+			info->dest_offset = next->offset;
+			state1->targets[range->dest_count++] = next;
+		}
+
+		if (!range->dest_count)
+			return;
+
+		if (TRACE_COUNT(state->link_count, TRACE_LINK, ioctl(fd, FIDEDUPERANGE, range)) == -1)
+		{
+			char* fpath = path_build(state, src->inode->paths->dir, src->inode->paths->name);
+			perror(fpath);
+			talloc_free(fpath);
+			return;
+		}
+
+		for (size_t i = 0; i < range->dest_count; ++i)
+		{
+			struct file_dedupe_range_info* info = &range->info[i];
+			if (info->status == FILE_DEDUPE_RANGE_SAME && info->bytes_deduped == state->blocks)
+			{
+				++state->shared_count;
+				state->shared_size += state->blocks;
+				continue;
+			}
+
+			struct block_entry* entry = state1->targets[i];
+			char* fpath = path_build(state, entry->inode->paths->dir, entry->inode->paths->name);
+			if (info->status < 0)
+			{
+				errno = -info->status;
+				perror(fpath);
+			}
+			else
+			{
+				fprintf(stderr, "%s: block at %llu differs, skipping\n", fpath, (unsigned long long)entry->offset);
+			}
+			talloc_free(fpath);
+		}
+	}
+}
+
+// Opens files through a small cache, as the same files come up over and over.
+// An entry used by the call being assembled is never evicted.
+static int block_open(struct block_state* state1, struct inode_entry* inode)
+{
+	for (size_t i = 0; i < BLOCK_FDS; ++i)
+	{
+		struct block_fd* slot = &state1->fds[i];
+		if (slot->inode == inode)
+		{
+			slot->batch = state1->batch;
+			return slot->fd;
+		}
+	}
+
+	struct block_fd* slot;
+	do
+	{
+		slot = &state1->fds[state1->next_fd];
+		state1->next_fd = (state1->next_fd + 1) % BLOCK_FDS;
+	}
+	while (slot->batch == state1->batch);
+
+	char fpath[PATH_MAX];
+	int fd = open_inode(state1->state0, inode, fpath, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	if (slot->fd != -1)
+		close(slot->fd);
+
+	slot->inode = inode;
+	slot->fd = fd;
+	slot->batch = state1->batch;
+	return fd;
+}
+#endif
+
+// Writes every hashed inode with its paths, sorted by size and digest, so that
+// the manifests of several hosts can be merged as streams.
+static void manifest_emit(struct dedupe_state* state)
+{
+	size_t count = 0;
+	struct inode_entry** list = talloc_array(state, struct inode_entry*, state->tohash_count);
+	for (size_t i = 0; i < state->tohash_count; ++i)
+	{
+		if (state->tohash_list[i]->hashed)
+			list[count++] = state->tohash_list[i];
+	}
+	qsort(list, count, sizeof(struct inode_entry*), manifest_sortcb);
+
+	struct manifest_header header;
+	memset(&header, 0, sizeof(struct manifest_header));
+	memcpy(header.magic, "dedupeM\1", 8);
+	strncpy(header.digest, state->digest->name, sizeof(header.digest) - 1);
+	if (gethostname(header.host, sizeof(header.host) - 1) == -1)
+		strcpy(header.host, "localhost");
+	header.count = htole64(count);
+
+	char* tmp = talloc_asprintf(state, "%s.tmp", state->manifest_path);
+	FILE* f = fopen(tmp, "wb");
+	if (!f)
+	{
+		perror(tmp);
+		talloc_free(tmp);
+		talloc_free(list);
+		return;
+	}
+
+	bool success = fwrite(&header, sizeof(struct manifest_header), 1, f) == 1;
+	char* paths = talloc_array(state, char, PATH_MAX);
+	size_t capacity = PATH_MAX;
+	for (size_t i = 0; i < count && success; ++i)
+	{
+		struct inode_entry* inode = list[i];
+		struct manifest_record record;
+		memset(&record, 0, sizeof(struct manifest_record));
+		record.size = inode->size;
+		memcpy(record.hash, inode->hash, state->digest->length);
+		record.dev = inode->dev;
+		record.ino = inode->ino;
+
+		for (struct path_entry* path = inode->paths; path; path = path->next)
+		{
+			size_t length = path_length(path->dir, path->name) + 1;
+			while (record.path_size + length > capacity)
+			{
+				capacity *= 2;
+				paths = talloc_realloc(state, paths, char, capacity);
+			}
+
+			path_fill(paths + record.path_size, length - 1, path->dir, path->name);
+			record.path_size += length;
+			++record.path_count;
+		}
+
+		size_t size = record.path_size;
+		manifest_byteorder(&record);
+		success = fwrite(&record, sizeof(struct manifest_record), 1, f) == 1 &&
+			fwrite(paths, 1, size, f) == size;
+	}
+
+	if (!success || fflush(f) || fsync(fileno(f)))
+	{
+		perror(tmp);
+		fclose(f);
+		unlink(tmp);
+	}
+	else if (fclose(f) || rename(tmp, state->manifest_path) == -1)
+	{
+		perror(state->manifest_path);
+		unlink(tmp);
+	}
+
+	talloc_free(paths);
+	talloc_free(tmp);
+	talloc_free(list);
+}
+
+static int manifest_sortcb(const void* p1, const void* p2)
+{
+	struct inode_entry
+		*inode0 = *((struct inode_entry* const*)p1),
+		*inode1 = *((struct inode_entry* const*)p2);
+
+	if (inode0->size != inode1->size)
+		return inode0->size < inode1->size ? -1 : 1;
+
+	int result = memcmp(inode0->hash, inode1->hash, DIGEST_MAX_LENGTH);
+	if (result)
+		return result;
+
+	return order_inode_sortcb(p1, p2);
+}
+
+// Reads the manifests given instead of directories all at once and reports
+// the groups of files with the same size and digest on any of their hosts.
+static bool manifest_merge(struct dedupe_state* state)
+{
+	struct manifest_stream* streams = talloc_zero_array(state, struct manifest_stream, state->dircount);
+	struct manifest_stream** heap = talloc_array(state, struct manifest_stream*, state->dircount);
+	size_t count = 0;
+	bool success = true, named = false;
+
+	for (size_t i = 0; i < state->dircount; ++i)
+	{
+		struct manifest_stream* stream = &streams[i];
+		stream->path = state->dirs[i];
+		stream->file = fopen(stream->path, "rb");
+		if (!stream->file)
+		{
+			perror(stream->path);
+			success = false;
+			continue;
+		}
+
+		// All manifests must hash alike, so the first one names the digest.
+		struct manifest_header* header = &stream->header;
+		const struct digest_descriptor* digest = state->digest;
+		if (fread(header, sizeof(struct manifest_header), 1, stream->file) == 1 && !named)
+		{
+			for (digest = digest_descriptors; digest->name; ++digest)
+			{
+				if (!strncmp(digest->name, header->digest, sizeof(header->digest)))
+					break;
+			}
+		}
+
+		if (memcmp(header->magic, "dedupeM\1", 8) || !digest->name ||
+			strncmp(header->digest, digest->name, sizeof(header->digest)))
+		{
+			fprintf(stderr, "%s: not a manifest, or not hashed with %s\n", stream->path, state->digest->name);
+			fclose(stream->file);
+			stream->file = NULL;
+			success = false;
+			continue;
+		}
+
+		state->digest = digest;
+		named = true;
+
+		header->host[sizeof(header->host) - 1] = 0;
+		header->count = le64toh(header->count);
+		stream->left = header->count;
+		if (manifest_next(stream))
+			heap[count++] = stream;
+	}
+
+	for (size_t i = count / 2; i-- > 0; )
+		manifest_sift(heap, count, i);
+
+	// Entries of the current group, which has all its members once the
+	// smallest record left differs.
+	void* ctx = talloc_new(state);
+	size_t group_count = 0, group_capacity = 16;
+	struct manifest_entry* group = talloc_array(state, struct manifest_entry, group_capacity);
+
+	while (count)
+	{
+		struct manifest_stream* stream = heap[0];
+		if (group_count && manifest_compare(&group->record, &stream->record))
+		{
+			manifest_report(state, group, group_count);
+			group_count = 0;
+			talloc_free(ctx);
+			ctx = talloc_new(state);
+		}
+
+		if (group_count == group_capacity)
+		{
+			group_capacity *= 2;
+			group = talloc_realloc(state, group, struct manifest_entry, group_capacity);
+		}
+
+		struct manifest_entry* entry = &group[group_count++];
+		entry->host = stream->header.host;
+		entry->record = stream->record;
+		entry->paths = talloc_memdup(ctx, stream->paths, stream->record.path_size);
+
+		struct manifest_record previous = stream->record;
+		if (!manifest_next(stream))
+		{
+			heap[0] = heap[--count];
+		}
+		else if (manifest_compare(&previous, &stream->record) > 0)
+		{
+			fprintf(stderr, "%s: manifest isn't sorted, ignoring the rest\n", stream->path);
+			heap[0] = heap[--count];
+			success = false;
+		}
+
+		if (count)
+			manifest_sift(heap, count, 0);
+	}
+
+	manifest_report(state, group, group_count);
+
+	printf(
+		state->tty ?
+			"\e[1mFound \e[32m%zu\e[39m duplicate%s, \e[32m%llu\e[39m redundant bytes.\e[0m\n" :
+			"Found %zu duplicate%s, %llu redundant bytes.\n",
+		state->tolink_count,
+		state->tolink_count == 1 ? "" : "s",
+		state->relinked_size);
+
+	for (size_t i = 0; i < state->dircount; ++i)
+	{
+		if (streams[i].file)
+			fclose(streams[i].file);
+		talloc_free(streams[i].paths);
+		success &= !streams[i].damaged;
+	}
+
+	talloc_free(ctx);
+	talloc_free(group);
+	talloc_free(heap);
+	talloc_free(streams);
+	return success;
+}
+
+// Reads the stream's next record and its paths, or returns false at the end
+// or on a damaged record.
+static bool manifest_next(struct manifest_stream* stream)
+{
+	if (!stream->left)
+		return false;
+	--stream->left;
+
+	if (fread(&stream->record, sizeof(struct manifest_record), 1, stream->file) != 1)
+	{
+		fprintf(stderr, "%s: manifest is truncated\n", stream->path);
+		stream->damaged = true;
+		return false;
+	}
+
+	manifest_byteorder(&stream->record);
+
+	size_t size = stream->record.path_size;
+	if (size > stream->capacity)
+	{
+		stream->capacity = size;
+		stream->paths = talloc_realloc(NULL, stream->paths, char, size);
+	}
+
+	size_t nuls = 0;
+	if (fread(stream->paths, 1, size, stream->file) == size)
+	{
+		for (size_t i = 0; i < size; ++i)
+			nuls += !stream->paths[i];
+	}
+
+	if (!size || nuls != stream->record.path_count || stream->paths[size - 1])
+	{
+		fprintf(stderr, "%s: manifest is damaged\n", stream->path);
+		stream->damaged = true;
+		return false;
+	}
+
+	return true;
+}
+
+// Converts a record between host and little-endian order, either way.
+static void manifest_byteorder(struct manifest_record* record)
+{
+	record->size = htole64(record->size);
+	record->dev = htole64(record->dev);
+	record->ino = htole64(record->ino);
+	record->path_count = htole32(record->path_count);
+	record->path_size = htole32(record->path_size);
+}
+
+static int manifest_compare(const struct manifest_record* record0, const struct manifest_record* record1)
+{
+	if (record0->size != record1->size)
+		return record0->size < record1->size ? -1 : 1;
+
+	return memcmp(record0->hash, record1->hash, DIGEST_MAX_LENGTH);
+}
+
+static void manifest_sift(struct manifest_stream** heap, size_t count, size_t i)
+{
+	while (true)
+	{
+		size_t smallest = i;
+		for (size_t child = i * 2 + 1; child <= i * 2 + 2 && child < count; ++child)
+		{
+			if (manifest_compare(&heap[child]->record, &heap[smallest]->record) < 0)
+				smallest = child;
+		}
+
+		if (smallest == i)
+			return;
+
+		struct manifest_stream* swap = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = swap;
+		i = smallest;
+	}
+}
+
+static void manifest_report(struct dedupe_state* state, const struct manifest_entry* group, size_t count)
+{
+	if (count < 2)
+		return;
+
+	++state->tolink_count;
+	state->relinked_size += group->record.size * (count - 1);
+
+	char buffer[DIGEST_MAX_LENGTH * 2 + 1];
+	for (size_t i = 0; i < state->digest->length; ++i)
+		snprintf(buffer + (i * 2), 3, "%02x", (int)group->record.hash[i]);
+
+	printf(
+		state->tty ? "\e[1mDuplicate \e[31m%s\e[39m (%llu bytes):\e[0m\n" : "Duplicate %s (%llu bytes):\n",
+		buffer,
+		(unsigned long long)group->record.size);
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		printf(
+			state->tty ? " \e[1m%s\e[0m \e[2m#%llu on %u:%u\e[0m\n" : " %s #%llu on %u:%u\n",
+			group[i].host,
+			group[i].record.ino,
+			major(group[i].record.dev),
+			minor(group[i].record.dev));
+
+		const char* path = group[i].paths;
+		for (unsigned int j = 0; j < group[i].record.path_count; ++j)
+		{
+			printf("  %s\n", path);
+			path += strlen(path) + 1;
+		}
+	}
+}
+
+// Finds duplicates with memory bounded by the number of directories instead
+// of files. The scan writes its records to sorted runs, which are merged by
+// size to hash the files with company in batches. Their digests go to another
+// set of runs, merged by digest to find the duplicate groups.
+static bool spill_all(struct dedupe_state* state)
+{
+	state->spill_runs = spill_runs_create(state, sizeof(struct spill_record), spill_record_sortcb);
+	state->spill_digests = spill_runs_create(state, sizeof(struct spill_digest), spill_digest_sortcb);
+
+	if (!state->spill_runs->failed && !state->spill_digests->failed)
+		scan_all(state);
+	for (size_t i = 0; i < state->spill_names_count; ++i)
+	{
+		if (state->spill_names[i] && fflush(state->spill_names[i]) == EOF)
+		{
+			perror(state->spill_path);
+			state->spill_runs->failed = true;
+		}
+	}
+	stats_phase(state, "scan", state->file_count);
+
+	// Files left out of a run would silently go unhashed and unlinked.
+	if (!state->spill_runs->failed)
+	{
+		spill_hash(state);
+		stats_phase(state, "hash", state->tohash_count);
+	}
+
+	if (state->verbose && state->tty)
+	{
+		fputs("\e[u\e[J", stdout);
+		fflush(stdout);
+	}
+
+	if (!state->spill_runs->failed && !state->spill_digests->failed)
+	{
+		spill_link(state);
+		stats_phase(state, "relink", state->relinked_count);
+	}
+
+	bool success = !state->spill_runs->failed && !state->spill_digests->failed;
+	if (!success)
+		fprintf(stderr, "%s: couldn't keep all file records in the spill files, stopping\n", state->spill_path);
+
+	struct spill_runs* runs[] = { state->spill_runs, state->spill_digests };
+	for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); ++i)
+	{
+		if (runs[i]->file)
+			fclose(runs[i]->file);
+	}
+
+	for (size_t i = 0; i < state->spill_names_count; ++i)
+	{
+		if (state->spill_names[i])
+			fclose(state->spill_names[i]);
+	}
+
+	return success;
+}
+
+// Creates a temporary file in the spill directory, gone once it is closed.
+static FILE* spill_open(struct dedupe_state* state)
+{
+	char* fpath = talloc_asprintf(NULL, "%s/.dedupe.XXXXXX", state->spill_path);
+	FILE* result = NULL;
+
+	int fd = mkstemp(fpath);
+	if (fd == -1 || unlink(fpath) == -1 || !(result = fdopen(fd, "w+")))
+	{
+		perror(fpath);
+		if (fd != -1)
+			close(fd);
+	}
+
+	talloc_free(fpath);
+	return result;
+}
+
+static struct spill_runs* spill_runs_create(struct dedupe_state* state, size_t width, int (*sort_function)(const void*, const void*))
+{
+	struct spill_runs* result = talloc_zero(state, struct spill_runs);
+	result->width = width;
+	result->sort_function = sort_function;
+	result->runs = talloc_array(result, struct spill_run, 0);
+	result->failed = !(result->file = spill_open(state));
+	return result;
+}
+
+// Sorts a full buffer and writes it out as another run. Scan workers call
+// this as well, so only reserving the run's range takes the lock.
+static void spill_write(struct dedupe_state* state, struct spill_runs* runs, void* buffer, size_t count)
+{
+	if (!count)
+		return;
+
+	qsort(buffer, count, runs->width, runs->sort_function);
+
+	pthread_mutex_lock(&state->lock);
+	unsigned long long offset = runs->size;
+	runs->size += count * runs->width;
+	runs->runs = talloc_realloc(runs, runs->runs, struct spill_run, runs->count + 1);
+	runs->runs[runs->count++] = (struct spill_run){ offset, count };
+	pthread_mutex_unlock(&state->lock);
+
+	if (!spill_pwrite(fileno(runs->file), buffer, count * runs->width, offset))
+	{
+		perror(state->spill_path);
+		__atomic_store_n(&runs->failed, true, __ATOMIC_RELAXED);
+	}
+}
+
+static bool spill_pwrite(int fd, const void* buffer, size_t size, unsigned long long offset)
+{
+	for (size_t done = 0; done < size;)
+	{
+		ssize_t result = pwrite(fd, (const unsigned char*)buffer + done, size - done, offset + done);
+		if (result == -1 && errno == EINTR)
+			continue;
+
+		if (result <= 0)
+		{
+			if (!result)
+				errno = ENOSPC;
+			return false;
+		}
+
+		done += result;
+	}
+
+	return true;
+}
+
+// Merges the runs SPILL_FANIN at a time into a second file until at most that
+// many are left, so the final merge holds a bounded number of stream buffers.
+static bool spill_reduce(struct dedupe_state* state, struct spill_runs* runs)
+{
+	size_t capacity = SPILL_STREAM_SIZE / runs->width;
+	unsigned char* buffer = talloc_array(runs, unsigned char, capacity * runs->width);
+
+	while (runs->count > SPILL_FANIN && !runs->failed)
+	{
+		FILE* file = spill_open(state);
+		if (!file)
+		{
+			runs->failed = true;
+			break;
+		}
+
+		size_t count = 0;
+		unsigned long long size = 0;
+		struct spill_run* merged = talloc_array(runs, struct spill_run, (runs->count + SPILL_FANIN - 1) / SPILL_FANIN);
+		for (size_t i = 0; i < runs->count && !runs->failed; i += SPILL_FANIN)
+		{
+			struct spill_merge* merge = spill_merge_create(runs, runs, i, runs->count - i < SPILL_FANIN ? runs->count - i : SPILL_FANIN);
+			struct spill_run* run = &merged[count++];
+			run->offset = size;
+			run->count = 0;
+
+			size_t pending = 0;
+			while (true)
+			{
+				bool more = spill_merge_next(merge, buffer + pending * runs->width);
+				pending += more;
+				if (pending < capacity && more)
+					continue;
+
+				if (!spill_pwrite(fileno(file), buffer, pending * runs->width, size))
+				{
+					perror(state->spill_path);
+					runs->failed = true;
+					break;
+				}
+
+				run->count += pending;
+				size += pending * runs->width;
+				pending = 0;
+				if (!more)
+					break;
+			}
+
+			talloc_free(merge);
+		}
+
+		fclose(runs->file);
+		talloc_free(runs->runs);
+		runs->file = file;
+		runs->size = size;
+		runs->count = count;
+		runs->runs = merged;
+	}
+
+	talloc_free(buffer);
+	return !runs->failed;
+}
+
+static void spill_file(struct scan_worker* worker, struct dir_entry* dentry, const char* name, ino_t ino, const struct inode_entry* record)
+{
+	struct dedupe_state* state = worker->pool->state;
+	__atomic_add_fetch(&state->file_count, 1, __ATOMIC_RELAXED);
+
+	if (!worker->spill_names || !is_wanted(state, record) || __atomic_load_n(&state->spill_runs->failed, __ATOMIC_RELAXED))
+		return;
+
+	if (!worker->spill)
+	{
+		worker->spill_capacity = SPILL_BUFFER_SIZE / sizeof(struct spill_record) / worker->pool->count;
+		if (!(worker->spill = malloc(worker->spill_capacity * sizeof(struct spill_record))))
+		{
+			perror("malloc");
+			__atomic_store_n(&state->spill_runs->failed, true, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+
+	size_t length = strlen(name) + 1;
+	if (fwrite(name, 1, length, worker->spill_names) != length)
+	{
+		perror(state->spill_path);
+		__atomic_store_n(&state->spill_runs->failed, true, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct spill_record* entry = &worker->spill[worker->spill_count++];
+	memset(entry, 0, sizeof(struct spill_record));
+	entry->dev = record->dev;
+	entry->ino = ino;
+	entry->size = record->size;
+	entry->mtime = record->mtime;
+	entry->ctime = record->ctime;
+	entry->dir = dentry;
+	entry->name = worker->spill_names_size;
+	entry->names = worker->spill_names_index;
+	worker->spill_names_size += length;
+
+	if (worker->spill_count == worker->spill_capacity)
+		spill_flush(worker);
+}
+
+static void spill_flush(struct scan_worker* worker)
+{
+	if (!worker->spill_count)
+		return;
+
+	struct dedupe_state* state = worker->pool->state;
+	spill_write(state, state->spill_runs, worker->spill, worker->spill_count);
+	worker->spill_count = 0;
+}
+
+static int spill_record_sortcb(const void* p1, const void* p2)
+{
+	const struct spill_record
+		*record0 = p1,
+		*record1 = p2;
+
+	if (record0->size != record1->size)
+		return record0->size < record1->size ? -1 : 1;
+	else if (record0->dev != record1->dev)
+		return record0->dev < record1->dev ? -1 : 1;
+	else if (record0->ino != record1->ino)
+		return record0->ino < record1->ino ? -1 : 1;
+	else
+		return 0;
+}
+
+static int spill_digest_sortcb(const void* p1, const void* p2)
+{
+	const struct spill_digest
+		*digest0 = p1,
+		*digest1 = p2;
+
+	int result = memcmp(digest0->hash, digest1->hash, DIGEST_MAX_LENGTH);
+	if (result)
+		return result;
+
+	return spill_record_sortcb(&digest0->record, &digest1->record);
+}
+
+// Merges count runs starting with the first one given.
+static struct spill_merge* spill_merge_create(void* ctx, struct spill_runs* runs, size_t first, size_t count)
+{
+	struct spill_merge* merge = talloc_zero(ctx, struct spill_merge);
+	merge->runs = runs;
+	merge->heap = talloc_zero_array(merge, struct spill_stream, count);
+
+	size_t capacity = SPILL_STREAM_SIZE / runs->width;
+	for (size_t i = 0; i < count; ++i)
+	{
+		struct spill_stream* stream = &merge->heap[merge->count];
+		if (!stream->buffer)
+			stream->buffer = talloc_array(merge, unsigned char, capacity * runs->width);
+
+		stream->fd = fileno(runs->file);
+		stream->offset = runs->runs[first + i].offset;
+		stream->left = runs->runs[first + i].count;
+		if (spill_stream_fill(runs, stream))
+			++merge->count;
+	}
+
+	for (size_t i = merge->count / 2; i-- > 0; )
+		spill_merge_sift(merge, i);
+
+	return merge;
+}
+
+// Copies the smallest record left in any run to record, or returns false once
+// all runs are exhausted.
+static bool spill_merge_next(struct spill_merge* merge, void* record)
+{
+	if (!merge->count)
+		return false;
+
+	size_t width = merge->runs->width;
+	struct spill_stream* stream = &merge->heap[0];
+	memcpy(record, stream->buffer + stream->next * width, width);
+
+	if (++stream->next == stream->count && !spill_stream_fill(merge->runs, stream))
+	{
+		struct spill_stream done = *stream;
+		*stream = merge->heap[--merge->count];
+		merge->heap[merge->count] = done;
+	}
+
+	if (merge->count)
+		spill_merge_sift(merge, 0);
+
+	return true;
+}
+
+static bool spill_stream_fill(struct spill_runs* runs, struct spill_stream* stream)
+{
+	stream->next = 0;
+	stream->count = stream->left < SPILL_STREAM_SIZE / runs->width ? stream->left : SPILL_STREAM_SIZE / runs->width;
+	size_t size = stream->count * runs->width;
+	for (size_t done = 0; done < size;)
+	{
+		ssize_t result = pread(stream->fd, stream->buffer + done, size - done, stream->offset + done);
+		if (result == -1 && errno == EINTR)
+			continue;
+
+		if (result <= 0)
+		{
+			if (!result)
+				errno = EIO;
+			perror("pread");
+			runs->failed = true;
+			stream->count = 0;
+			break;
+		}
+
+		done += result;
+	}
+
+	stream->offset += size;
+	stream->left -= stream->count;
+	return stream->count;
+}
+
+static void spill_merge_sift(struct spill_merge* merge, size_t i)
+{
+	size_t width = merge->runs->width;
+	while (true)
+	{
+		size_t smallest = i;
+		for (size_t child = i * 2 + 1; child <= i * 2 + 2 && child < merge->count; ++child)
+		{
+			struct spill_stream
+				*stream0 = &merge->heap[child],
+				*stream1 = &merge->heap[smallest];
+
+			if (merge->runs->sort_function(stream0->buffer + stream0->next * width, stream1->buffer + stream1->next * width) < 0)
+				smallest = child;
+		}
+
+		if (smallest == i)
+			return;
+
+		struct spill_stream swap = merge->heap[i];
+		merge->heap[i] = merge->heap[smallest];
+		merge->heap[smallest] = swap;
+		i = smallest;
+	}
+}
+
+// Streams the scan records by size and device and hashes every group with at
+// least two inodes.
+static void spill_hash(struct dedupe_state* state)
+{
+	if (!spill_reduce(state, state->spill_runs))
+		return;
+
+	struct spill_merge* merge = spill_merge_create(state, state->spill_runs, 0, state->spill_runs->count);
+
+	struct spill_batch batch = { talloc_new(state) };
+	batch.digest_capacity = SPILL_BUFFER_SIZE / sizeof(struct spill_digest);
+	batch.digests = talloc_array(state, struct spill_digest, batch.digest_capacity);
+
+	size_t count = 0, capacity = 16;
+	struct spill_record* group = talloc_array(state, struct spill_record, capacity);
+
+	// A size bucket larger than SPILL_GROUP records is passed on in parts,
+	// split between inodes. Since the part after a split holds another inode,
+	// the bucket has company either way. Only the links of a single inode,
+	// which the file system bounds, can make the array grow past that.
+	bool company = false;
+	struct spill_record record;
+	while (spill_merge_next(merge, &record))
+	{
+		if (count && (record.size != group->size || record.dev != group->dev))
+		{
+			spill_group(state, &batch, group, count, company);
+			count = 0;
+			company = false;
+		}
+
+		if (count >= SPILL_GROUP && record.ino != group[count - 1].ino)
+		{
+			spill_group(state, &batch, group, count, true);
+			count = 0;
+			company = true;
+		}
+
+		if (count == capacity)
+		{
+			capacity *= 2;
+			group = talloc_realloc(state, group, struct spill_record, capacity);
+		}
+
+		group[count++] = record;
+	}
+
+	spill_group(state, &batch, group, count, company);
+	spill_batch_flush(state, &batch);
+	spill_write(state, state->spill_digests, batch.digests, batch.digest_count);
+
+	talloc_free(group);
+	talloc_free(batch.digests);
+	talloc_free(batch.ctx);
+	talloc_free(merge);
+}
+
+// Adds the inodes of a size bucket to the batch, unless they are all the same.
+// Records of the same inode are next to each other.
+static void spill_group(struct dedupe_state* state, struct spill_batch* batch, const struct spill_record* group, size_t count, bool company)
+{
+	size_t inodes = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (!i || group[i].ino != group[i - 1].ino)
+			++inodes;
+	}
+
+	state->inode_count += inodes;
+	if (inodes < 2 && !company)
+		return;
+
+	for (size_t i = 0, j; i < count; i = j)
+	{
+		for (j = i + 1; j < count && group[j].ino == group[i].ino; ++j);
+
+		if (batch->count + 1 >= batch->capacity)
+		{
+			batch->capacity = batch->capacity ? batch->capacity * 2 : 64;
+			batch->inodes = talloc_realloc(batch->ctx, batch->inodes, struct inode_entry*, batch->capacity);
+			batch->first = talloc_realloc(batch->ctx, batch->first, size_t, batch->capacity);
+		}
+
+		while (batch->record_count + (j - i) > batch->record_capacity)
+		{
+			batch->record_capacity = batch->record_capacity ? batch->record_capacity * 2 : 64;
+			batch->records = talloc_realloc(batch->ctx, batch->records, struct spill_record, batch->record_capacity);
+		}
+
+		struct inode_entry* inode = spill_inode(batch->ctx, &group[i]);
+		for (size_t k = i; k < j; ++k)
+			spill_path(state, batch->ctx, inode, &group[k]);
+
+		batch->first[batch->count] = batch->record_count;
+		batch->inodes[batch->count++] = inode;
+		memcpy(batch->records + batch->record_count, group + i, (j - i) * sizeof(struct spill_record));
+		batch->record_count += j - i;
+		batch->size += inode->size;
+	}
+
+	if (batch->count >= SPILL_BATCH)
+		spill_batch_flush(state, batch);
+}
+
+// Hashes the batch and passes the digest of every path on to the next runs.
+static void spill_batch_flush(struct dedupe_state* state, struct spill_batch* batch)
+{
+	if (!batch->count)
+		return;
+
+	batch->first[batch->count] = batch->record_count;
+
+	// Ordering must not lose track of which records belong to which inode.
+	struct inode_entry** list = talloc_memdup(batch->ctx, batch->inodes, batch->count * sizeof(struct inode_entry*));
+	order_inodes(state, list, batch->count);
+	process_inodes(state, list, batch->count, hash_inode, batch->size);
+
+	for (size_t i = 0; i < batch->count; ++i)
+	{
+		struct inode_entry* inode = batch->inodes[i];
+		if (!inode->hashed)
+			continue;
+
+		++state->tohash_count;
+		state->tohash_size += inode->size;
+		for (size_t j = batch->first[i]; j < batch->first[i + 1]; ++j)
+		{
+			if (batch->digest_count == batch->digest_capacity)
+			{
+				spill_write(state, state->spill_digests, batch->digests, batch->digest_count);
+				batch->digest_count = 0;
+			}
+
+			struct spill_digest* digest = &batch->digests[batch->digest_count++];
+			memcpy(digest->hash, inode->hash, DIGEST_MAX_LENGTH);
+			digest->record = batch->records[j];
+		}
+	}
+
+	talloc_free(batch->ctx);
+	batch->ctx = talloc_new(state);
+	batch->count = batch->capacity = 0;
+	batch->record_count = batch->record_capacity = 0;
+	batch->inodes = NULL;
+	batch->first = NULL;
+	batch->records = NULL;
+	batch->size = 0;
+}
+
+// Streams the digests in order and relinks every group of the same digest,
+// size and device.
+static void spill_link(struct dedupe_state* state)
+{
+	if (!spill_reduce(state, state->spill_digests))
+		return;
+
+	struct spill_merge* merge = spill_merge_create(state, state->spill_digests, 0, state->spill_digests->count);
+
+	size_t count = 0, capacity = 16;
+	struct spill_digest* group = talloc_array(state, struct spill_digest, capacity);
+
+	struct spill_digest digest;
+	while (spill_merge_next(merge, &digest))
+	{
+		if (count && (memcmp(digest.hash, group->hash, DIGEST_MAX_LENGTH) || digest.record.size != group->record.size || digest.record.dev != group->record.dev))
+		{
+			spill_relink(state, group, count);
+			count = 0;
+		}
+
+		if (count == capacity)
+		{
+			capacity *= 2;
+			group = talloc_realloc(state, group, struct spill_digest, capacity);
+		}
+
+		group[count++] = digest;
+	}
+
+	spill_relink(state, group, count);
+
+	talloc_free(group);
+	talloc_free(merge);
+}
+
+static void spill_relink(struct dedupe_state* state, const struct spill_digest* group, size_t count)
+{
+	size_t inodes = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (!i || group[i].record.ino != group[i - 1].record.ino)
+			++inodes;
+	}
+
+	if (inodes < 2)
+		return;
+
+	void* ctx = talloc_new(state);
+	struct hash_bucket bucket = { 0, talloc_memdup(ctx, group->hash, DIGEST_MAX_LENGTH), inodes, NULL };
+
+	struct inode_entry* inode = NULL;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (!i || group[i].record.ino != group[i - 1].record.ino)
+		{
+			inode = spill_inode(ctx, &group[i].record);
+			inode->hash = bucket.key;
+			inode->hashed = true;
+			inode->next_by_hash = bucket.value;
+			bucket.value = inode;
+		}
+
+		spill_path(state, ctx, inode, &group[i].record);
+	}
+
+	relink(state, &bucket);
+	talloc_free(ctx);
+}
+
+static struct inode_entry* spill_inode(void* ctx, const struct spill_record* record)
+{
+	struct inode_entry* inode = talloc_zero(ctx, struct inode_entry);
+	inode->dev = record->dev;
+	inode->ino = record->ino;
+	inode->size = record->size;
+	inode->mtime = record->mtime;
+	inode->ctime = record->ctime;
+	inode->hash = talloc_zero_array(ctx, unsigned char, DIGEST_MAX_LENGTH);
+	return inode;
+}
+
+// Reads the name of a record back from its worker's file.
+static void spill_path(struct dedupe_state* state, void* ctx, struct inode_entry* inode, const struct spill_record* record)
+{
+	char name[NAME_MAX + 1];
+	ssize_t length = pread(fileno(state->spill_names[record->names]), name, sizeof(name), record->name);
+	if (length <= 0 || !memchr(name, 0, length))
+	{
+		if (length == -1)
+			perror(state->spill_path);
+		return;
+	}
+
+	size_t size = strlen(name) + 1;
+	struct path_entry* path = talloc_size(ctx, sizeof(struct path_entry) + size);
+	path->dir = record->dir;
+	memcpy(path->name, name, size);
+	path->next = inode->paths;
+	inode->paths = path;
+}
+
+static void index_load(struct dedupe_state* state)
+{
+	int fd = open(state->index_path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+	{
+		if (errno != ENOENT)
+			perror(state->index_path);
+		return;
+	}
+
+	struct stat buffer;
+	if (fstat(fd, &buffer) == -1)
+	{
+		perror(state->index_path);
+		close(fd);
+		return;
+	}
+
+	if (buffer.st_size < sizeof(struct index_header))
+	{
+		close(fd);
+		return;
+	}
+
+	void* map = mmap(NULL, buffer.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+	{
+		perror(state->index_path);
+		return;
+	}
+
+	const struct index_header* header = map;
+	if (memcmp(header->magic, "dedupe\0\1", 8) ||
+		strncmp(header->digest, state->digest->name, sizeof(header->digest)) ||
+		header->record_size != sizeof(struct index_record) ||
+		header->count > (buffer.st_size - sizeof(struct index_header)) / sizeof(struct index_record))
+	{
+		fprintf(stderr, "%s: ignoring incompatible index\n", state->index_path);
+		munmap(map, buffer.st_size);
+		return;
+	}
+
+	state->index_map = map;
+	state->index_map_size = buffer.st_size;
+	state->index_count = header->count;
+	state->index_records = (const struct index_record*)(header + 1);
+
+	madvise(map, buffer.st_size, MADV_RANDOM);
+}
+
+static const struct index_record* index_find(struct dedupe_state* state, struct inode_entry* inode)
+{
+	const struct index_record* record = index_search(state->index_records, state->index_count, inode);
+	return record ? record : index_search(state->checkpoint_records, state->checkpoint_count, inode);
+}
+
+// Unlike the index, a checkpoint can hold several records for an inode, one
+// for each time it was hashed or relinked, so all of them are checked.
+static const struct index_record* index_search(const struct index_record* records, size_t count, struct inode_entry* inode)
+{
+	size_t low = 0, high = count;
+	while (low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+		const struct index_record* record = &records[middle];
+
+		if (record->dev < inode->dev || (record->dev == inode->dev && record->ino < inode->ino))
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	for (; low < count && records[low].dev == inode->dev && records[low].ino == inode->ino; ++low)
+	{
+		const struct index_record* record = &records[low];
+		if (record->size == inode->size &&
+			record->mtime_sec == inode->mtime.tv_sec && record->mtime_nsec == inode->mtime.tv_nsec &&
+			record->ctime_sec == inode->ctime.tv_sec && record->ctime_nsec == inode->ctime.tv_nsec)
+			return record;
+	}
+
+	return NULL;
+}
+
+// Writes the digests of every inode seen in this run, either freshly computed
+// or still valid from the previous index, and atomically replaces the file.
+static void index_save(struct dedupe_state* state0)
+{
+	struct index_save_state state1 = { state0, 16, 0 };
+	state1.records = talloc_array(state0, struct index_record, state1.capacity);
+
+	for (size_t i = 0; i < state0->device_count; ++i)
+		hash_map_walk(state0->devices[i]->inode_lookup, &state1, index_save_walkcb);
+	qsort(state1.records, state1.count, sizeof(struct index_record), index_sortcb);
+
+	struct index_header header;
+	memset(&header, 0, sizeof(struct index_header));
+	memcpy(header.magic, "dedupe\0\1", 8);
+	strncpy(header.digest, state0->digest->name, sizeof(header.digest) - 1);
+	header.record_size = sizeof(struct index_record);
+	header.count = state1.count;
+
+	char* tmp = talloc_asprintf(state0, "%s.tmp", state0->index_path);
+	FILE* f = fopen(tmp, "wb");
+	if (!f)
+	{
+		perror(tmp);
+	}
+	else if (fwrite(&header, sizeof(struct index_header), 1, f) != 1 ||
+		fwrite(state1.records, sizeof(struct index_record), state1.count, f) != state1.count ||
+		fflush(f) || fsync(fileno(f)))
+	{
+		perror(tmp);
+		fclose(f);
+		unlink(tmp);
+	}
+	else if (fclose(f) || rename(tmp, state0->index_path) == -1)
+	{
+		perror(state0->index_path);
+		unlink(tmp);
+	}
+
+	talloc_free(tmp);
+	talloc_free(state1.records);
+
+	if (state0->index_map)
+		munmap(state0->index_map, state0->index_map_size);
+
+	state0->index_map = NULL;
+	state0->index_count = 0;
+}
+
+static void index_save_walkcb(void* state0, struct hash_bucket* inode_bucket)
+{
+	struct index_save_state* state1 = state0;
+	struct inode_entry* inode = inode_bucket->value;
+	if (!inode)
+		return;
+
+	const unsigned char* hash;
+	if (inode->hash && inode->hashed && !(state1->state0->prefilter_only && inode->size > state1->state0->prefilter * 2))
+	{
+		hash = inode->hash;
+	}
+	else
+	{
+		const struct index_record* record = index_find(state1->state0, inode);
+		if (!record)
+			return;
+
+		hash = record->hash;
+	}
+
+	if (state1->capacity == state1->count)
+	{
+		state1->capacity *= 2;
+		state1->records = talloc_realloc(state1->state0, state1->records, struct index_record, state1->capacity);
+	}
+
+	index_fill(&state1->records[state1->count++], inode, hash);
+}
+
+static int index_sortcb(const void* p1, const void* p2)
+{
+	const struct index_record
+		*record0 = p1,
+		*record1 = p2;
+
+	if (record0->dev != record1->dev)
+		return record0->dev < record1->dev ? -1 : 1;
+	else if (record0->ino != record1->ino)
+		return record0->ino < record1->ino ? -1 : 1;
+	else
+		return 0;
+}
+
+static void index_fill(struct index_record* record, const struct inode_entry* inode, const unsigned char* hash)
+{
+	record->dev = inode->dev;
+	record->ino = inode->ino;
+	record->size = inode->size;
+	record->mtime_sec = inode->mtime.tv_sec;
+	record->mtime_nsec = inode->mtime.tv_nsec;
+	record->ctime_sec = inode->ctime.tv_sec;
+	record->ctime_nsec = inode->ctime.tv_nsec;
+	memcpy(record->hash, hash, DIGEST_MAX_LENGTH);
+}
+
+// The checkpoint file is an index header followed by records appended in the
+// order files were hashed or relinked, so a run killed at any point leaves
+// every record written before the last flush intact. The scan inventory goes
+// to the snapshot file alongside it.
+static void checkpoint_open(struct dedupe_state* state)
+{
+	if (state->resume)
+		checkpoint_load(state);
+
+	if (!state->checkpoint_records)
+	{
+		if (state->checkpoint_snapshot)
+			unlink(state->snapshot_path);
+
+		struct index_header header;
+		memset(&header, 0, sizeof(struct index_header));
+		memcpy(header.magic, "dedupe\0\4", 8);
+		strncpy(header.digest, state->digest->name, sizeof(header.digest) - 1);
+		header.record_size = sizeof(struct index_record);
+
+		if (!(state->checkpoint = fopen(state->checkpoint_path, "wb")) ||
+			fwrite(&header, sizeof(struct index_header), 1, state->checkpoint) != 1 ||
+			fflush(state->checkpoint))
+		{
+			perror(state->checkpoint_path);
+			if (state->checkpoint)
+				fclose(state->checkpoint);
+			state->checkpoint = NULL;
+			return;
+		}
+	}
+	else if (!(state->checkpoint = fopen(state->checkpoint_path, "ab")))
+	{
+		perror(state->checkpoint_path);
+		return;
+	}
+
+	state->checkpoint_pending_capacity = 256;
+	state->checkpoint_pending = talloc_array(state, struct index_record, state->checkpoint_pending_capacity);
+	state->checkpoint_time = stats_clock();
+}
+
+// Reads back the records of an interrupted run, dropping a partly written
+// last one, and sorts them for index_find.
+static void checkpoint_load(struct dedupe_state* state)
+{
+	FILE* f = fopen(state->checkpoint_path, "rb");
+	if (!f)
+	{
+		if (errno != ENOENT)
+			perror(state->checkpoint_path);
+		return;
+	}
+
+	struct index_header header;
+	struct stat buffer;
+	if (fstat(fileno(f), &buffer) == -1)
+	{
+		perror(state->checkpoint_path);
+		fclose(f);
+		return;
+	}
+
+	if (fread(&header, sizeof(struct index_header), 1, f) != 1 ||
+		memcmp(header.magic, "dedupe\0\4", 8) ||
+		strncmp(header.digest, state->digest->name, sizeof(header.digest)) ||
+		header.record_size != sizeof(struct index_record))
+	{
+		fprintf(stderr, "%s: ignoring incompatible checkpoint\n", state->checkpoint_path);
+		fclose(f);
+		return;
+	}
+
+	size_t count = (buffer.st_size - sizeof(struct index_header)) / sizeof(struct index_record);
+	struct index_record* records = talloc_array(state, struct index_record, count ? count : 1);
+	count = fread(records, sizeof(struct index_record), count, f);
+	fclose(f);
+
+	qsort(records, count, sizeof(struct index_record), index_sortcb);
+	state->checkpoint_records = records;
+	state->checkpoint_count = count;
+
+	if (state->verbose)
+		printf("Resuming with %zu hashed files from %s.\n", count, state->checkpoint_path);
+}
+
+// Queues the digest of a file that was just hashed, or whose ctime changed
+// by relinking it, and writes the queue out every CHECKPOINT_INTERVAL
+// seconds. The hashing threads call it without holding the lock.
+static void checkpoint_add(struct dedupe_state* state, const struct inode_entry* inode)
+{
+	if (!state->checkpoint_path || !inode->hash || (state->prefilter_only && inode->size > state->prefilter * 2))
+		return;
+
+	// A failed write closes the checkpoint under the lock, so it is only
+	// looked at once the lock is held.
+	pthread_mutex_lock(&state->lock);
+	if (!state->checkpoint)
+	{
+		pthread_mutex_unlock(&state->lock);
+		return;
+	}
+
+	if (state->checkpoint_pending_count == state->checkpoint_pending_capacity)
+	{
+		state->checkpoint_pending_capacity *= 2;
+		state->checkpoint_pending = talloc_realloc(state, state->checkpoint_pending, struct index_record, state->checkpoint_pending_capacity);
+	}
+
+	index_fill(&state->checkpoint_pending[state->checkpoint_pending_count++], inode, inode->hash);
+	if (stats_clock() - state->checkpoint_time >= CHECKPOINT_INTERVAL)
+		checkpoint_flush(state);
+	pthread_mutex_unlock(&state->lock);
+}
+
+// Must be called with the lock held while other threads are running.
+static void checkpoint_flush(struct dedupe_state* state)
+{
+	size_t count = state->checkpoint_pending_count;
+	if (fwrite(state->checkpoint_pending, sizeof(struct index_record), count, state->checkpoint) != count ||
+		fflush(state->checkpoint) || fsync(fileno(state->checkpoint)))
+	{
+		perror(state->checkpoint_path);
+		fclose(state->checkpoint);
+		state->checkpoint = NULL;
+	}
+
+	state->checkpoint_pending_count = 0;
+	state->checkpoint_time = stats_clock();
+}
+
+// A run that got this far has nothing left to resume.
+static void checkpoint_finish(struct dedupe_state* state)
+{
+	fclose(state->checkpoint);
+	state->checkpoint = NULL;
+
+	if (unlink(state->checkpoint_path) == -1)
+		perror(state->checkpoint_path);
+	if (state->checkpoint_snapshot)
+		unlink(state->snapshot_path);
+}
+
+static void snapshot_load(struct dedupe_state* state)
+{
+	int fd = open(state->snapshot_path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+	{
+		if (errno != ENOENT)
+			perror(state->snapshot_path);
+		return;
+	}
+
+	struct stat buffer;
+	if (fstat(fd, &buffer) == -1)
+	{
+		perror(state->snapshot_path);
+		close(fd);
+		return;
+	}
+
+	if (buffer.st_size < sizeof(struct snapshot_header))
+	{
+		close(fd);
+		return;
+	}
+
+	void* map = mmap(NULL, buffer.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+	{
+		perror(state->snapshot_path);
+		return;
+	}
+
+	const struct snapshot_header* header = map;
+	size_t available = buffer.st_size - sizeof(struct snapshot_header);
+	if (memcmp(header->magic, "dedupe\0\5", 8) ||
+		header->count > available / sizeof(struct snapshot_dir) ||
+		header->blob_size != available - header->count * sizeof(struct snapshot_dir))
+	{
+		fprintf(stderr, "%s: ignoring incompatible snapshot\n", state->snapshot_path);
+		munmap(map, buffer.st_size);
+		return;
+	}
+
+	if (header->excludes != snapshot_excludes(state))
+	{
+		fprintf(stderr, "%s: ignoring snapshot taken with different exclusions\n", state->snapshot_path);
+		munmap(map, buffer.st_size);
+		return;
+	}
+
+	state->snapshot_map = map;
+	state->snapshot_map_size = buffer.st_size;
+	state->snapshot_count = header->count;
+	state->snapshot_dirs = (const struct snapshot_dir*)(header + 1);
+	state->snapshot_blob = (const unsigned char*)(state->snapshot_dirs + header->count);
+	state->snapshot_blob_size = header->blob_size;
+}
+
+// Returns the recorded children of a directory, provided it hasn't been
+// modified since the snapshot was taken. A file rewritten in place leaves its
+// directory's timestamps alone, so each listing is also read again at most
+// SNAPSHOT_EXPIRY after it was, at a point spread over the second half of
+// that by inode so that a tree doesn't expire all at once.
+static const struct snapshot_dir* snapshot_find(struct dedupe_state* state, const struct stat* buffer)
+{
+	size_t low = 0, high = state->snapshot_count;
+	while (low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+		const struct snapshot_dir* record = &state->snapshot_dirs[middle];
+
+		if (record->dev < buffer->st_dev || (record->dev == buffer->st_dev && record->ino < buffer->st_ino))
+		{
+			low = middle + 1;
+		}
+		else if (record->dev == buffer->st_dev && record->ino == buffer->st_ino)
+		{
+			long long expiry = SNAPSHOT_EXPIRY / 2 + (long long)((record->ino * 0x9E3779B97F4A7C15ULL) % (SNAPSHOT_EXPIRY / 2));
+			if (record->mtime_sec == buffer->st_mtim.tv_sec && record->mtime_nsec == buffer->st_mtim.tv_nsec &&
+				record->ctime_sec == buffer->st_ctim.tv_sec && record->ctime_nsec == buffer->st_ctim.tv_nsec &&
+				state->snapshot_time - record->scanned < expiry &&
+				record->offset <= state->snapshot_blob_size &&
+				record->size <= state->snapshot_blob_size - record->offset)
+				return record;
+
+			return NULL;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	return NULL;
+}
+
+static void snapshot_child(struct scan_worker* worker, unsigned short type, const char* name, ino_t ino, const struct inode_entry* inode)
+{
+	if (!worker->snapshot)
+		return;
+
+	struct snapshot_child child = { type, strlen(name) };
+	fwrite(&child, sizeof(struct snapshot_child), 1, worker->snapshot);
+	fwrite(name, 1, child.length, worker->snapshot);
+	worker->snapshot_size += sizeof(struct snapshot_child) + child.length;
+
+	if (type != DT_REG)
+		return;
+
+	struct snapshot_file file =
+	{
+		ino,
+		inode->dev,
+		inode->ino,
+		inode->size,
+		inode->mtime.tv_sec,
+		inode->mtime.tv_nsec,
+		inode->ctime.tv_sec,
+		inode->ctime.tv_nsec,
+		inode->nlink,
+		inode->blocks
+	};
+
+	fwrite(&file, sizeof(struct snapshot_file), 1, worker->snapshot);
+	worker->snapshot_size += sizeof(struct snapshot_file);
+}
+
+static void snapshot_end(struct scan_worker* worker, const struct stat* buffer, struct dir_entry* dentry, unsigned long long start, long long scanned)
+{
+	if (!worker->snapshot)
+		return;
+
+	// A directory modified within a second of the scan could change again
+	// without its timestamps moving, so it isn't trusted next time.
+	time_t recent = worker->pool->state->snapshot_time - 1;
+	if (buffer->st_mtime >= recent || buffer->st_ctime >= recent)
+		return;
+
+	if (worker->snapshot_count == worker->snapshot_capacity)
+	{
+		worker->snapshot_capacity = worker->snapshot_capacity ? worker->snapshot_capacity * 2 : 64;
+		worker->snapshot_dirs = realloc(worker->snapshot_dirs, worker->snapshot_capacity * sizeof(struct snapshot_pending));
+	}
+
+	struct snapshot_pending* pending = &worker->snapshot_dirs[worker->snapshot_count++];
+	pending->record.dev = buffer->st_dev;
+	pending->record.ino = buffer->st_ino;
+	pending->record.mtime_sec = buffer->st_mtim.tv_sec;
+	pending->record.mtime_nsec = buffer->st_mtim.tv_nsec;
+	pending->record.ctime_sec = buffer->st_ctim.tv_sec;
+	pending->record.ctime_nsec = buffer->st_ctim.tv_nsec;
+	pending->record.scanned = scanned;
+	pending->record.offset = start;
+	pending->record.size = worker->snapshot_size - start;
+	pending->dir = dentry;
+}
+
+// Writes the directories scanned in this run, minus those holding files found
+// to be stale, and atomically replaces the snapshot file.
+static void snapshot_save(struct dedupe_state* state)
+{
+	struct snapshot_dir* records = talloc_array(state, struct snapshot_dir, state->snapshot_new_count);
+	qsort(state->snapshot_new, state->snapshot_new_count, sizeof(struct snapshot_pending), snapshot_sortcb);
+
+	size_t count = 0;
+	for (size_t i = 0; i < state->snapshot_new_count; ++i)
+	{
+		const struct snapshot_pending* pending = &state->snapshot_new[i];
+		if (pending->dir->stale)
+			continue;
+
+		// Overlapping roots can scan the same directory twice.
+		if (count && !snapshot_sortcb(&records[count - 1], &pending->record))
+			continue;
+
+		records[count++] = pending->record;
+	}
+
+	bool failed = false;
+	struct snapshot_header header;
+	memset(&header, 0, sizeof(struct snapshot_header));
+	memcpy(header.magic, "dedupe\0\5", 8);
+	header.excludes = snapshot_excludes(state);
+	header.count = count;
+
+	for (size_t i = 0; i < state->snapshot_file_count; ++i)
+	{
+		FILE* f = state->snapshot_files[i];
+		if (fflush(f) || ferror(f))
+			failed = true;
+
+		header.blob_size += ftello(f);
+		rewind(f);
+	}
+
+	char* tmp = talloc_asprintf(state, "%s.tmp", state->snapshot_path);
+	FILE* f = failed ? NULL : fopen(tmp, "wb");
+	if (!f)
+	{
+		perror(tmp);
+	}
+	else
+	{
+		failed = fwrite(&header, sizeof(struct snapshot_header), 1, f) != 1 ||
+			fwrite(records, sizeof(struct snapshot_dir), count, f) != count;
+
+		char data[0x10000];
+		for (size_t i = 0; i < state->snapshot_file_count && !failed; ++i)
+		{
+			size_t size;
+			while ((size = fread(data, 1, sizeof(data), state->snapshot_files[i])))
+			{
+				if (fwrite(data, 1, size, f) != size)
+				{
+					failed = true;
+					break;
+				}
+			}
+
+			if (ferror(state->snapshot_files[i]))
+				failed = true;
+		}
+
+		if (failed || fflush(f) || fsync(fileno(f)))
+		{
+			perror(tmp);
+			fclose(f);
+			unlink(tmp);
+		}
+		else if (fclose(f) || rename(tmp, state->snapshot_path) == -1)
+		{
+			perror(state->snapshot_path);
+			unlink(tmp);
+		}
+	}
+
+	for (size_t i = 0; i < state->snapshot_file_count; ++i)
+		fclose(state->snapshot_files[i]);
+
+	talloc_free(tmp);
+	talloc_free(records);
+	talloc_free(state->snapshot_files);
+	talloc_free(state->snapshot_new);
+
+	if (state->snapshot_map)
+		munmap(state->snapshot_map, state->snapshot_map_size);
+
+	state->snapshot_map = NULL;
+	state->snapshot_count = 0;
+	state->snapshot_file_count = 0;
+	state->snapshot_files = NULL;
+	state->snapshot_new_count = 0;
+	state->snapshot_new = NULL;
+}
+
+static int snapshot_sortcb(const void* p1, const void* p2)
+{
+	const struct snapshot_dir
+		*record0 = p1,
+		*record1 = p2;
+
+	if (record0->dev != record1->dev)
+		return record0->dev < record1->dev ? -1 : 1;
+	else if (record0->ino != record1->ino)
+		return record0->ino < record1->ino ? -1 : 1;
+	else
+		return 0;
+}
+
+// A snapshot only lists the children that weren't excluded, so it can only be
+// replayed with the same patterns.
+static unsigned long long snapshot_excludes(struct dedupe_state* state)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < state->xclcount + state->inclcount; ++i)
+	{
+		// Includes follow a marker, which leaves the hash of excludes alone.
+		if (i == state->xclcount)
+			hash = (hash ^ '+') * 0x100000001b3ULL;
+
+		const char* pattern = i < state->xclcount ? state->exclude[i] : state->include[i - state->xclcount];
+		for (const char* p = pattern; ; ++p)
+		{
+			hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
+			if (!*p)
+				break;
+		}
+	}
+
+	return hash;
+}
+
+static bool watch_init(struct dedupe_state* state)
+{
+#if defined(__linux__)
+	state->watch_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (state->watch_fd == -1)
+	{
+		perror("inotify_init1");
+		return false;
+	}
+#elif defined(__FreeBSD__)
+	state->watch_fd = kqueue();
+	if (state->watch_fd == -1)
+	{
+		perror("kqueue");
+		return false;
+	}
+#endif
+
+	state->watch_lookup = hash_map_create(state, &hash_ptr_descriptor, 0);
+	return true;
+}
+
+// Starts watching a directory. Called by the scan workers as well, so the maps
+// are only touched under the lock.
+static void watch_add(struct dedupe_state* state, int fd, const char* dpath, struct dir_entry* dentry, const struct stat* buffer)
+{
+#if defined(__linux__)
+	int wd = inotify_add_watch(state->watch_fd, dpath, IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE|IN_ONLYDIR|IN_DONT_FOLLOW);
+#elif defined(__FreeBSD__)
+	int wd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (wd != -1)
+	{
+		struct kevent change;
+		EV_SET(&change, wd, EVFILT_VNODE, EV_ADD|EV_CLEAR, NOTE_WRITE|NOTE_DELETE|NOTE_RENAME, 0, dentry);
+		if (kevent(state->watch_fd, &change, 1, NULL, 0, NULL) == -1)
+		{
+			int error = errno;
+			close(wd);
+			errno = error;
+			wd = -1;
+		}
+	}
+#endif
+
+	pthread_mutex_lock(&state->lock);
+	if (wd == -1)
+	{
+		if (errno != ENOSPC)
+			perror(dpath);
+		else if (!state->watch_failed)
+			fprintf(stderr, "%s: too many directories to watch, raise fs.inotify.max_user_watches\n", dpath);
+
+		state->watch_failed = true;
+	}
+	else
+	{
+		hash_map_insert(state->watch_lookup, (void*)(intptr_t)wd)->value = dentry;
+		hash_map_insert(device_get(state, buffer->st_dev)->watch_dirs, (void*)buffer->st_ino)->value = dentry;
+	}
+	pthread_mutex_unlock(&state->lock);
+}
+
+static void watch_all(struct dedupe_state* state)
+{
+	struct sigaction action;
+	memset(&action, 0, sizeof(struct sigaction));
+	action.sa_handler = watch_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	state->process_count = 0;
+	state->progress_size = 0;
+
+	if (state->verbose)
+	{
+		printf("Watching %zu directories for changes.\n", state->watch_lookup->item_count);
+		fflush(stdout);
+	}
+
+	while (!watch_stop)
+	{
+		struct pollfd pfd = { state->watch_fd, POLLIN };
+		int result = poll(&pfd, 1, state->watch_count ? 1000 : -1);
+		if (result == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			perror("poll");
+			break;
+		}
+
+		if (result)
+			watch_read(state);
+
+		watch_process(state);
+	}
+}
+
+static void watch_read(struct dedupe_state* state)
+{
+#if defined(__linux__)
+	char buffer[0x10000] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t length = read(state->watch_fd, buffer, sizeof(buffer));
+	if (length == -1)
+	{
+		if (errno != EAGAIN && errno != EINTR)
+			perror("inotify");
+		return;
+	}
+
+	for (char* p = buffer; p < buffer + length; )
+	{
+		const struct inotify_event* event = (const struct inotify_event*)p;
+		p += sizeof(struct inotify_event) + event->len;
+
+		if (event->mask & IN_Q_OVERFLOW)
+		{
+			fputs("inotify: event queue overflowed, some changes were missed\n", stderr);
+			continue;
+		}
+
+		struct hash_bucket* bucket = hash_map_insert(state->watch_lookup, (void*)(intptr_t)event->wd);
+		struct dir_entry* dentry = bucket->value;
+
+		if (event->mask & IN_IGNORED)
+		{
+			bucket->value = NULL;
+			continue;
+		}
+
+		if (!dentry || !event->len || is_excluded(state, dentry, event->name))
+			continue;
+
+		if (event->mask & IN_ISDIR)
+			watch_directory(state, dentry, event->name);
+		else if (event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO))
+			watch_queue(state, dentry, event->name);
+	}
+#elif defined(__FreeBSD__)
+	struct kevent events[64];
+	struct timespec timeout = { 0, 0 };
+	int count = kevent(state->watch_fd, NULL, 0, events, 64, &timeout);
+	if (count == -1)
+	{
+		if (errno != EINTR)
+			perror("kevent");
+		return;
+	}
+
+	for (int i = 0; i < count; ++i)
+	{
+		int fd = events[i].ident;
+		if (events[i].fflags & (NOTE_DELETE|NOTE_RENAME))
+		{
+			hash_map_insert(state->watch_lookup, (void*)(intptr_t)fd)->value = NULL;
+			close(fd);
+			continue;
+		}
+
+		watch_rescan(state, events[i].udata, fd);
+	}
+#endif
+}
+
+#ifdef __FreeBSD__
+// kqueue only reports that a directory changed, not which entry, so the whole
+// directory is read again. Known files that haven't changed are cheap to skip.
+static void watch_rescan(struct dedupe_state* state, struct dir_entry* dentry, int fd)
+{
+	int dfd = openat(fd, ".", O_RDONLY|O_CLOEXEC|O_DIRECTORY);
+	DIR* d = dfd == -1 ? NULL : fdopendir(dfd);
+	if (!d)
+	{
+		char* dpath = path_build(state, dentry, NULL);
+		perror(dpath);
+		talloc_free(dpath);
+		if (dfd != -1)
+			close(dfd);
+		return;
+	}
+
+	struct dirent* e;
+	while ((e = TRACE(TRACE_READDIR, readdir(d))))
+	{
+		if (is_excluded(state, dentry, e->d_name))
+			continue;
+
+		if (e->d_type == DT_DIR)
+			watch_directory(state, dentry, e->d_name);
+		else if (e->d_type == DT_REG)
+			watch_queue(state, dentry, e->d_name);
+	}
+
+	closedir(d);
+}
+#endif
+
+// Starts watching a directory that appeared or moved after the initial scan,
+// and queues the files already in it, which may have been written before the
+// watch was set up.
+static void watch_directory(struct dedupe_state* state, struct dir_entry* parent, const char* name)
+{
+	char* dpath = path_build(state, parent, name);
+	int fd = open(dpath, O_RDONLY|O_CLOEXEC|O_DIRECTORY|O_NOFOLLOW);
+	if (fd == -1)
+	{
+		if (errno != ENOENT)
+			perror(dpath);
+		talloc_free(dpath);
+		return;
+	}
+
+	// Like the scan, stay on the file system of the parent. Going up from a
+	// mount point leads back to the parent's file system.
+	struct stat buffer, parent_buffer;
+	if (fstat(fd, &buffer) == -1 || fstatat(fd, "..", &parent_buffer, 0) == -1 || buffer.st_dev != parent_buffer.st_dev)
+	{
+		close(fd);
+		talloc_free(dpath);
+		return;
+	}
+
+	struct device_entry* device = device_find(state, buffer.st_dev);
+	struct dir_entry* known = device ? hash_map_insert(device->watch_dirs, (void*)buffer.st_ino)->value : NULL;
+	if (known && known->parent == parent && !strcmp(known->name, name))
+	{
+		close(fd);
+		talloc_free(dpath);
+		return;
+	}
+
+	size_t length = strlen(name) + 1;
+	struct dir_entry* dentry = arena_alloc(state->arena, sizeof(struct dir_entry) + length);
+	dentry->parent = parent;
+	dentry->stale = false;
+	memcpy(dentry->name, name, length);
+
+	watch_add(state, fd, dpath, dentry, &buffer);
+
+	DIR* d = fdopendir(fd);
+	if (!d)
+	{
+		perror(dpath);
+		close(fd);
+		talloc_free(dpath);
+		return;
+	}
+
+	struct dirent* e;
+	while ((e = TRACE(TRACE_READDIR, readdir(d))))
+	{
+		if (is_excluded(state, dentry, e->d_name))
+			continue;
+
+		if (e->d_type == DT_DIR)
+			watch_directory(state, dentry, e->d_name);
+		else if (e->d_type == DT_REG)
+			watch_queue(state, dentry, e->d_name);
+	}
+
+	closedir(d);
+	talloc_free(dpath);
+}
+
+static void watch_queue(struct dedupe_state* state, struct dir_entry* dir, const char* name)
+{
+	if (state->watch_count == state->watch_capacity)
+	{
+		state->watch_capacity = state->watch_capacity ? state->watch_capacity * 2 : 16;
+		state->watch_events = talloc_realloc(state, state->watch_events, struct watch_event*, state->watch_capacity);
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	size_t length = strlen(name) + 1;
+	struct watch_event* event = talloc_size(state->watch_events, sizeof(struct watch_event) + length);
+	event->dir = dir;
+	event->time = ts.tv_sec;
+	memcpy(event->name, name, length);
+
+	state->watch_events[state->watch_count++] = event;
+}
+
+static void watch_process(struct dedupe_state* state)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	size_t count = 0, ready = 0;
+	struct watch_event** list = talloc_array(state, struct watch_event*, state->watch_count);
+	for (size_t i = 0; i < state->watch_count; ++i)
+	{
+		struct watch_event* event = state->watch_events[i];
+		if (ts.tv_sec - event->time >= WATCH_DELAY)
+			list[ready++] = event;
+		else
+			state->watch_events[count++] = event;
+	}
+
+	state->watch_count = count;
+
+	if (ready && state->verbose && state->tty)
+	{
+		fputs("\n\n\e[2A\e[s", stdout);
+		fflush(stdout);
+	}
+
+	for (size_t i = 0; i < ready; ++i)
+	{
+		if (!watch_file(state, list[i]->dir, list[i]->name))
+			watch_queue(state, list[i]->dir, list[i]->name);
+
+		talloc_free(list[i]);
+	}
+
+	// Directories may be renamed or removed before the next batch.
+	dir_release();
+
+	if (ready && state->verbose && state->tty)
+	{
+		fputs("\e[u\e[J", stdout);
+		fflush(stdout);
+	}
+
+	talloc_free(list);
+}
+
+// Brings a file that was written or moved into the tree into the lookups, and
+// returns false if it was modified too recently to be considered finished.
+static bool watch_file(struct dedupe_state* state, struct dir_entry* dir, const char* name)
+{
+	char fpath[PATH_MAX];
+	struct stat buffer;
+
+	if (!path_format(fpath, PATH_MAX, dir, name))
+	{
+		perror(fpath);
+		return true;
+	}
+
+	throttle(state, 0, 1);
+	if (lstat(fpath, &buffer) == -1)
+	{
+		if (errno != ENOENT)
+			perror(fpath);
+		return true;
+	}
+
+	struct device_entry* device = device_find(state, buffer.st_dev);
+	if (!S_ISREG(buffer.st_mode) || !device)
+		return true;
+
+	if (time(NULL) - buffer.st_mtime < WATCH_DELAY)
+		return false;
+
+	struct hash_bucket* bucket = hash_map_insert(device->inode_lookup, (void*)buffer.st_ino);
+	struct inode_entry* inode = bucket->value;
+	bool changed = true;
+
+	if (!inode)
+	{
+		inode = arena_alloc(state->arena, sizeof(struct inode_entry));
+		inode_from_stat(inode, &buffer);
+		bucket->value = inode;
+	}
+	else if (inode->size != buffer.st_size ||
+		inode->mtime.tv_sec != buffer.st_mtim.tv_sec || inode->mtime.tv_nsec != buffer.st_mtim.tv_nsec)
+	{
+		watch_forget(state, inode);
+
+		struct path_entry* paths = inode->paths;
+		inode_from_stat(inode, &buffer);
+		inode->paths = paths;
+	}
+	else
+	{
+		changed = false;
+	}
+
+	struct path_entry* path;
+	for (path = inode->paths; path; path = path->next)
+	{
+		if (path->dir == dir && !strcmp(path->name, name))
+			break;
+	}
+
+	if (!path)
+	{
+		size_t length = strlen(name) + 1;
+		path = arena_alloc(state->arena, sizeof(struct path_entry) + length);
+		path->next = inode->paths;
+		path->dir = dir;
+		memcpy(path->name, name, length);
+		inode->paths = path;
+	}
+
+	if (changed && is_wanted(state, inode))
+		watch_match(state, inode);
+
+	return true;
+}
+
+// Adds an inode to its size bucket and, if that leaves it with company, hashes
+// whichever members weren't hashed before and links the inode's duplicates.
+static void watch_match(struct dedupe_state* state, struct inode_entry* inode)
+{
+	struct device_entry* device = device_find(state, inode->dev);
+	struct hash_bucket* bucket = hash_map_insert(device->size_lookup, (void*)inode->size);
+	inode->next_by_size = bucket->value;
+	bucket->value = inode;
+	if (++bucket->dummy < 2)
+		return;
+
+	for (struct inode_entry* other = inode; other; other = other->next_by_size)
+	{
+		if (other->hashed && other->hash)
+			continue;
+
+		other->hash = talloc_zero_array(state, unsigned char, DIGEST_MAX_LENGTH);
+		other->hashed = hash_inode(state, other);
+		if (!other->hashed)
+			continue;
+
+		struct hash_bucket* hash_bucket = hash_map_insert(device->hash_lookup, other->hash);
+		++hash_bucket->dummy;
+		other->next_by_hash = hash_bucket->value;
+		hash_bucket->value = other;
+	}
+
+	if (!inode->hashed)
+		return;
+
+	bucket = hash_map_insert(device->hash_lookup, inode->hash);
+	if (bucket->dummy >= 2)
+		watch_link(state, bucket);
+}
+
+static void watch_link(struct dedupe_state* state, struct hash_bucket* bucket)
+{
+	watch_settle(state, bucket);
+	if (bucket->dummy < 2)
+		return;
+
+	if (state->verbose && state->tty)
+	{
+		fputs("\e[u\e[J", stdout);
+		fflush(stdout);
+	}
+
+	relink(state, bucket);
+	watch_settle(state, bucket);
+
+	if (state->verbose && state->tty)
+	{
+		fputs("\n\n\e[2A\e[s", stdout);
+		fflush(stdout);
+	}
+}
+
+// Checks every path of a group against the file system. A path now linked to
+// another member, which is how relink leaves them, moves over to it, one that
+// changed or disappeared is dropped, and so are members left without paths.
+static void watch_settle(struct dedupe_state* state, struct hash_bucket* bucket)
+{
+	for (struct inode_entry* inode = bucket->value; inode; inode = inode->next_by_hash)
+	{
+		struct path_entry** p = &inode->paths;
+		while (*p)
+		{
+			struct path_entry* path = *p;
+			struct inode_entry* owner = NULL;
+
+			char fpath[PATH_MAX];
+			struct stat buffer;
+			if (path_format(fpath, PATH_MAX, path->dir, path->name) && lstat(fpath, &buffer) != -1 && S_ISREG(buffer.st_mode))
+			{
+				for (struct inode_entry* other = bucket->value; other; other = other->next_by_hash)
+				{
+					if (other->ino == buffer.st_ino && other->size == buffer.st_size &&
+						other->mtime.tv_sec == buffer.st_mtim.tv_sec && other->mtime.tv_nsec == buffer.st_mtim.tv_nsec)
+						owner = other;
+				}
+			}
+
+			if (owner == inode)
+			{
+				p = &path->next;
+				continue;
+			}
+
+			*p = path->next;
+			if (owner)
+			{
+				path->next = owner->paths;
+				owner->paths = path;
+			}
+		}
+	}
+
+	for (struct inode_entry** p = (struct inode_entry**)&bucket->value; *p; )
+	{
+		struct inode_entry* inode = *p;
+		if (inode->paths)
+		{
+			p = &inode->next_by_hash;
+			continue;
+		}
+
+		*p = inode->next_by_hash;
+		--bucket->dummy;
+		inode->next_by_hash = NULL;
+		inode->hashed = false;
+		inode->hash = NULL;
+		watch_forget(state, inode);
+
+		struct hash_bucket* inode_bucket = hash_map_insert(device_find(state, inode->dev)->inode_lookup, (void*)inode->ino);
+		if (inode_bucket->value == inode)
+			inode_bucket->value = NULL;
+	}
+}
+
+// Takes an inode out of its size and hash buckets before its contents are
+// looked at again. Its digest buffer may still be a hash_lookup key, so it is
+// left alone and a new one gets allocated.
+static void watch_forget(struct dedupe_state* state, struct inode_entry* inode)
+{
+	struct device_entry* device = device_find(state, inode->dev);
+	struct hash_bucket* bucket = hash_map_insert(device->size_lookup, (void*)inode->size);
+	for (struct inode_entry** p = (struct inode_entry**)&bucket->value; *p; p = &(*p)->next_by_size)
+	{
+		if (*p == inode)
+		{
+			*p = inode->next_by_size;
+			--bucket->dummy;
+			break;
+		}
+	}
+
+	if (inode->hashed && inode->hash)
+	{
+		bucket = hash_map_insert(device->hash_lookup, inode->hash);
+		for (struct inode_entry** p = (struct inode_entry**)&bucket->value; *p; p = &(*p)->next_by_hash)
+		{
+			if (*p == inode)
+			{
+				*p = inode->next_by_hash;
+				--bucket->dummy;
+				break;
+			}
+		}
+	}
+
+	inode->next_by_size = NULL;
+	inode->next_by_hash = NULL;
+	inode->hashed = false;
+	inode->hash = NULL;
+}
+
+static void watch_signal(int signal)
+{
+	watch_stop = 1;
+}
+
+static void print_progress(struct dedupe_state* state, const char* status, size_t count, size_t max, unsigned long long size, unsigned long long total)
+{
+	if (!state->verbose)
+		return;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (state->last == ts.tv_sec)
+		return;
+
+	if (state->tty)
+	{
+		fputs("\e[u\e[J", stdout);
+
+		if (total)
+		{
+			unsigned long long cmax = (state->width >= 3 ? state->width - 3 : 1);
+			unsigned long long ccount = (size * cmax) / total;
+			unsigned long long cncount = cmax - ccount;
+
+			char* buf0 = alloca(ccount + 1);
+			memset(buf0, 0x7C, ccount);
+			buf0[ccount] = 0;
+
+			char* buf1 = alloca(cncount + 1);
+			memset(buf1, 0x20, cncount);
+			buf1[cncount] = 0;
+
+			printf("\e[0;1m[\e[0;32;42m%s\e[0m%s\e[1m]\e[0m\n", buf0, buf1);
+		}
+
+		if (max)
+			printf("\e[0;1m[%zu/%zu]\e[0m ", count, max);
+		else
+			printf("\e[0;1m[%c]\e[0m ", "-\\|/"[ts.tv_sec & 3]);
+
+		printf("%s\n", status);
+	}
+	else
+	{
+		if (max)
+			printf("[%zu/%zu] ", count, max);
+		if (total)
+			printf("[%llu/%llu] ", size, total);
+
+		printf("%s\n", status);
+	}
+
+	state->last = ts.tv_sec;
+	fflush(stdout);
+}
+
+static void print_summary(struct dedupe_state* state)
+{
+	if (!state->verbose)
+		return;
+
+	if (state->relinked_count)
+	{
+		printf(
+			state->tty ?
+				"\e[1mPerformed \e[32m%zu\e[39m relink%s, saved \e[32m%llu\e[39m bytes.\e[0m\n" :
+				"Performed %zu relink%s, saved %llu bytes.\n",
+			state->relinked_count,
+			state->relinked_count > 1 ? "s" : "",
+			state->relinked_size);
+	}
+
+	if (state->shared_count)
+	{
+		printf(
+			state->tty ?
+				"\e[1mShared \e[32m%zu\e[39m block%s, saved \e[32m%llu\e[39m bytes.\e[0m\n" :
+				"Shared %zu block%s, saved %llu bytes.\n",
+			state->shared_count,
+			state->shared_count > 1 ? "s" : "",
+			state->shared_size);
+	}
+}
+
+static bool stats_open(struct dedupe_state* state)
+{
+	state->stats = strcmp(state->stats_path, "-") ? fopen(state->stats_path, "w") : stdout;
+	if (!state->stats)
+	{
+		perror(state->stats_path);
+		return false;
+	}
+
+	state->stats_start = state->stats_time = stats_clock();
+	return true;
+}
+
+// Reports how long the phase that just ended took, how many items it dealt
+// with and the reads and stats it issued.
+static void stats_phase(struct dedupe_state* state, const char* name, size_t items)
+{
+	if (state->trace)
+		trace_dump(name, true);
+
+	if (!state->stats)
+		return;
+
+	double now = stats_clock();
+	double seconds = now - state->stats_time;
+	unsigned long long read_size = state->read_size - state->stats_read_size;
+
+	fprintf(state->stats,
+		"{\"type\":\"phase\",\"name\":\"%s\",\"seconds\":%.6f,\"items\":%zu,"
+		"\"read_bytes\":%llu,\"read_bytes_per_second\":%.0f,\"reads\":%llu,\"stats\":%llu,"
+		"\"opens\":%llu,\"links\":%llu}\n",
+		name, seconds, items,
+		read_size, seconds > 0 ? read_size / seconds : 0,
+		state->read_count - state->stats_read_count,
+		state->stat_count - state->stats_stat_count,
+		state->open_count - state->stats_open_count,
+		state->link_count - state->stats_link_count);
+	fflush(state->stats);
+
+	state->stats_time = now;
+	state->stats_read_size = state->read_size;
+	state->stats_read_count = state->read_count;
+	state->stats_stat_count = state->stat_count;
+	state->stats_open_count = state->open_count;
+	state->stats_link_count = state->link_count;
 }
 
-static void gather_tohash(struct dedupe_state* state0)
+static void stats_duplicate(struct dedupe_state* state, const unsigned char* key, struct inode_entry** ordered, size_t count)
 {
-	struct gather_state state1 = { state0, 16 };
+	fputs("{\"type\":\"duplicate\",\"hash\":", state->stats);
+	if (key)
+	{
+		fputc('"', state->stats);
+		for (size_t i = 0; i < state->digest->length; ++i)
+			fprintf(state->stats, "%02x", (int)key[i]);
+		fputc('"', state->stats);
+	}
+	else
+	{
+		fputs("null", state->stats);
+	}
 
-	state0->tohash_count = 0;
-	state0->tohash_size = 0;
-	state0->tohash_list = talloc_array(state0, struct inode_entry*, state1.capacity);
+	fprintf(state->stats, ",\"size\":%llu,\"inodes\":[", (unsigned long long)ordered[0]->size);
+	for (size_t i = 0; i < count; ++i)
+	{
+		fprintf(state->stats, "%s{\"dev\":%llu,\"ino\":%llu,\"mtime\":%lld,\"paths\":[",
+			i ? "," : "",
+			(unsigned long long)ordered[i]->dev,
+			(unsigned long long)ordered[i]->ino,
+			(long long)ordered[i]->mtime.tv_sec);
 
-	hash_map_walk(state0->size_lookup, &state1, gather_tohash_walkcb);
-	qsort(state0->tohash_list, state0->tohash_count, sizeof(struct inode_entry*), gather_tohash_sortcb);
+		for (struct path_entry* path = ordered[i]->paths; path; path = path->next)
+		{
+			char* fpath = path_build(NULL, path->dir, path->name);
+			if (path != ordered[i]->paths)
+				fputc(',', state->stats);
+			stats_string(state->stats, fpath);
+			talloc_free(fpath);
+		}
+
+		fputs("]}", state->stats);
+	}
+
+	fputs("]}\n", state->stats);
+	fflush(state->stats);
 }
 
-static void gather_tohash_walkcb(void* state0, struct hash_bucket* size_bucket)
+static void stats_summary(struct dedupe_state* state)
 {
-	if (size_bucket->dummy < 2)
+	if (!state->stats)
 		return;
 
-	struct gather_state* state1 = state0;
-	struct dedupe_state* state2 = state1->state0;
+	size_t size_buckets = 0, hash_buckets = 0;
+	for (size_t i = 0; i < state->device_count; ++i)
+	{
+		if (state->devices[i]->size_lookup)
+			size_buckets += state->devices[i]->size_lookup->item_count;
+		if (state->devices[i]->hash_lookup)
+			hash_buckets += state->devices[i]->hash_lookup->item_count;
+	}
 
-	for (struct inode_entry* inode = size_bucket->value; inode; inode = inode->next_by_size)
+	// Both Linux and FreeBSD count the peak resident set in kilobytes.
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == -1)
+		usage.ru_maxrss = 0;
+
+	fprintf(state->stats,
+		"{\"type\":\"summary\",\"seconds\":%.6f,\"devices\":%zu,\"files\":%zu,\"inodes\":%zu,"
+		"\"size_buckets\":%zu,\"hash_buckets\":%zu,\"hashed\":%zu,\"hashed_bytes\":%llu,"
+		"\"cached_bytes\":%llu,\"read_bytes\":%llu,\"reads\":%llu,\"stats\":%llu,\"opens\":%llu,\"links\":%llu,"
+		"\"relinks\":%zu,\"relinked_bytes\":%llu,\"shared_blocks\":%zu,\"shared_bytes\":%llu,"
+		"\"max_rss_bytes\":%llu}\n",
+		stats_clock() - state->stats_start, state->device_count, state->file_count, state->inode_count,
+		size_buckets, hash_buckets, state->digested_count, state->digested_size,
+		state->cached_size, state->read_size, state->read_count, state->stat_count, state->open_count, state->link_count,
+		state->relinked_count, state->relinked_size, state->shared_count, state->shared_size,
+		(unsigned long long)usage.ru_maxrss * 1024);
+
+	if (state->stats != stdout)
+		fclose(state->stats);
+	else
+		fflush(stdout);
+	state->stats = NULL;
+}
+
+// Counts a file whose contents were read and digested, as opposed to those
+// taken from a cache or that couldn't be read.
+static void stats_digested(struct dedupe_state* state, unsigned long long size)
+{
+	__atomic_add_fetch(&state->digested_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&state->digested_size, size, __ATOMIC_RELAXED);
+}
+
+// Paths are written as they are where they are valid UTF-8. Other bytes are
+// escaped as the lone surrogates U+DC80 to U+DCFF, like Python's
+// surrogateescape, so that the original bytes can still be told apart and
+// recovered.
+static void stats_string(FILE* f, const char* s)
+{
+	fputc('"', f);
+	for (const unsigned char* p = (const unsigned char*)s; *p; ++p)
 	{
-		if (state1->capacity == state2->tohash_count)
+		unsigned char c = *p;
+		size_t length;
+		if (c == '"' || c == '\\')
 		{
-			state1->capacity *= 2;
-			state2->tohash_list = talloc_realloc(state2, state2->tohash_list, struct inode_entry*, state1->capacity);
+			fprintf(f, "\\%c", c);
+		}
+		else if (c < 0x20)
+		{
+			fprintf(f, "\\u%04x", c);
+		}
+		else if (c < 0x80)
+		{
+			fputc(c, f);
+		}
+		else if ((length = stats_utf8(p)))
+		{
+			fwrite(p, 1, length, f);
+			p += length - 1;
+		}
+		else
+		{
+			fprintf(f, "\\udc%02x", c);
 		}
-
-		state2->tohash_list[state2->tohash_count++] = inode;
-		state2->tohash_size += inode->buffer.st_size;
 	}
+	fputc('"', f);
 }
 
-static int gather_tohash_sortcb(const void* p1, const void* p2)
+// Returns the length of the UTF-8 sequence starting with a byte of 0x80 or
+// up, or 0 where it is cut short, overlong, a surrogate or beyond U+10FFFF.
+static size_t stats_utf8(const unsigned char* p)
 {
-	struct inode_entry
-		*inode0 = *((struct inode_entry* const*)p1),
-		*inode1 = *((struct inode_entry* const*)p2);
+	size_t length;
+	unsigned int c, min;
+	if ((*p & 0xE0) == 0xC0)
+		length = 2, c = *p & 0x1F, min = 0x80;
+	else if ((*p & 0xF0) == 0xE0)
+		length = 3, c = *p & 0x0F, min = 0x800;
+	else if ((*p & 0xF8) == 0xF0)
+		length = 4, c = *p & 0x07, min = 0x10000;
+	else
+		return 0;
 
-	off_t sz0 = inode0->buffer.st_size,
-		sz1 = inode1->buffer.st_size;
+	for (size_t i = 1; i < length; ++i)
+	{
+		if ((p[i] & 0xC0) != 0x80)
+			return 0;
+		c = c << 6 | (p[i] & 0x3F);
+	}
 
-	if (sz0 < sz1)
-		return -1;
-	else if (sz0 > sz1)
-		return 1;
-	else
+	if (c < min || c > 0x10FFFF || (c >= 0xD800 && c < 0xE000))
 		return 0;
+
+	return length;
 }
 
-static void hash_inode(struct dedupe_state* state, size_t progress, unsigned long long total, struct inode_entry* inode)
+static double stats_clock(void)
 {
-	int fd = -1;
-	char* fpath = NULL;
-	for (struct path_entry* path = inode->paths; path; path = path->next)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Measures how fast the cycle counter runs, and leaves SIGUSR1 to a thread
+// of its own that dumps the counters on demand. It must run before any other
+// thread is started, so that all of them inherit the blocked signal.
+static void trace_init(void)
+{
+	struct timespec delay = { 0, 10000000 };
+	double start = stats_clock();
+	unsigned long long ticks = trace_clock();
+	nanosleep(&delay, NULL);
+	ticks = trace_clock() - ticks;
+	if (ticks)
+		trace_scale = (stats_clock() - start) * 1e9 / ticks;
+
+	trace_time = stats_clock();
+	trace_enabled = true;
+
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	pthread_t thread;
+	int error = pthread_create(&thread, NULL, trace_worker, NULL);
+	if (error)
 	{
-		fpath = path->path;
-		fd = open(fpath, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
-		if (fd == -1)
-			perror(path->path);
-		else
-			break;
+		errno = error;
+		perror("pthread_create");
+		return;
 	}
+	pthread_detach(thread);
+}
 
-	if (fd == -1)
-		return;
+static void* trace_worker(void* context)
+{
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
 
-	print_progress(state, fpath, progress, state->tohash_count, total, state->tohash_size);
+	int signal;
+	while (!sigwait(&signals, &signal))
+		trace_dump(NULL, false);
 
-	bool cached = false;
-	if (state->xattrs)
-	{
-		ssize_t result0, result1;
-		struct timespec mtime;
+	return NULL;
+}
 
-#if defined(__linux__)
-		result0 = fgetxattr(fd, "user.dedupe.hash", inode->hash, SHA256_DIGEST_LENGTH);
-		result1 = fgetxattr(fd, "user.dedupe.hash_mtime", &mtime, sizeof(struct timespec));
-#elif defined(__FreeBSD__)
-		result0 = extattr_get_fd(fd, EXTATTR_NAMESPACE_USER, "dedupe.hash", inode->hash, SHA256_DIGEST_LENGTH);
-		result1 = extattr_get_fd(fd, EXTATTR_NAMESPACE_USER, "dedupe.hash_mtime", &mtime, sizeof(struct timespec));
+static unsigned long long trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
 #else
-		result1 = result0 = 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline unsigned long long trace_begin(enum trace_point point)
+{
+#ifdef HAVE_SDT
+	DTRACE_PROBE2(dedupe, trace__start, point, trace_names[point]);
+#endif
+	return trace_enabled ? trace_clock() : 0;
+}
+
+static inline void trace_end(enum trace_point point, unsigned long long start)
+{
+	unsigned long long nanoseconds = 0;
+	if (start)
+	{
+		nanoseconds = (trace_clock() - start) * trace_scale;
+
+		size_t bucket = nanoseconds ? 63 - __builtin_clzll(nanoseconds) : 0;
+		if (bucket >= TRACE_BUCKETS)
+			bucket = TRACE_BUCKETS - 1;
+
+		struct trace_counter* counter = &trace_counters[point];
+		__atomic_add_fetch(&counter->count, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&counter->total, nanoseconds, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&counter->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+		unsigned long long max = __atomic_load_n(&counter->max, __ATOMIC_RELAXED);
+		while (nanoseconds > max && !__atomic_compare_exchange_n(&counter->max, &max, nanoseconds, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+
+#ifdef HAVE_SDT
+	DTRACE_PROBE3(dedupe, trace__done, point, trace_names[point], nanoseconds);
 #endif
+}
+
+// Prints the counters gathered since the end of the last phase to stderr, and
+// starts over for the next phase when one just ended.
+static void trace_dump(const char* phase, bool reset)
+{
+	double now = stats_clock();
+	char buffer[4096];
+	size_t length = snprintf(buffer, sizeof(buffer),
+		phase ? "Trace of phase %s, %.3f s:\n" : "Trace of the running phase%s, %.3f s so far:\n",
+		phase ? phase : "", now - trace_time);
+
+	for (size_t i = 0; i < TRACE_POINTS; ++i)
+	{
+		struct trace_counter counter;
+		struct trace_counter* source = &trace_counters[i];
+		counter.count = reset ? __atomic_exchange_n(&source->count, 0, __ATOMIC_RELAXED) : __atomic_load_n(&source->count, __ATOMIC_RELAXED);
+		counter.total = reset ? __atomic_exchange_n(&source->total, 0, __ATOMIC_RELAXED) : __atomic_load_n(&source->total, __ATOMIC_RELAXED);
+		counter.max = reset ? __atomic_exchange_n(&source->max, 0, __ATOMIC_RELAXED) : __atomic_load_n(&source->max, __ATOMIC_RELAXED);
+		for (size_t j = 0; j < TRACE_BUCKETS; ++j)
+			counter.buckets[j] = reset ? __atomic_exchange_n(&source->buckets[j], 0, __ATOMIC_RELAXED) : __atomic_load_n(&source->buckets[j], __ATOMIC_RELAXED);
+
+		if (!counter.count || length >= sizeof(buffer))
+			continue;
+
+		char total[16], mean[16], max[16];
+		trace_format(total, sizeof(total), counter.total);
+		trace_format(mean, sizeof(mean), (double)counter.total / counter.count);
+		trace_format(max, sizeof(max), counter.max);
+		length += snprintf(buffer + length, sizeof(buffer) - length,
+			"  %-8s %llu calls, %s in all, %s mean, %s max\n   ",
+			trace_names[i], counter.count, total, mean, max);
+
+		for (size_t j = 0; j < TRACE_BUCKETS && length < sizeof(buffer); ++j)
+		{
+			if (!counter.buckets[j])
+				continue;
+
+			char bound[16];
+			trace_format(bound, sizeof(bound), (double)(2ULL << j));
+			length += snprintf(buffer + length, sizeof(buffer) - length, " <%s:%llu", bound, counter.buckets[j]);
+		}
+
+		if (length < sizeof(buffer))
+			buffer[length++] = '\n';
+	}
+
+	if (reset)
+		trace_time = now;
+
+	if (length > sizeof(buffer))
+		length = sizeof(buffer);
+	fwrite(buffer, 1, length, stderr);
+}
+
+static void trace_format(char* buffer, size_t size, double nanoseconds)
+{
+	if (nanoseconds < 1e3)
+		snprintf(buffer, size, "%.0fns", nanoseconds);
+	else if (nanoseconds < 1e6)
+		snprintf(buffer, size, "%.3gus", nanoseconds / 1e3);
+	else if (nanoseconds < 1e9)
+		snprintf(buffer, size, "%.3gms", nanoseconds / 1e6);
+	else
+		snprintf(buffer, size, "%.3gs", nanoseconds / 1e9);
+}
+
+static struct hash_map* hash_map_create(void* ctx, const struct hash_descriptor* descriptor, size_t expected)
+{
+	struct hash_map* result = talloc(ctx, struct hash_map);
+	result->descriptor = descriptor;
+	result->item_count = 0;
+	result->bucket_count = next_power_of_two(expected + expected / 3 + 1);
+	result->buckets = talloc_zero_array(result, struct hash_bucket, result->bucket_count);
+	return result;
+}
+
+// Robin Hood linear probing: an entry displaces any resident that sits closer
+// to its home slot, which keeps probe sequences short at high load factors.
+static struct hash_bucket* hash_map_insert(struct hash_map* map, void* key)
+{
+	hash_map_rehash(map);
+
+	size_t hash = map->descriptor->hash_function(key);
+	if (!hash)
+		hash = 1;
+
+	size_t mask = map->bucket_count - 1;
+	size_t index = hash & mask;
+	size_t distance = 0;
+
+	struct hash_bucket* current;
+	for (;; index = (index + 1) & mask, ++distance)
+	{
+		current = &map->buckets[index];
+		if (!current->hash)
+			break;
+
+		if (current->hash == hash && map->descriptor->equal_function(current->key, key))
+			return current;
+
+		if (((index - current->hash) & mask) < distance)
+			break;
+	}
+
+	struct hash_bucket carry = *current;
+	*current = (struct hash_bucket){ hash, key, 0, NULL };
+	++map->item_count;
+
+	struct hash_bucket* result = current;
+	while (carry.hash)
+	{
+		distance = (index - carry.hash) & mask;
+		do
+		{
+			index = (index + 1) & mask;
+			++distance;
+			current = &map->buckets[index];
+		}
+		while (current->hash && ((index - current->hash) & mask) >= distance);
 
-		cached = result0 == SHA256_DIGEST_LENGTH && (result1 == -1 ||
-			(result1 == sizeof(struct timespec) &&
-			inode->buffer.st_mtim.tv_sec == mtime.tv_sec &&
-			inode->buffer.st_mtim.tv_nsec == mtime.tv_nsec));
+		struct hash_bucket next = *current;
+		*current = carry;
+		carry = next;
 	}
 
-	if (!cached)
+	return result;
+}
+
+static void hash_map_rehash(struct hash_map* map)
+{
+	if ((map->item_count + 1) * 4 <= map->bucket_count * 3)
+		return;
+
+	unsigned long long start = trace_begin(TRACE_REHASH);
+	size_t bucket_count_old = map->bucket_count;
+	struct hash_bucket* buckets_old = map->buckets;
+
+	map->bucket_count *= 2;
+	map->buckets = talloc_zero_array(map, struct hash_bucket, map->bucket_count);
+
+	size_t mask = map->bucket_count - 1;
+	for (size_t bucket_old = 0; bucket_old < bucket_count_old; ++bucket_old)
 	{
-		unsigned char* data = NULL;
-		if (inode->buffer.st_size)
+		struct hash_bucket carry = buckets_old[bucket_old];
+		if (!carry.hash)
+			continue;
+
+		size_t index = carry.hash & mask;
+		for (size_t distance = 0; carry.hash; index = (index + 1) & mask, ++distance)
 		{
-			data = mmap(NULL, inode->buffer.st_size, PROT_READ, MAP_SHARED, fd, 0);
-			if (data == MAP_FAILED)
+			struct hash_bucket* current = &map->buckets[index];
+			if (!current->hash)
 			{
-				perror(fpath);
-				close(fd);
-				return;
+				*current = carry;
+				break;
+			}
+
+			size_t current_distance = (index - current->hash) & mask;
+			if (current_distance < distance)
+			{
+				struct hash_bucket next = *current;
+				*current = carry;
+				carry = next;
+				distance = current_distance;
 			}
 		}
+	}
+
+	talloc_free(buckets_old);
+	trace_end(TRACE_REHASH, start);
+}
+
+// Looks a key up without inserting it, so that a map that is no longer
+// modified can be read by several threads.
+static struct hash_bucket* hash_map_find(const struct hash_map* map, void* key)
+{
+	size_t hash = map->descriptor->hash_function(key);
+	if (!hash)
+		hash = 1;
+
+	size_t mask = map->bucket_count - 1;
+	for (size_t index = hash & mask, distance = 0;; index = (index + 1) & mask, ++distance)
+	{
+		struct hash_bucket* current = &map->buckets[index];
+		if (!current->hash || ((index - current->hash) & mask) < distance)
+			return NULL;
+
+		if (current->hash == hash && map->descriptor->equal_function(current->key, key))
+			return current;
+	}
+}
+
+static void hash_map_walk(struct hash_map* map, void* context, void(*cb)(void*, struct hash_bucket*))
+{
+	for (size_t bucket = 0; bucket < map->bucket_count; ++bucket)
+	{
+		if (map->buckets[bucket].hash)
+			cb(context, &map->buckets[bucket]);
+	}
+}
+
+static void digest_final(struct dedupe_state* state, union digest_context* ctx, unsigned char* hash)
+{
+	memset(hash, 0, DIGEST_MAX_LENGTH);
+	state->digest->final_function(ctx, hash);
+}
+
+static void digest_sha256_init(union digest_context* ctx)
+{
+	SHA256_Init(&ctx->sha256);
+}
+
+static void digest_sha256_update(union digest_context* ctx, const void* data, size_t size)
+{
+	SHA256_Update(&ctx->sha256, data, size);
+}
+
+static void digest_sha256_final(union digest_context* ctx, unsigned char* hash)
+{
+	SHA256_Final(hash, &ctx->sha256);
+}
 
-		SHA256_CTX ctx;
-		SHA256_Init(&ctx);
+#ifdef HAVE_SHA256_BATCH
+typedef unsigned int sha256_vector __attribute__((vector_size(DIGEST_BATCH * sizeof(unsigned int))));
 
-		if (data)
+#define SHA256_ROTATE(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// Hashes up to DIGEST_BATCH messages side by side, one in each 32-bit lane of
+// a 512-bit vector. Messages that are shorter than others stop updating their
+// lane once their last block has gone through.
+__attribute__((target("avx512f")))
+static void digest_sha256_batch(const unsigned char* const* data, const size_t* sizes, size_t count, unsigned char** hashes)
+{
+	static const unsigned int k[64] =
+	{
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+	};
+
+	static const unsigned int iv[8] =
+	{
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	sha256_vector h[8];
+	for (size_t i = 0; i < 8; ++i)
+		h[i] = (sha256_vector){} + iv[i];
+
+	size_t blocks[DIGEST_BATCH], most = 0;
+	for (size_t lane = 0; lane < count; ++lane)
+	{
+		blocks[lane] = (sizes[lane] + 8) / 64 + 1;
+		if (blocks[lane] > most)
+			most = blocks[lane];
+	}
+
+	for (size_t block = 0; block < most; ++block)
+	{
+		unsigned int words[16][DIGEST_BATCH], mask[DIGEST_BATCH];
+		memset(words, 0, sizeof(words));
+		memset(mask, 0, sizeof(mask));
+
+		for (size_t lane = 0; lane < count; ++lane)
 		{
-			const size_t chunk_size = 0x2000000;
-			for (size_t offset = 0; offset < inode->buffer.st_size; offset += chunk_size)
+			if (block >= blocks[lane])
+				continue;
+			mask[lane] = ~0u;
+
+			// The last one or two blocks carry the padding and the bit length.
+			unsigned char buffer[64];
+			const unsigned char* p = data[lane] + block * 64;
+			size_t offset = block * 64, size = sizes[lane];
+			if (offset + 64 > size)
 			{
-				if (offset)
-					print_progress(state, fpath, progress, state->tohash_count, total + offset, state->tohash_size);
+				size_t length = offset < size ? size - offset : 0;
+				memset(buffer, 0, 64);
+				memcpy(buffer, p, length);
+				if (offset <= size)
+					buffer[length] = 0x80;
+				if (block == blocks[lane] - 1)
+				{
+					unsigned long long bits = (unsigned long long)size * 8;
+					for (size_t i = 0; i < 8; ++i)
+						buffer[63 - i] = bits >> (i * 8);
+				}
+				p = buffer;
+			}
+
+			for (size_t i = 0; i < 16; ++i)
+				words[i][lane] = (unsigned int)p[i * 4] << 24 | p[i * 4 + 1] << 16 | p[i * 4 + 2] << 8 | p[i * 4 + 3];
+		}
 
-				size_t remaining = inode->buffer.st_size - offset;
-				if (remaining > chunk_size)
-					remaining = chunk_size;
+		sha256_vector w[16], active, v[8];
+		memcpy(w, words, sizeof(w));
+		memcpy(&active, mask, sizeof(active));
+		memcpy(v, h, sizeof(v));
 
-				SHA256_Update(&ctx, data + offset, remaining);
+		for (size_t i = 0; i < 64; ++i)
+		{
+			if (i >= 16)
+			{
+				sha256_vector w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+				w[i & 15] += (SHA256_ROTATE(w15, 7) ^ SHA256_ROTATE(w15, 18) ^ (w15 >> 3)) +
+					w[(i - 7) & 15] +
+					(SHA256_ROTATE(w2, 17) ^ SHA256_ROTATE(w2, 19) ^ (w2 >> 10));
 			}
-		}
 
-		SHA256_Final(inode->hash, &ctx);
+			sha256_vector t1 = v[7] +
+				(SHA256_ROTATE(v[4], 6) ^ SHA256_ROTATE(v[4], 11) ^ SHA256_ROTATE(v[4], 25)) +
+				((v[4] & v[5]) ^ (~v[4] & v[6])) +
+				k[i] + w[i & 15];
+			sha256_vector t2 =
+				(SHA256_ROTATE(v[0], 2) ^ SHA256_ROTATE(v[0], 13) ^ SHA256_ROTATE(v[0], 22)) +
+				((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+
+			v[7] = v[6];
+			v[6] = v[5];
+			v[5] = v[4];
+			v[4] = v[3] + t1;
+			v[3] = v[2];
+			v[2] = v[1];
+			v[1] = v[0];
+			v[0] = t1 + t2;
+		}
 
-		if (data)
-			munmap(data, inode->buffer.st_size);
+		// Lanes whose message already ended keep their state.
+		for (size_t i = 0; i < 8; ++i)
+			h[i] += v[i] & active;
+	}
 
-		if (state->xattrs)
+	for (size_t lane = 0; lane < count; ++lane)
+	{
+		for (size_t i = 0; i < 8; ++i)
 		{
-#if defined(__linux__)
-			fsetxattr(fd, "user.dedupe.hash", inode->hash, SHA256_DIGEST_LENGTH, 0);
-			fsetxattr(fd, "user.dedupe.hash_mtime", &inode->buffer.st_mtim, sizeof(struct timespec), 0);
-#elif defined(__FreeBSD__)
-			extattr_set_fd(fd, EXTATTR_NAMESPACE_USER, "dedupe.hash", inode->hash, SHA256_DIGEST_LENGTH);
-			extattr_set_fd(fd, EXTATTR_NAMESPACE_USER, "dedupe.hash_mtime", &inode->buffer.st_mtim, sizeof(struct timespec));
-#endif
+			unsigned int x = h[i][lane];
+			hashes[lane][i * 4] = x >> 24;
+			hashes[lane][i * 4 + 1] = x >> 16;
+			hashes[lane][i * 4 + 2] = x >> 8;
+			hashes[lane][i * 4 + 3] = x;
 		}
 	}
+}
+#endif
 
-	close(fd);
+#ifdef HAVE_BLAKE3
+static void digest_blake3_init(union digest_context* ctx)
+{
+	blake3_hasher_init(&ctx->blake3);
+}
+
+static void digest_blake3_update(union digest_context* ctx, const void* data, size_t size)
+{
+	blake3_hasher_update(&ctx->blake3, data, size);
+}
+
+static void digest_blake3_final(union digest_context* ctx, unsigned char* hash)
+{
+	blake3_hasher_finalize(&ctx->blake3, hash, BLAKE3_OUT_LEN);
+}
+#endif
+
+#ifdef HAVE_XXHASH
+static void digest_xxh3_init(union digest_context* ctx)
+{
+#ifdef XXH3_INITSTATE
+	XXH3_INITSTATE(&ctx->xxh3);
+#endif
+	XXH3_128bits_reset(&ctx->xxh3);
+}
+
+static void digest_xxh3_update(union digest_context* ctx, const void* data, size_t size)
+{
+	XXH3_128bits_update(&ctx->xxh3, data, size);
+}
+
+static void digest_xxh3_final(union digest_context* ctx, unsigned char* hash)
+{
+	XXH128_canonicalFromHash((XXH128_canonical_t*)hash, XXH3_128bits_digest(&ctx->xxh3));
+}
+#endif
+
+// splitmix64 finalizer, so that sequential inode numbers and sizes spread
+// over the whole table
+static size_t hash_ptr_hash(void* p)
+{
+	unsigned long long x = (unsigned long long)(size_t)p;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return (size_t)(x ^ (x >> 31));
+}
+
+static bool hash_ptr_equals(void* p1, void* p2)
+{
+	return p1 == p2;
+}
+
+static size_t hash_digest_hash(void* p)
+{
+	size_t result = 0;
+	for (size_t *current = p, *end = ((size_t*)p) + (DIGEST_MAX_LENGTH / sizeof(size_t)); current < end; ++current)
+		result ^= *current;
+	return result;
+}
 
-	struct hash_bucket* bucket = hash_map_insert(state->hash_lookup, inode->hash);
-	++bucket->dummy;
-	inode->next_by_hash = bucket->value;
-	bucket->value = inode;
+static bool hash_digest_equals(void* p1, void* p2)
+{
+	return !memcmp(p1, p2, DIGEST_MAX_LENGTH);
 }
 
-static void gather_tolink(struct dedupe_state* state0)
+static size_t hash_block_hash(void* p)
 {
-	struct gather_state state1 = { state0, 16 };
+	size_t result;
+	memcpy(&result, p, sizeof(size_t));
+	return result;
+}
 
-	state0->tolink_count = 0;
-	state0->tolink_list = talloc_array(state0, struct hash_bucket*, state1.capacity);
+static bool hash_block_equals(void* p1, void* p2)
+{
+	return !memcmp(p1, p2, BLOCK_DIGEST_LENGTH);
+}
 
-	hash_map_walk(state0->hash_lookup, &state1, gather_tolink_walkcb);
-	qsort(state0->tolink_list, state0->tolink_count, sizeof(struct hash_bucket*), gather_tolink_sortcb);
+static size_t hash_string_hash(void* p)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	for (const unsigned char* c = p; *c; ++c)
+		hash = (hash ^ *c) * 0x100000001b3ULL;
+	return (size_t)hash;
 }
 
-static void gather_tolink_walkcb(void* state0, struct hash_bucket* bucket)
+static bool hash_string_equals(void* p1, void* p2)
 {
-	if (bucket->dummy < 2)
-		return;
+	return !strcmp(p1, p2);
+}
 
-	struct gather_state* state1 = state0;
-	struct dedupe_state* state2 = state1->state0;
+#ifdef HAVE_IO_URING
+static struct uring* uring_local(struct dedupe_state* state)
+{
+	if (!state->uring || uring_thread_failed)
+		return NULL;
 
-	if (state1->capacity == state2->tolink_count)
-	{
-		state1->capacity *= 2;
-		state2->tolink_list = talloc_realloc(state2, state2->tolink_list, struct hash_bucket*, state1->capacity);
-	}
+	if (!uring_thread && !(uring_thread = uring_create()))
+		uring_thread_failed = true;
 
-	state2->tolink_list[state2->tolink_count++] = bucket;
+	return uring_thread;
 }
 
-static int gather_tolink_sortcb(const void* p1, const void* p2)
+static void uring_release(void)
 {
-	struct hash_bucket
-		*bucket0 = *((struct hash_bucket* const*)p1),
-		*bucket1 = *((struct hash_bucket* const*)p2);
+	if (uring_thread)
+		uring_destroy(uring_thread);
 
-	return memcmp(bucket0->key, bucket1->key, SHA256_DIGEST_LENGTH);
+	uring_thread = NULL;
+	uring_thread_failed = false;
 }
 
-static void relink(struct dedupe_state* state, struct hash_bucket* bucket)
+static struct uring* uring_create(void)
 {
-	struct inode_entry** ordered = alloca(bucket->dummy * sizeof(struct inode_entry*));
-	size_t i = 0;
-	for (struct inode_entry* inode = bucket->value; inode; inode = inode->next_by_hash)
-		ordered[i++] = inode;
-	qsort(ordered, bucket->dummy, sizeof(struct inode_entry*), relink_sortcb);
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
 
-	if (state->verbose || state->interactive)
+	int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (fd == -1)
 	{
-		char buffer[SHA256_DIGEST_LENGTH * 2 + 1];
-		unsigned char* key = bucket->key;
-
-		for (i = 0; i < SHA256_DIGEST_LENGTH; ++i)
-			snprintf(buffer + (i * 2), 3, "%02x", (int)key[i]);
-
-		printf(state->tty ? "\e[1mDuplicate \e[31m%s\e[39m:\e[0m\n" : "Duplicate %s:\n", buffer);
+		perror("io_uring_setup");
+		return NULL;
+	}
 
-		for (i = 0; i < bucket->dummy; ++i)
-		{
-			struct tm tm;
-			localtime_r(&ordered[i]->buffer.st_mtim.tv_sec, &tm);
+	struct uring* ring = calloc(1, sizeof(struct uring));
+	ring->fd = fd;
 
-			strftime(buffer, sizeof(buffer) / sizeof(char), "%c", &tm);
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
 
-			printf(
-				state->tty ?
-					" \e[1m#%lu\e[0m (%llu bytes) \e[2mmodified %s\e[0m\n" :
-					" #%lu (%llu bytes) modified %s\n",
-				(unsigned long)ordered[i]->buffer.st_ino,
-				(unsigned long long)ordered[i]->buffer.st_size,
-				buffer
-			);
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto fail;
 
-			for (struct path_entry* path = ordered[i]->paths; path; path = path->next)
-				printf("  %s\n", path->path);
-		}
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+		goto fail;
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail;
+
+	ring->sq_head = (unsigned int*)((char*)ring->sq_ring + params.sq_off.head);
+	ring->sq_tail = (unsigned int*)((char*)ring->sq_ring + params.sq_off.tail);
+	ring->sq_array = (unsigned int*)((char*)ring->sq_ring + params.sq_off.array);
+	ring->sq_mask = *(unsigned int*)((char*)ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->tail = *ring->sq_tail;
+
+	ring->cq_head = (unsigned int*)((char*)ring->cq_ring + params.cq_off.head);
+	ring->cq_tail = (unsigned int*)((char*)ring->cq_ring + params.cq_off.tail);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + params.cq_off.cqes);
+	ring->cq_mask = *(unsigned int*)((char*)ring->cq_ring + params.cq_off.ring_mask);
+
+	if (posix_memalign((void**)&ring->buffers, 4096, (size_t)URING_BUFFERS * URING_BUFFER_SIZE))
+	{
+		ring->buffers = NULL;
+		goto fail;
 	}
 
-	if (state->interactive)
+	// Fixed buffers need locked memory, so plain reads are used if the
+	// RLIMIT_MEMLOCK does not allow registering them.
+	struct iovec iov[URING_BUFFERS];
+	for (unsigned int i = 0; i < URING_BUFFERS; ++i)
 	{
-		while (true)
-		{
-			fputs(state->tty ? " \e[1mRelink? [\e[32myes\e[39m/\e[31mno\e[39m]\e[0m " : " Relink? [yes/no] ", stdout);
-			fflush(stdout);
-
-			char buffer[4096];
-			fgets(buffer, 4096, stdin);
-
-			if (!strcmp(buffer, "y\n") || !strcmp(buffer, "yes\n"))
-				break;
-			else if (!strcmp(buffer, "n\n") || !strcmp(buffer, "no\n"))
-				return;
-		}
+		iov[i].iov_base = ring->buffers + (size_t)i * URING_BUFFER_SIZE;
+		iov[i].iov_len = URING_BUFFER_SIZE;
 	}
 
-	if (state->dryrun)
-		return;
+	ring->registered = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) == 0;
+	return ring;
 
-	void* root = talloc_size(state, 0);
+fail:
+	perror("io_uring mmap");
+	uring_destroy(ring);
+	return NULL;
+}
 
-	for (i = 1; i < bucket->dummy; ++i)
-	{
-		for (struct path_entry* dpath = ordered[i]->paths; dpath; dpath = dpath->next)
-		{
-			char* dir = talloc_strdup(root, dpath->path);
-			*strrchr(dir, '/') = 0;
+static void uring_destroy(struct uring* ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+
+	close(ring->fd);
+	free(ring->buffers);
+	free(ring);
+}
 
-			unsigned int r;
-retry:
-#if defined(__linux__)
-			getrandom(&r, sizeof(r), 0);
-#elif defined(__FreeBSD__)
-			arc4random_buf(&r, sizeof(r));
-#else
-			r = (unsigned int)rand();
-#endif
-			char* tmp = talloc_asprintf(root, "%s/.tmp%08X~", dir, r);
+static struct io_uring_sqe* uring_get_sqe(struct uring* ring)
+{
+	if (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+		uring_submit(ring, 0);
 
-			bool linked = false;
-			for (struct path_entry* spath = ordered[0]->paths; spath; spath = spath->next)
-			{
-				if (link(spath->path, tmp) == -1)
-				{
-					if (errno == EEXIST)
-					{
-						talloc_free(tmp);
-						goto retry;
-					}
+	unsigned int index = ring->tail & ring->sq_mask;
+	ring->sq_array[index] = index;
+	++ring->tail;
+	++ring->queued;
 
-					perror(spath->path);
-				}
-				else
-				{
-					linked = true;
-					break;
-				}
-			}
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
 
-			if (linked)
-			{
-				if (rename(tmp, dpath->path) == -1)
-				{
-					perror(tmp);
-					unlink(tmp);
-				}
-				else
-				{
-					++state->relinked_count;
-					state->relinked_size += ordered[0]->buffer.st_size;
-				}
-			}
+static int uring_submit(struct uring* ring, unsigned int wait)
+{
+	__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
 
-			talloc_free(tmp);
-			talloc_free(dir);
-		}
-	}
+	int result;
+	do
+		result = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	while (result == -1 && errno == EINTR);
 
-	talloc_free(root);
+	if (result >= 0)
+		ring->queued -= result < ring->queued ? result : ring->queued;
+
+	return result;
 }
 
-static int relink_sortcb(const void* p1, const void* p2)
+static struct io_uring_cqe* uring_peek(struct uring* ring)
 {
-	struct inode_entry
-		*inode0 = *((struct inode_entry* const*)p1),
-		*inode1 = *((struct inode_entry* const*)p2);
+	unsigned int head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
 
-	struct timespec
-		*mt0 = &inode0->buffer.st_mtim,
-		*mt1 = &inode1->buffer.st_mtim;
+	return &ring->cqes[head & ring->cq_mask];
+}
 
-	if (mt0->tv_sec < mt1->tv_sec)
-		return -1;
-	else if (mt0->tv_sec > mt1->tv_sec)
-		return 1;
-	else if (mt0->tv_nsec < mt1->tv_nsec)
-		return -1;
-	else if (mt0->tv_nsec > mt1->tv_nsec)
-		return 1;
-	else if (inode0->buffer.st_ino < inode1->buffer.st_ino)
-		return -1;
-	else if (inode0->buffer.st_ino > inode1->buffer.st_ino)
-		return 1;
-	else
-		return 0;
+static void uring_advance(struct uring* ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
 }
+#endif
 
-static void print_progress(struct dedupe_state* state, const char* status, size_t count, size_t max, unsigned long long size, unsigned long long total)
+// Counts the given reads and waits until both buckets can cover them, so that
+// a run during working hours leaves the disks some room for everyone else.
+static void throttle(struct dedupe_state* state, unsigned long long bytes, unsigned long long ops)
 {
-	if (!state->verbose)
+	__atomic_add_fetch(&state->read_size, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(bytes ? &state->read_count : &state->stat_count, ops, __ATOMIC_RELAXED);
+
+	if (!state->bandwidth.rate && !state->iops.rate)
 		return;
 
 	struct timespec ts;
 	clock_gettime(CLOCK_MONOTONIC, &ts);
+	double now = ts.tv_sec + ts.tv_nsec / 1e9;
 
-	if (state->last == ts.tv_sec)
-		return;
+	pthread_mutex_lock(&state->lock);
+	double wait = throttle_take(&state->bandwidth, now, bytes);
+	double wait_iops = throttle_take(&state->iops, now, ops);
+	pthread_mutex_unlock(&state->lock);
 
-	if (state->tty)
+	if (wait_iops > wait)
+		wait = wait_iops;
+
+	if (wait > 0)
 	{
-		fputs("\e[u\e[J", stdout);
+		ts.tv_sec = wait;
+		ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+		nanosleep(&ts, NULL);
+	}
+}
 
-		if (total)
-		{
-			unsigned long long cmax = (state->width >= 3 ? state->width - 3 : 1);
-			unsigned long long ccount = (size * cmax) / total;
-			unsigned long long cncount = cmax - ccount;
+// Refills the bucket by the time passed, keeping at most a tenth of a second
+// worth, and takes the amount out of it. The bucket may go into debt so that
+// requests larger than that still go through; the returned time pays it off.
+// Threads that come later wait for the debt of those before them too.
+static double throttle_take(struct throttle* bucket, double now, double amount)
+{
+	if (!bucket->rate)
+		return 0;
 
-			char* buf0 = alloca(ccount + 1);
-			memset(buf0, 0x7C, ccount);
-			buf0[ccount] = 0;
+	bucket->tokens += bucket->last ? (now - bucket->last) * bucket->rate : bucket->rate / 10;
+	if (bucket->tokens > bucket->rate / 10)
+		bucket->tokens = bucket->rate / 10;
 
-			char* buf1 = alloca(cncount + 1);
-			memset(buf1, 0x20, cncount);
-			buf1[cncount] = 0;
+	bucket->last = now;
+	bucket->tokens -= amount;
+	return bucket->tokens < 0 ? -bucket->tokens / bucket->rate : 0;
+}
 
-			printf("\e[0;1m[\e[0;32;42m%s\e[0m%s\e[1m]\e[0m\n", buf0, buf1);
-		}
+static void inode_from_stat(struct inode_entry* inode, const struct stat* buffer)
+{
+	memset(inode, 0, sizeof(struct inode_entry));
+	inode->dev = buffer->st_dev;
+	inode->ino = buffer->st_ino;
+	inode->size = buffer->st_size;
+	inode->mtime = buffer->st_mtim;
+	inode->ctime = buffer->st_ctim;
+	inode->nlink = buffer->st_nlink;
+	inode->blocks = buffer->st_blocks;
+}
 
-		if (max)
-			printf("\e[0;1m[%zu/%zu]\e[0m ", count, max);
-		else
-			printf("\e[0;1m[%c]\e[0m ", "-\\|/"[ts.tv_sec & 3]);
+static void* arena_alloc(struct arena* arena, size_t size)
+{
+	size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
 
-		printf("%s\n", status);
-	}
-	else
+	if (size > arena->left)
 	{
-		if (max)
-			printf("[%zu/%zu] ", count, max);
-		if (total)
-			printf("[%llu/%llu] ", size, total);
+		size_t block = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
 
-		printf("%s\n", status);
+		if (arena->lock)
+			pthread_mutex_lock(arena->lock);
+		arena->next = talloc_size(arena, block);
+		if (arena->lock)
+			pthread_mutex_unlock(arena->lock);
+
+		arena->left = block;
 	}
 
-	state->last = ts.tv_sec;
-	fflush(stdout);
+	void* result = arena->next;
+	arena->next += size;
+	arena->left -= size;
+	return result;
 }
 
-static void print_summary(struct dedupe_state* state)
+static size_t path_length(struct dir_entry* dir, const char* name)
 {
-	if (!state->verbose)
-		return;
-
-	if (!state->relinked_count)
-		return;
-
-	printf(
-		state->tty ?
-			"\e[1mPerformed \e[32m%zu\e[39m relink%s, saved \e[32m%llu\e[39m bytes.\e[0m\n" :
-			"Performed %zu relink%s, saved %llu bytes.\n",
-		state->relinked_count,
-		state->relinked_count > 1 ? "s" : "",
-		state->relinked_size);
+	size_t result = name ? strlen(name) + 1 : 0;
+	for (; dir; dir = dir->parent)
+		result += strlen(dir->name) + 1;
+	return result - 1;
 }
 
-static struct hash_map* hash_map_create(void* ctx, const struct hash_descriptor* descriptor, size_t expected)
+static void path_fill(char* buffer, size_t length, struct dir_entry* dir, const char* name)
 {
-	struct hash_map* result = talloc(ctx, struct hash_map);
-	result->descriptor = descriptor;
-	result->item_count = 0;
-	result->bucket_count = next_prime(expected);
-	result->buckets = talloc_zero_array(result, struct hash_bucket*, result->bucket_count);
-	return result;
-}
+	buffer[length] = 0;
 
-static struct hash_bucket* hash_map_insert(struct hash_map* map, void* key)
-{
-	size_t hash = map->descriptor->hash_function(key);
-	size_t bucket = hash % map->bucket_count;
+	if (name)
+	{
+		size_t size = strlen(name);
+		length -= size;
+		memcpy(buffer + length, name, size);
+		if (dir)
+			buffer[--length] = '/';
+	}
 
-	struct hash_bucket* result;
-	for (result = map->buckets[bucket]; result; result = result->next)
+	for (; dir; dir = dir->parent)
 	{
-		if (map->descriptor->equal_function(result->key, key))
-			break;
+		size_t size = strlen(dir->name);
+		length -= size;
+		memcpy(buffer + length, dir->name, size);
+		if (dir->parent)
+			buffer[--length] = '/';
 	}
+}
 
-	if (!result)
+static bool path_format(char* buffer, size_t size, struct dir_entry* dir, const char* name)
+{
+	size_t length = path_length(dir, name);
+	if (length >= size)
 	{
-		result = talloc_zero(map->buckets, struct hash_bucket);
-		result->next = map->buckets[bucket];
-		result->key = key;
-		++map->item_count;
-		map->buckets[bucket] = result;
+		snprintf(buffer, size, "%s", name);
+		errno = ENAMETOOLONG;
+		return false;
 	}
 
-	hash_map_rehash(map);
-	return result;
+	path_fill(buffer, length, dir, name);
+	return true;
 }
 
-static void hash_map_rehash(struct hash_map* map)
+static char* path_build(void* ctx, struct dir_entry* dir, const char* name)
 {
-	if ((map->item_count / 2) <= map->bucket_count)
-		return;
-
-	size_t bucket_count_old = map->bucket_count;
-	map->bucket_count = next_prime(map->item_count * 2);
+	size_t length = path_length(dir, name);
+	char* result = talloc_size(ctx, length + 1);
+	path_fill(result, length, dir, name);
+	return result;
+}
 
-	struct hash_bucket** buckets_old = map->buckets;
-	map->buckets = talloc_zero_array(map, struct hash_bucket*, map->bucket_count);
+// Returns an fd for the directory from the calling thread's cache, or -1
+// after printing why it couldn't be opened.
+static int dir_open(struct dir_entry* dir)
+{
+	struct dir_cache* cache = &dir_thread;
+	for (size_t i = 0; i < dir_limit; ++i)
+	{
+		struct dir_fd* slot = &cache->fds[i];
+		if (slot->dir == dir)
+		{
+			slot->used = ++cache->tick;
+			return slot->fd;
+		}
+	}
 
-	for (size_t bucket_old = 0; bucket_old < bucket_count_old; ++bucket_old)
+	// Opens the directory relative to its closest cached ancestor, one level
+	// at a time, so that a miss usually costs a single lookup rather than a
+	// walk of the whole path. The ancestor counts as the newest entry while
+	// this goes on, so that dir_evict leaves it open, and gets its own age
+	// back afterwards.
+	struct dir_fd* anchor = NULL;
+	size_t depth = 0;
+	for (struct dir_entry* base = dir->parent; base && !anchor; base = base->parent)
 	{
-		struct hash_bucket* next;
-		for (struct hash_bucket* current = buckets_old[bucket_old]; current; current = next)
+		for (size_t i = 0; i < dir_limit && !anchor; ++i)
 		{
-			next = current->next;
+			if (cache->fds[i].dir == base)
+				anchor = &cache->fds[i];
+		}
+
+		depth += !anchor;
+	}
 
-			size_t hash = map->descriptor->hash_function(current->key);
-			size_t bucket = hash % map->bucket_count;
+	int top = anchor ? anchor->fd : AT_FDCWD, fd = top;
+	unsigned long long used = anchor ? anchor->used : 0;
+	if (anchor)
+		anchor->used = ++cache->tick;
 
-			talloc_steal(map->buckets, current);
-			current->next = map->buckets[bucket];
-			map->buckets[bucket] = current;
+	for (size_t level = depth + 1; level-- > 0;)
+	{
+		struct dir_entry* entry = dir;
+		for (size_t i = 0; i < level; ++i)
+			entry = entry->parent;
+
+		int next;
+		while ((next = openat(fd, entry->name, O_RDONLY|O_CLOEXEC|O_DIRECTORY)) == -1 && dir_evict());
+		if (next == -1)
+		{
+			char dpath[PATH_MAX];
+			int error = errno;
+			path_format(dpath, PATH_MAX, entry->parent, entry->name);
+			errno = error;
+			perror(dpath);
 		}
+
+		if (fd != top)
+			close(fd);
+		fd = next;
+		if (fd == -1)
+			break;
 	}
 
-	talloc_free(buckets_old);
-}
+	if (anchor)
+		anchor->used = used;
+	if (fd == -1)
+		return -1;
 
-static void hash_map_walk(struct hash_map* map, void* context, void(*cb)(void*, struct hash_bucket*))
-{
-	for (size_t bucket = 0; bucket < map->bucket_count; ++bucket)
+	struct dir_fd* slot = &cache->fds[0];
+	for (size_t i = 1; i < dir_limit; ++i)
 	{
-		for (struct hash_bucket* current = map->buckets[bucket]; current; current = current->next)
-			cb(context, current);
+		if (cache->fds[i].used < slot->used)
+			slot = &cache->fds[i];
 	}
-}
-
-static size_t hash_ptr_hash(void* p)
-{
-	return (size_t)p;
-}
 
-static bool hash_ptr_equals(void* p1, void* p2)
-{
-	return p1 == p2;
-}
+	if (slot->dir)
+		close(slot->fd);
 
-static size_t hash_digest_hash(void* p)
-{
-	size_t result = 0;
-	for (size_t *current = p, *end = ((size_t*)p) + (SHA256_DIGEST_LENGTH / sizeof(size_t)); current < end; ++current)
-		result ^= *current;
-	return result;
+	slot->dir = dir;
+	slot->fd = fd;
+	slot->used = ++cache->tick;
+	return fd;
 }
 
-static bool hash_digest_equals(void* p1, void* p2)
+// Closes the least recently used directory after running out of descriptors,
+// as the caches of all threads together may hold most of them. The last two
+// stay open, since callers may still be using them.
+static bool dir_evict(void)
 {
-	return !memcmp(p1, p2, SHA256_DIGEST_LENGTH);
-}
+	if (errno != EMFILE && errno != ENFILE)
+		return false;
 
-// https://stackoverflow.com/a/5694432 impl #5
-static bool is_prime(size_t x)
-{
-	size_t o = 4;
-	for (size_t i = 5; 1; i += o)
+	struct dir_cache* cache = &dir_thread;
+	struct dir_fd* slot = NULL;
+	size_t count = 0;
+	for (size_t i = 0; i < dir_limit; ++i)
 	{
-		size_t q = x / i;
-		if (q < i)
-			return true;
-		if (x == q * i)
-			return false;
-		o ^= 6;
+		struct dir_fd* other = &cache->fds[i];
+		if (!other->dir)
+			continue;
+
+		++count;
+		if (!slot || other->used < slot->used)
+			slot = other;
 	}
 
+	if (count <= 2)
+		return false;
+
+	close(slot->fd);
+	slot->dir = NULL;
+	slot->used = 0;
 	return true;
 }
 
-static size_t next_prime(size_t x)
+// Closes the directories of the calling thread, which may be renamed or
+// removed before it opens them again.
+static void dir_release(void)
 {
-	switch (x)
+	struct dir_cache* cache = &dir_thread;
+	for (size_t i = 0; i < dir_limit; ++i)
 	{
-		case 0:
-		case 1:
-		case 2:
-			return 2;
-		case 3:
-			return 3;
-		case 4:
-		case 5:
-			return 5;
+		if (cache->fds[i].dir)
+			close(cache->fds[i].fd);
+		cache->fds[i].dir = NULL;
+		cache->fds[i].used = 0;
 	}
+	cache->tick = 0;
+}
 
-	size_t k = x / 6;
-	size_t i = x - 6 * k;
-	size_t o = i < 2 ? 1 : 5;
-
-	x = 6 * k + o;
-	for (i = (3 + o) / 2; !is_prime(x); x += i)
-		i ^= 6;
-
-	return x;
+static size_t next_power_of_two(size_t x)
+{
+	size_t result = 16;
+	while (result < x)
+		result *= 2;
+	return result;
 }
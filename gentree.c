@@ -0,0 +1,372 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <getopt.h>
+#include <math.h>
+
+#define WRITE_BUFFER_SIZE 0x10000
+#define GENTREE_MARKER ".gentree"
+
+// What each written file was made of, so that duplicates and hardlinks can
+// refer back to files written before them without keeping their content.
+struct file_entry
+{
+	unsigned long long seed;
+	unsigned long long size;
+	char* path;
+};
+
+struct gentree_options
+{
+	const char* root;
+	unsigned long long count;
+	unsigned long long min_size;
+	unsigned long long max_size;
+	double duplicates;
+	double hardlinks;
+	double same_size;
+	unsigned int depth;
+	unsigned int fanout;
+	unsigned long long seed;
+};
+
+static unsigned long long random_state;
+
+static int parse_cmdline(struct gentree_options*, int, char**);
+static void print_usage(const char*);
+static unsigned long long random_next(unsigned long long*);
+static double random_unit(void);
+static unsigned long long random_size(const struct gentree_options*);
+static char* random_dir(const struct gentree_options*);
+static bool make_dirs(char*);
+static bool write_file(const char*, unsigned long long, unsigned long long);
+
+int main(int argc, char** argv)
+{
+	struct gentree_options options =
+	{
+		NULL, 10000, 1024, 1024 * 1024, 0.3, 0.05, 0.1, 4, 8, 1
+	};
+
+	if (parse_cmdline(&options, argc, argv))
+		return 1;
+
+	random_state = options.seed;
+	if (mkdir(options.root, 0755) == -1 && errno != EEXIST)
+	{
+		perror(options.root);
+		return 1;
+	}
+
+	// Marks the directory as generated, so that scripts know it is safe to
+	// delete and write again.
+	char marker[PATH_MAX];
+	snprintf(marker, PATH_MAX, "%s/" GENTREE_MARKER, options.root);
+	if (!write_file(marker, 0, 0))
+		return 1;
+
+	struct file_entry* files = calloc(options.count, sizeof(struct file_entry));
+	if (!files)
+	{
+		perror("calloc");
+		return 1;
+	}
+
+	unsigned long long total = 0, duplicates = 0, hardlinks = 0, same_size = 0;
+	for (unsigned long long i = 0; i < options.count; ++i)
+	{
+		struct file_entry* file = &files[i];
+		char* dir = random_dir(&options);
+		if (!dir || !make_dirs(dir))
+			return 1;
+
+		size_t length = strlen(dir) + 32;
+		file->path = malloc(length);
+		if (!file->path)
+		{
+			perror("malloc");
+			return 1;
+		}
+
+		snprintf(file->path, length, "%s/f%llu", dir, i);
+		free(dir);
+
+		// Earlier files are picked from uniformly, so popular contents end up
+		// with a few copies each rather than all of them on the first file.
+		double choice = random_unit();
+		struct file_entry* earlier = i ? &files[random_next(&random_state) % i] : NULL;
+		if (earlier && choice < options.hardlinks)
+		{
+			*file = (struct file_entry){ earlier->seed, earlier->size, file->path };
+			if (link(earlier->path, file->path) == -1)
+			{
+				perror(file->path);
+				return 1;
+			}
+
+			++hardlinks;
+			continue;
+		}
+
+		if (earlier && (choice -= options.hardlinks) < options.duplicates)
+		{
+			file->seed = earlier->seed;
+			file->size = earlier->size;
+			++duplicates;
+		}
+		else if (earlier && (choice -= options.duplicates) < options.same_size)
+		{
+			file->seed = random_next(&random_state);
+			file->size = earlier->size;
+			++same_size;
+		}
+		else
+		{
+			file->seed = random_next(&random_state);
+			file->size = random_size(&options);
+		}
+
+		if (!write_file(file->path, file->seed, file->size))
+			return 1;
+		total += file->size;
+	}
+
+	printf(
+		"Wrote %llu files, %llu bytes: %llu duplicates, %llu hardlinks and %llu of the same size as another.\n",
+		options.count, total, duplicates, hardlinks, same_size);
+
+	for (unsigned long long i = 0; i < options.count; ++i)
+		free(files[i].path);
+	free(files);
+	return 0;
+}
+
+static int parse_cmdline(struct gentree_options* options, int argc, char** argv)
+{
+	static const struct option long_options[] =
+	{
+		{"count", required_argument, NULL, 'n'},
+		{"min-size", required_argument, NULL, 's'},
+		{"max-size", required_argument, NULL, 'S'},
+		{"duplicates", required_argument, NULL, 'u'},
+		{"hardlinks", required_argument, NULL, 'l'},
+		{"same-size", required_argument, NULL, 'c'},
+		{"depth", required_argument, NULL, 'd'},
+		{"fanout", required_argument, NULL, 'f'},
+		{"seed", required_argument, NULL, 'r'},
+		{"help", no_argument, NULL, 'h'},
+		{}
+	};
+
+	int result, index;
+	while ((result = getopt_long(argc, argv, "n:s:S:u:l:c:d:f:r:h?", long_options, &index)) != -1)
+	{
+		switch (result)
+		{
+			case 'n':
+				options->count = strtoull(optarg, NULL, 0);
+				break;
+			case 's':
+				options->min_size = strtoull(optarg, NULL, 0);
+				break;
+			case 'S':
+				options->max_size = strtoull(optarg, NULL, 0);
+				break;
+			case 'u':
+				options->duplicates = strtod(optarg, NULL);
+				break;
+			case 'l':
+				options->hardlinks = strtod(optarg, NULL);
+				break;
+			case 'c':
+				options->same_size = strtod(optarg, NULL);
+				break;
+			case 'd':
+				options->depth = strtoul(optarg, NULL, 0);
+				break;
+			case 'f':
+				options->fanout = strtoul(optarg, NULL, 0);
+				break;
+			case 'r':
+				options->seed = strtoull(optarg, NULL, 0);
+				break;
+			case 'h':
+			case '?':
+				print_usage(argv[0]);
+				return 1;
+			default:
+				return 1;
+		}
+	}
+
+	if (optind != argc - 1)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+	options->root = argv[optind];
+
+	if (options->min_size > options->max_size || !options->fanout ||
+		options->duplicates < 0 || options->hardlinks < 0 || options->same_size < 0 ||
+		options->duplicates + options->hardlinks + options->same_size > 1)
+	{
+		fprintf(stderr, "%s: sizes must be ascending and ratios must add up to at most 1\n", argv[0]);
+		return 1;
+	}
+
+	if (!options->seed)
+		options->seed = 1;
+
+	return 0;
+}
+
+static void print_usage(const char* name)
+{
+	printf(
+		"Usage:\n"
+		"  %s [options] directory\n"
+		"\n"
+		"Writes a reproducible tree of files to deduplicate into the directory.\n"
+		"\n"
+		"Options:\n"
+		"  -n, --count N     Write N files, 10000 by default.\n"
+		"  -s, --min-size SIZE\n"
+		"                    Make files at least SIZE bytes, 1024 by default.\n"
+		"  -S, --max-size SIZE\n"
+		"                    Make files at most SIZE bytes, 1048576 by default. Sizes\n"
+		"                    in between are spread evenly on a logarithmic scale.\n"
+		"  -u, --duplicates RATIO\n"
+		"                    Copy RATIO of the files from earlier ones, 0.3 by default.\n"
+		"  -l, --hardlinks RATIO\n"
+		"                    Hardlink RATIO of the files to earlier ones, 0.05 by default.\n"
+		"  -c, --same-size RATIO\n"
+		"                    Give RATIO of the files the size of an earlier one but\n"
+		"                    different content, 0.1 by default.\n"
+		"  -d, --depth N     Nest directories up to N levels deep, 4 by default.\n"
+		"  -f, --fanout N    Spread files over N subdirectories per level, 8 by default.\n"
+		"  -r, --seed N      Seed the generator with N, 1 by default.\n"
+		"  -h, -?, --help    Show program usage.\n"
+		"\n",
+		name);
+}
+
+// xorshift64*, which is plenty for filling files and needs no state beyond
+// one word per stream.
+static unsigned long long random_next(unsigned long long* state)
+{
+	unsigned long long x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double random_unit(void)
+{
+	return (random_next(&random_state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static unsigned long long random_size(const struct gentree_options* options)
+{
+	double low = log((double)options->min_size + 1), high = log((double)options->max_size + 1);
+	unsigned long long size = (unsigned long long)exp(low + (high - low) * random_unit()) - 1;
+	if (size < options->min_size)
+		size = options->min_size;
+	if (size > options->max_size)
+		size = options->max_size;
+	return size;
+}
+
+static char* random_dir(const struct gentree_options* options)
+{
+	char* dir = malloc(PATH_MAX);
+	if (!dir)
+	{
+		perror("malloc");
+		return NULL;
+	}
+
+	size_t length = snprintf(dir, PATH_MAX, "%s", options->root);
+	unsigned int depth = random_next(&random_state) % (options->depth + 1);
+	for (unsigned int i = 0; i < depth && length < PATH_MAX; ++i)
+		length += snprintf(dir + length, PATH_MAX - length, "/d%llu", random_next(&random_state) % options->fanout);
+
+	return dir;
+}
+
+static bool make_dirs(char* dir)
+{
+	for (char* p = dir + 1; ; ++p)
+	{
+		if (*p && *p != '/')
+			continue;
+
+		char c = *p;
+		*p = 0;
+		bool success = mkdir(dir, 0755) != -1 || errno == EEXIST;
+		if (!success)
+			perror(dir);
+		*p = c;
+
+		if (!success)
+			return false;
+		if (!c)
+			return true;
+	}
+}
+
+static bool write_file(const char* path, unsigned long long seed, unsigned long long size)
+{
+	int fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		perror(path);
+		return false;
+	}
+
+	static unsigned long long buffer[WRITE_BUFFER_SIZE / sizeof(unsigned long long)];
+	unsigned long long state = seed | 1;
+	for (unsigned long long offset = 0; offset < size;)
+	{
+		for (size_t i = 0; i < WRITE_BUFFER_SIZE / sizeof(unsigned long long); ++i)
+			buffer[i] = random_next(&state);
+
+		size_t length = size - offset < WRITE_BUFFER_SIZE ? size - offset : WRITE_BUFFER_SIZE;
+		ssize_t written = write(fd, buffer, length);
+		if (written == -1 && errno == EINTR)
+			continue;
+
+		if (written == -1)
+		{
+			perror(path);
+			close(fd);
+			return false;
+		}
+
+		// Resuming mid-buffer would shift the content of duplicates.
+		if ((size_t)written != length)
+		{
+			fprintf(stderr, "%s: short write\n", path);
+			close(fd);
+			return false;
+		}
+
+		offset += written;
+	}
+
+	if (close(fd) == -1)
+	{
+		perror(path);
+		return false;
+	}
+
+	return true;
+}